@@ -0,0 +1,49 @@
+#pragma once
+
+#include <chrono>
+#include <cstddef>
+#include <cstdio>
+#include <cstdlib>
+
+namespace Bench
+{
+    // Makes the compiler assume value, and anything reachable through it, is read here, so work whose result is never
+    // used can't be optimized away.
+    template<typename T>
+    inline void KeepAlive(const T& value)
+    {
+        asm volatile("" : : "r"(&value) : "memory");
+    }
+
+    // Runs f iterations times per run and returns the fastest run's time per iteration, in nanoseconds.
+    template<typename F>
+    double BestNanos(size_t iterations, F&& f, int runs = 5)
+    {
+        double best = 0.0;
+        for (int run = 0; run < runs; run++)
+        {
+            auto start = std::chrono::steady_clock::now();
+            for (size_t i = 0; i < iterations; i++)
+            {
+                f(i);
+            }
+            std::chrono::duration<double, std::nano> elapsed = std::chrono::steady_clock::now() - start;
+            double nanos = elapsed.count() / double(iterations);
+            if (run == 0 || nanos < best)
+            {
+                best = nanos;
+            }
+        }
+        return best;
+    }
+
+    // Benches check that what they compare gives the same results, and fail the ctest run if it doesn't.
+    inline void Check(bool ok, const char* what)
+    {
+        if (!ok)
+        {
+            std::fprintf(stderr, "check failed: %s\n", what);
+            std::exit(1);
+        }
+    }
+} // namespace Bench
@@ -0,0 +1,158 @@
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <string>
+#include <string_view>
+#include <utility>
+#include <variant>
+#include <vector>
+
+#include "nlohmann/json.hpp"
+
+#include "AllocationCounter.hpp"
+#include "Bench.hpp"
+#include "BitStream.hpp"
+#include "ControlMessage.hpp"
+
+namespace
+{
+    const size_t PLAYERS = 200;
+    const size_t ITERATIONS = 2000;
+
+    // The Connected a player gets on joining a full server, built the way message.rs's test builds it.
+    ControlMessage::Connected MakeConnected()
+    {
+        ControlMessage::Connected connected{
+            .id = 7,
+            .features = { "delta", "short_keyframes", "redundancy", "binary" },
+            .players = {},
+        };
+        for (size_t i = 0; i < PLAYERS; i++)
+        {
+            connected.players.push_back(ControlMessage::PlayerInfo{
+                .id = uint16_t(i),
+                .color = { uint8_t(i), 127, 255 },
+                .name = "Player " + std::to_string(i),
+            });
+        }
+        return connected;
+    }
+
+    std::string ToJson(const ControlMessage::Connected& connected)
+    {
+        nlohmann::json players = nlohmann::json::array();
+        for (const auto& player : connected.players)
+        {
+            players.push_back({ { "id", player.id }, { "color", player.color }, { "name", player.name } });
+        }
+        nlohmann::json j = {
+            { "type", "Connected" },
+            { "id", connected.id },
+            { "players", players },
+            { "features", connected.features },
+        };
+        return j.dump();
+    }
+
+    // the client never sends a Connected, so there's no encoder for one in ControlMessage.hpp
+    std::string ToBinary(const ControlMessage::Connected& connected)
+    {
+        size_t len = 5 + 2;
+        for (const auto& feature : connected.features)
+        {
+            len += 2 + feature.size();
+        }
+        for (const auto& player : connected.players)
+        {
+            len += 7 + player.name.size();
+        }
+        std::string message(len, '\0');
+        BitStream::BitWriter writer(reinterpret_cast<uint8_t*>(message.data()), message.size());
+        auto write_string = [&writer](const std::string& s)
+        {
+            writer.write_big_endian(s.size(), 2);
+            for (char c : s)
+            {
+                writer.write_big_endian(uint8_t(c), 1);
+            }
+        };
+        writer.write_big_endian(uint8_t(ControlMessage::ServerType::Connected), 1);
+        writer.write_big_endian(connected.id, 2);
+        writer.write_big_endian(connected.features.size(), 2);
+        for (const auto& feature : connected.features)
+        {
+            write_string(feature);
+        }
+        writer.write_big_endian(connected.players.size(), 2);
+        for (const auto& player : connected.players)
+        {
+            writer.write_big_endian(player.id, 2);
+            for (uint8_t channel : player.color)
+            {
+                writer.write_big_endian(channel, 1);
+            }
+            write_string(player.name);
+        }
+        Bench::Check(!writer.overflowed(), "binary Connected fits");
+        return message;
+    }
+
+    bool Same(const ControlMessage::Connected& a, const ControlMessage::Connected& b)
+    {
+        if (a.id != b.id || a.features != b.features || a.players.size() != b.players.size())
+        {
+            return false;
+        }
+        for (size_t i = 0; i < a.players.size(); i++)
+        {
+            const auto& pa = a.players[i];
+            const auto& pb = b.players[i];
+            if (pa.id != pb.id || pa.color != pb.color || pa.name != pb.name)
+            {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    // Times decode, returning nanoseconds per decode and how many heap allocations one makes.
+    template<typename F>
+    std::pair<double, uint64_t> Time(F&& decode)
+    {
+        uint64_t before = AllocationCounter::Get();
+        Bench::KeepAlive(decode());
+        uint64_t allocations = AllocationCounter::Get() - before;
+        double nanos = Bench::BestNanos(ITERATIONS, [&](size_t) { Bench::KeepAlive(decode()); });
+        return { nanos, allocations };
+    }
+} // namespace
+
+// Decodes the Connected for a 200 player roster as JSON and as binary, checks that both give the same roster and that
+// the binary decoder rejects every truncation of it, then times both and counts their allocations.
+int main()
+{
+    auto expected = MakeConnected();
+    std::string json = ToJson(expected);
+    std::string binary = ToBinary(expected);
+
+    auto from_json = ControlMessage::ParseJson(json);
+    auto from_binary = ControlMessage::ReadBinary(binary);
+    Bench::Check(from_json && std::holds_alternative<ControlMessage::Connected>(*from_json), "JSON decodes");
+    Bench::Check(from_binary && std::holds_alternative<ControlMessage::Connected>(*from_binary), "binary decodes");
+    Bench::Check(Same(std::get<ControlMessage::Connected>(*from_json), expected), "JSON round trips");
+    Bench::Check(Same(std::get<ControlMessage::Connected>(*from_binary), expected), "binary round trips");
+    for (size_t cut = 0; cut < binary.size(); cut++)
+    {
+        Bench::Check(!ControlMessage::ReadBinary(std::string_view(binary).substr(0, cut)), "truncations are rejected");
+    }
+
+    auto [json_nanos, json_allocations] = Time([&] { return ControlMessage::ParseJson(json); });
+    auto [binary_nanos, binary_allocations] = Time([&] { return ControlMessage::ReadBinary(binary); });
+    std::printf("%zu players\n", PLAYERS);
+    std::printf("JSON:   %6zu bytes, %8.0f ns, %4llu allocations\n", json.size(), json_nanos,
+        (unsigned long long)json_allocations);
+    std::printf("binary: %6zu bytes, %8.0f ns, %4llu allocations\n", binary.size(), binary_nanos,
+        (unsigned long long)binary_allocations);
+    return 0;
+}
@@ -0,0 +1,157 @@
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <vector>
+
+#include "AllocationCounter.hpp"
+#include "Bench.hpp"
+#include "Interpolation.hpp"
+#include "PacketLayout.hpp"
+#include "Rotation.hpp"
+#include "StateBatch.hpp"
+#include "StateBuffer.hpp"
+
+namespace
+{
+    const size_t GHOSTS = 64;
+    const size_t MAX_STATES = 20;
+    const size_t STATES_PER_PACKET = PacketLayout::MAX_DATAGRAM_LEN / StateBatch::RECORD_LEN;
+    // the location fields are written straight into an array of FST_PlayerInfo, which is 9 doubles long
+    const size_t STRIDE = 9;
+    const size_t FRAMES = 1000;
+
+    // a ghost's state as Client.cpp keeps it
+    struct State
+    {
+        std::array<double, 3> location;
+        uint32_t zone;
+        uint32_t millis;
+        Rotation::Quat orientation;
+    };
+
+    struct Frame
+    {
+        std::array<StateBuffer::StateBuffer<State, MAX_STATES>, GHOSTS> ghosts{};
+        std::array<StateBatch::DecodedState, STATES_PER_PACKET> decoded{};
+        Interpolation::Batch<GHOSTS> batch{};
+        std::array<double, GHOSTS * STRIDE> out{};
+    };
+
+    // Full-state packets from every ghost moving along, one packet's worth of states per frame.
+    std::vector<std::vector<uint8_t>> MakePackets()
+    {
+        std::vector<std::vector<uint8_t>> packets;
+        size_t sent = 0;
+        for (size_t frame = 0; frame < FRAMES; frame++)
+        {
+            std::vector<uint8_t> packet(STATES_PER_PACKET * StateBatch::RECORD_LEN);
+            BitStream::BitWriter writer(packet.data(), packet.size());
+            for (size_t i = 0; i < STATES_PER_PACKET; i++, sent++)
+            {
+                uint8_t id = uint8_t(sent % GHOSTS);
+                uint32_t millis = uint32_t(1000 + sent / GHOSTS * 33);
+                double x = double(sent / GHOSTS) * 10.0 + id;
+                StateBatch::Header::write(writer, id, millis);
+                StateBatch::Body::write(writer, 7, x, -x, 100.0, 0.0, double(sent % 360) - 180.0, 45.0);
+            }
+            Bench::Check(!writer.overflowed(), "packets fit");
+            packets.push_back(std::move(packet));
+        }
+        return packets;
+    }
+
+    // What a frame does with the header-only parts of the mod: decode a packet and give its states to their ghosts,
+    // then interpolate every ghost for this frame.
+    void RunFrame(Frame& frame, const std::vector<uint8_t>& packet, uint32_t millis)
+    {
+        size_t count = packet.size() / StateBatch::RECORD_LEN;
+        StateBatch::Decode(packet.data(), count, frame.decoded.data());
+        for (size_t i = 0; i < count; i++)
+        {
+            const auto& d = frame.decoded[i];
+            auto& states = frame.ghosts[d.id];
+            if (!states.can_insert(d.millis))
+            {
+                continue;
+            }
+            states.insert(State
+            {
+                .location = d.location,
+                .zone = d.zone,
+                .millis = d.millis,
+                .orientation = Rotation::FromRotator(d.rotation[0], d.rotation[1], d.rotation[2]),
+            });
+        }
+
+        size_t n = 0;
+        for (const auto& states : frame.ghosts)
+        {
+            size_t i = states.lower_bound(millis);
+            if (i == 0 || i == states.size())
+            {
+                continue;
+            }
+            const State& from = states[i - 1];
+            const State& to = states[i];
+            frame.batch.span[n] = double(to.millis - from.millis);
+            frame.batch.elapsed[n] = double(millis - from.millis);
+            frame.batch.from_x[n] = from.location[0];
+            frame.batch.from_y[n] = from.location[1];
+            frame.batch.from_z[n] = from.location[2];
+            frame.batch.to_x[n] = to.location[0];
+            frame.batch.to_y[n] = to.location[1];
+            frame.batch.to_z[n] = to.location[2];
+            frame.batch.from_tx[n] = frame.batch.to_tx[n] = to.location[0] - from.location[0];
+            frame.batch.from_ty[n] = frame.batch.to_ty[n] = to.location[1] - from.location[1];
+            frame.batch.from_tz[n] = frame.batch.to_tz[n] = to.location[2] - from.location[2];
+            double pct = frame.batch.elapsed[n] / frame.batch.span[n];
+            auto orientation = Rotation::Slerp(from.orientation, to.orientation, pct);
+            double* out = &frame.out[n * STRIDE];
+            Rotation::ToRotator(orientation, out[3], out[4], out[5]);
+            n++;
+        }
+        Interpolation::Interpolate(frame.batch, n, frame.out.data(), STRIDE);
+    }
+} // namespace
+
+// Runs the header-only part of the frame path for FRAMES frames of 64 ghosts and fails if any of them allocates. The
+// rest of the frame path, in Client.cpp, needs UE4SS; in the mod, the SyncInfo hook only logs frames that allocate, and
+// only when it's built with PM_COUNT_ALLOCATIONS.
+int main()
+{
+    auto packets = MakePackets();
+    static Frame frame;
+    // ghosts are shown a few states behind the newest, like the playout delay does
+    auto millis_at = [](size_t i) { return uint32_t(1000 + (i * STATES_PER_PACKET / GHOSTS) * 33 - 100); };
+
+    uint64_t before = AllocationCounter::Get();
+    for (size_t i = 0; i < FRAMES; i++)
+    {
+        RunFrame(frame, packets[i], millis_at(i));
+    }
+    uint64_t allocations = AllocationCounter::Get() - before;
+    Bench::KeepAlive(frame.out);
+    std::printf("%zu frames of %zu ghosts made %llu heap allocation(s)\n", FRAMES, GHOSTS,
+        (unsigned long long)allocations);
+    Bench::Check(allocations == 0, "frames don't allocate");
+
+    for (auto& states : frame.ghosts)
+    {
+        states.clear();
+    }
+    double nanos = Bench::BestNanos(FRAMES, [&](size_t i)
+    {
+        if (i == 0)
+        {
+            for (auto& states : frame.ghosts)
+            {
+                states.clear();
+            }
+        }
+        RunFrame(frame, packets[i], millis_at(i));
+        Bench::KeepAlive(frame.out);
+    });
+    std::printf("%.0f ns per frame\n", nanos);
+    return 0;
+}
@@ -0,0 +1,95 @@
+#include <array>
+#include <cmath>
+#include <cstddef>
+#include <cstdio>
+#include <random>
+
+#include "Bench.hpp"
+#include "Interpolation.hpp"
+
+namespace
+{
+    const size_t MAX_GHOSTS = 255;
+    // the location fields are written straight into an array of FST_PlayerInfo, which is 9 doubles long
+    const size_t STRIDE = 9;
+
+    Interpolation::Batch<MAX_GHOSTS> MakeBatch()
+    {
+        std::mt19937 rng(3);
+        std::uniform_real_distribution<double> location(-20000.0, 20000.0);
+        std::uniform_real_distribution<double> velocity(-2.0, 2.0);
+        Interpolation::Batch<MAX_GHOSTS> batch{};
+        for (size_t i = 0; i < MAX_GHOSTS; i++)
+        {
+            // some ghosts have a single state, and some are past their newest one
+            batch.span[i] = i % 16 == 0 ? 0.0 : 33.0;
+            batch.elapsed[i] = double(rng() % 50);
+            batch.from_x[i] = location(rng);
+            batch.from_y[i] = location(rng);
+            batch.from_z[i] = location(rng);
+            batch.to_x[i] = batch.from_x[i] + velocity(rng) * 33.0;
+            batch.to_y[i] = batch.from_y[i] + velocity(rng) * 33.0;
+            batch.to_z[i] = batch.from_z[i] + velocity(rng) * 33.0;
+            batch.from_tx[i] = velocity(rng) * batch.span[i];
+            batch.from_ty[i] = velocity(rng) * batch.span[i];
+            batch.from_tz[i] = velocity(rng) * batch.span[i];
+            batch.to_tx[i] = velocity(rng) * batch.span[i];
+            batch.to_ty[i] = velocity(rng) * batch.span[i];
+            batch.to_tz[i] = velocity(rng) * batch.span[i];
+        }
+        return batch;
+    }
+
+    void InterpolateScalar(const Interpolation::Batch<MAX_GHOSTS>& batch, size_t n, double* out)
+    {
+        for (size_t i = 0; i < n; i++)
+        {
+            Interpolation::Detail::InterpolateScalar(batch, i, out + i * STRIDE);
+        }
+    }
+} // namespace
+
+// Times a frame's interpolation of 22, 64 and 255 ghosts with the batched kernel, built for whatever instruction set
+// this target enables, against the scalar formula one ghost at a time. Both have to agree to within rounding.
+int main()
+{
+#if defined(__AVX2__)
+    if (!__builtin_cpu_supports("avx2"))
+    {
+        std::printf("skipped: this cpu doesn't support AVX2\n");
+        return 0;
+    }
+    const char* kernel = "AVX2";
+#elif defined(__SSE2__)
+    const char* kernel = "SSE2";
+#else
+    const char* kernel = "scalar";
+#endif
+
+    static const auto batch = MakeBatch();
+    static std::array<double, MAX_GHOSTS * STRIDE> batched{};
+    static std::array<double, MAX_GHOSTS * STRIDE> scalar{};
+    for (size_t n : { size_t(22), size_t(64), MAX_GHOSTS })
+    {
+        Interpolation::Interpolate(batch, n, batched.data(), STRIDE);
+        InterpolateScalar(batch, n, scalar.data());
+        for (size_t i = 0; i < n * STRIDE; i++)
+        {
+            Bench::Check(std::abs(batched[i] - scalar[i]) <= 1e-6, "batched kernel matches the scalar formula");
+        }
+
+        double batched_nanos = Bench::BestNanos(20000, [&](size_t)
+        {
+            Interpolation::Interpolate(batch, n, batched.data(), STRIDE);
+            Bench::KeepAlive(batched);
+        });
+        double scalar_nanos = Bench::BestNanos(20000, [&](size_t)
+        {
+            InterpolateScalar(batch, n, scalar.data());
+            Bench::KeepAlive(scalar);
+        });
+        std::printf("%3zu ghosts: %s %.0f ns per frame, scalar %.0f ns per frame\n", n, kernel, batched_nanos,
+            scalar_nanos);
+    }
+    return 0;
+}
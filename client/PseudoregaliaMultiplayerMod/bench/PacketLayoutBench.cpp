@@ -0,0 +1,203 @@
+#include <array>
+#include <bit>
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+
+#include "Bench.hpp"
+#include "StateBatch.hpp"
+
+namespace
+{
+    const size_t STATES = PacketLayout::MAX_DATAGRAM_LEN / StateBatch::RECORD_LEN;
+    typedef std::array<uint8_t, STATES * StateBatch::RECORD_LEN> Packet;
+
+    struct State
+    {
+        uint8_t id;
+        uint32_t millis;
+        uint32_t zone;
+        std::array<double, 3> location;
+        std::array<double, 3> rotation;
+    };
+
+    // The Serialize and Deserialize helpers that the layouts replaced, as they were in Client.cpp: one field at a time
+    // at a moving offset.
+    namespace HandWritten
+    {
+        void SerializeU8(uint8_t src, Packet& buf, size_t& pos)
+        {
+            buf[pos] = src;
+            pos += 1;
+        }
+
+        void SerializeU32(uint32_t src, Packet& buf, size_t& pos)
+        {
+            buf[pos + 3] = uint8_t(src);
+            for (int i = 2; i >= 0; i--)
+            {
+                src >>= 8;
+                buf[pos + i] = uint8_t(src);
+            }
+            pos += 4;
+        }
+
+        void SerializeLocator(double src, Packet& buf, size_t& pos)
+        {
+            SerializeU32(std::bit_cast<uint32_t>(float(src)), buf, pos);
+        }
+
+        void SerializeRotator(double src, Packet& buf, size_t& pos)
+        {
+            SerializeU8(uint8_t((src + 180.0) * 256.0 / 360.0), buf, pos);
+        }
+
+        uint8_t DeserializeU8(const Packet& buf, size_t& pos)
+        {
+            uint8_t result = buf[pos];
+            pos += 1;
+            return result;
+        }
+
+        uint32_t DeserializeU32(const Packet& buf, size_t& pos)
+        {
+            uint32_t result = buf[pos];
+            for (int i = 1; i < 4; i++)
+            {
+                result <<= 8;
+                result |= buf[pos + i];
+            }
+            pos += 4;
+            return result;
+        }
+
+        double DeserializeLocator(const Packet& buf, size_t& pos)
+        {
+            return double(std::bit_cast<float>(DeserializeU32(buf, pos)));
+        }
+
+        double DeserializeRotator(const Packet& buf, size_t& pos)
+        {
+            return double(DeserializeU8(buf, pos)) * 360.0 / 256.0 - 180.0;
+        }
+
+        [[gnu::noinline]] void Write(const std::array<State, STATES>& states, Packet& packet)
+        {
+            size_t pos = 0;
+            for (const auto& s : states)
+            {
+                SerializeU8(s.id, packet, pos);
+                SerializeU32(s.millis, packet, pos);
+                SerializeU32(s.zone, packet, pos);
+                SerializeLocator(s.location[0], packet, pos);
+                SerializeLocator(s.location[1], packet, pos);
+                SerializeLocator(s.location[2], packet, pos);
+                SerializeRotator(s.rotation[0], packet, pos);
+                SerializeRotator(s.rotation[1], packet, pos);
+                SerializeRotator(s.rotation[2], packet, pos);
+            }
+        }
+
+        [[gnu::noinline]] void Read(const Packet& packet, std::array<State, STATES>& states)
+        {
+            size_t pos = 0;
+            for (auto& s : states)
+            {
+                s.id = DeserializeU8(packet, pos);
+                s.millis = DeserializeU32(packet, pos);
+                s.zone = DeserializeU32(packet, pos);
+                s.location = { DeserializeLocator(packet, pos), DeserializeLocator(packet, pos),
+                    DeserializeLocator(packet, pos) };
+                s.rotation = { DeserializeRotator(packet, pos), DeserializeRotator(packet, pos),
+                    DeserializeRotator(packet, pos) };
+            }
+        }
+    } // namespace HandWritten
+
+    namespace Layouts
+    {
+        [[gnu::noinline]] void Write(const std::array<State, STATES>& states, Packet& packet)
+        {
+            BitStream::BitWriter writer(packet.data(), packet.size());
+            for (const auto& s : states)
+            {
+                StateBatch::Header::write(writer, s.id, s.millis);
+                StateBatch::Body::write(writer, s.zone, s.location[0], s.location[1], s.location[2], s.rotation[0],
+                    s.rotation[1], s.rotation[2]);
+            }
+        }
+
+        [[gnu::noinline]] void Read(const Packet& packet, std::array<State, STATES>& states)
+        {
+            BitStream::BitReader reader(packet.data(), packet.size());
+            for (auto& s : states)
+            {
+                std::tie(s.id, s.millis) = StateBatch::Header::read(reader);
+                std::tie(s.zone, s.location[0], s.location[1], s.location[2], s.rotation[0], s.rotation[1],
+                    s.rotation[2]) = StateBatch::Body::read(reader);
+            }
+        }
+    } // namespace Layouts
+
+    bool Same(const std::array<State, STATES>& a, const std::array<State, STATES>& b)
+    {
+        for (size_t i = 0; i < STATES; i++)
+        {
+            if (a[i].id != b[i].id || a[i].millis != b[i].millis || a[i].zone != b[i].zone
+                || a[i].location != b[i].location || a[i].rotation != b[i].rotation)
+            {
+                return false;
+            }
+        }
+        return true;
+    }
+} // namespace
+
+// Times writing and reading a full 21 state packet with the state layouts against the hand-written helpers they
+// replaced, both called through non-inlined functions like the client does. The bytes and states have to match.
+int main()
+{
+    std::array<State, STATES> states{};
+    for (size_t i = 0; i < STATES; i++)
+    {
+        states[i] = State
+        {
+            .id = uint8_t(i * 11),
+            .millis = uint32_t(100000 + i * 33),
+            .zone = uint32_t(0x9e3779b9u * i),
+            .location = { 1.5 * double(i) - 7000.25, -2.25 * double(i), 1000.0 + double(i) },
+            .rotation = { -170.0 + double(i), 3.0 * double(i), 90.0 },
+        };
+    }
+
+    Packet hand_packet{};
+    Packet layout_packet{};
+    HandWritten::Write(states, hand_packet);
+    Layouts::Write(states, layout_packet);
+    Bench::Check(hand_packet == layout_packet, "layouts write the same bytes");
+    std::array<State, STATES> hand_states{};
+    std::array<State, STATES> layout_states{};
+    HandWritten::Read(hand_packet, hand_states);
+    Layouts::Read(layout_packet, layout_states);
+    Bench::Check(Same(hand_states, layout_states), "layouts read the same states");
+
+    const size_t iterations = 200000;
+    double hand_nanos = Bench::BestNanos(iterations, [&](size_t i)
+    {
+        states[0].millis = uint32_t(i);
+        HandWritten::Write(states, hand_packet);
+        HandWritten::Read(hand_packet, hand_states);
+        Bench::KeepAlive(hand_states);
+    });
+    double layout_nanos = Bench::BestNanos(iterations, [&](size_t i)
+    {
+        states[0].millis = uint32_t(i);
+        Layouts::Write(states, layout_packet);
+        Layouts::Read(layout_packet, layout_states);
+        Bench::KeepAlive(layout_states);
+    });
+    std::printf("%zu states written and read: layouts %.0f ns, hand-written %.0f ns\n", STATES, layout_nanos,
+        hand_nanos);
+    return 0;
+}
@@ -0,0 +1,234 @@
+#include <array>
+#include <bit>
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <iterator>
+#include <random>
+#include <vector>
+
+#include "Bench.hpp"
+#include "StateBatch.hpp"
+
+namespace
+{
+    const size_t MAX_STATES = PacketLayout::MAX_DATAGRAM_LEN / StateBatch::RECORD_LEN;
+    const size_t RECV = MAX_STATES * StateBatch::RECORD_LEN;
+
+    // a packet the way Client.cpp gets it, in a receive buffer
+    struct Packet
+    {
+        std::array<uint8_t, RECV> buf;
+        size_t len;
+    };
+
+    // The per-state decode that Client.cpp used before StateBatch, with its helpers as they were: one field at a time
+    // at a moving offset. DecodePacket skipped states it was going to drop, but it decoded every state a batch is
+    // timed with here.
+    namespace Original
+    {
+        uint8_t DeserializeU8(const std::array<uint8_t, RECV>& buf, size_t& pos)
+        {
+            uint8_t result = buf[pos];
+            pos += 1;
+            return result;
+        }
+
+        uint32_t DeserializeU32(const std::array<uint8_t, RECV>& buf, size_t& pos)
+        {
+            uint32_t result = buf[pos];
+            for (int i = 1; i < 4; i++)
+            {
+                result <<= 8;
+                result |= buf[pos + i];
+            }
+            pos += 4;
+            return result;
+        }
+
+        float DeserializeF32(const std::array<uint8_t, RECV>& buf, size_t& pos)
+        {
+            uint32_t bits = DeserializeU32(buf, pos);
+            return std::bit_cast<float>(bits);
+        }
+
+        double DeserializeLocator(const std::array<uint8_t, RECV>& buf, size_t& pos)
+        {
+            return double(DeserializeF32(buf, pos));
+        }
+
+        double DequantizeRotator(uint8_t byte)
+        {
+            return double(byte) * 360.0 / 256.0 - 180.0;
+        }
+
+        double DeserializeRotator(const std::array<uint8_t, RECV>& buf, size_t& pos)
+        {
+            return DequantizeRotator(DeserializeU8(buf, pos));
+        }
+
+        void Decode(const Packet& packet, StateBatch::DecodedState* out)
+        {
+            size_t pos = 0;
+            size_t num_updates = packet.len / StateBatch::RECORD_LEN;
+            for (size_t i = 0; i < num_updates; i++)
+            {
+                StateBatch::DecodedState& state = out[i];
+                state.id = DeserializeU8(packet.buf, pos);
+                state.millis = DeserializeU32(packet.buf, pos);
+                state.zone = DeserializeU32(packet.buf, pos);
+                state.location[0] = DeserializeLocator(packet.buf, pos);
+                state.location[1] = DeserializeLocator(packet.buf, pos);
+                state.location[2] = DeserializeLocator(packet.buf, pos);
+                state.rotation[0] = DeserializeRotator(packet.buf, pos);
+                state.rotation[1] = DeserializeRotator(packet.buf, pos);
+                state.rotation[2] = DeserializeRotator(packet.buf, pos);
+            }
+        }
+    } // namespace Original
+
+    uint32_t ReadU32(const uint8_t* p, bool swapped)
+    {
+        uint32_t value;
+        std::memcpy(&value, p, 4);
+        return swapped ? __builtin_bswap32(value) : value;
+    }
+
+    // Returns the UDP payloads in a pcap file that are full-state packets, ie a whole number of 24 byte states. Reads
+    // ethernet, linux cooked and raw IPv4 captures, like tcpdump -i lo -w capture.pcap udp port 23432 makes.
+    std::vector<Packet> ReadCapture(const char* path)
+    {
+        std::ifstream file(path, std::ios::binary);
+        std::vector<uint8_t> bytes{ std::istreambuf_iterator<char>(file), std::istreambuf_iterator<char>() };
+        Bench::Check(bytes.size() >= 24, "capture has a pcap header");
+        uint32_t magic = ReadU32(bytes.data(), false);
+        bool swapped = magic == 0xd4c3b2a1 || magic == 0x4d3cb2a1;
+        Bench::Check(swapped || magic == 0xa1b2c3d4 || magic == 0xa1b23c4d, "capture is a pcap file");
+        uint32_t link_type = ReadU32(bytes.data() + 20, swapped);
+        size_t link_len = link_type == 1 ? 14 : link_type == 113 ? 16 : link_type == 101 ? 0 : SIZE_MAX;
+        Bench::Check(link_len != SIZE_MAX, "capture is ethernet, linux cooked or raw IP");
+
+        std::vector<Packet> packets;
+        for (size_t pos = 24; pos + 16 <= bytes.size();)
+        {
+            size_t len = ReadU32(bytes.data() + pos + 8, swapped);
+            const uint8_t* frame = bytes.data() + pos + 16;
+            pos += 16 + len;
+            if (pos > bytes.size() || len < link_len + 28)
+            {
+                continue;
+            }
+            const uint8_t* ip = frame + link_len;
+            size_t ip_len = size_t(ip[0] & 0xf) * 4;
+            if ((ip[0] >> 4) != 4 || ip[9] != 17 || len < link_len + ip_len + 8)
+            {
+                continue;
+            }
+            const uint8_t* payload = ip + ip_len + 8;
+            size_t payload_len = len - link_len - ip_len - 8;
+            size_t count = payload_len / StateBatch::RECORD_LEN;
+            if (count == 0 || count > MAX_STATES || payload_len % StateBatch::RECORD_LEN != 0)
+            {
+                continue;
+            }
+            Packet& packet = packets.emplace_back(Packet{ .buf = {}, .len = payload_len });
+            std::memcpy(packet.buf.data(), payload, payload_len);
+        }
+        return packets;
+    }
+
+    // Packets like the server sends when there's no capture to read: players moving around a few zones, with full
+    // range ids and floats.
+    std::vector<Packet> MakePackets()
+    {
+        std::mt19937 rng(16);
+        std::uniform_real_distribution<double> location(-20000.0, 20000.0);
+        std::vector<Packet> packets;
+        for (size_t i = 0; i < 20000; i++)
+        {
+            Packet packet{ .buf = {}, .len = (1 + i % MAX_STATES) * StateBatch::RECORD_LEN };
+            BitStream::BitWriter writer(packet.buf.data(), packet.len);
+            for (size_t j = 0; j < packet.len / StateBatch::RECORD_LEN; j++)
+            {
+                auto rotation = [&rng] { return double(rng() % 360) - 180.0; };
+                StateBatch::Header::write(writer, uint8_t(rng()), uint32_t(100000 + rng() % 1000));
+                StateBatch::Body::write(writer, uint32_t(0x9e3779b9u * (rng() % 6)), location(rng), location(rng),
+                    location(rng), rotation(), rotation(), rotation());
+            }
+            packets.push_back(std::move(packet));
+        }
+        return packets;
+    }
+
+    // compares the doubles bit for bit, so a NaN in a capture matches itself
+    bool Same(const StateBatch::DecodedState& a, const StateBatch::DecodedState& b)
+    {
+        return a.id == b.id && a.millis == b.millis && a.zone == b.zone
+            && std::memcmp(a.location.data(), b.location.data(), sizeof(a.location)) == 0
+            && std::memcmp(a.rotation.data(), b.rotation.data(), sizeof(a.rotation)) == 0;
+    }
+
+    typedef void (*Decoder)(const Packet&, StateBatch::DecodedState*);
+
+    // Each StateBatch path, called the way DecodePacket calls StateBatch::Decode.
+    template<void (*DECODE)(const uint8_t*, size_t, StateBatch::DecodedState*)>
+    void Batch(const Packet& packet, StateBatch::DecodedState* out)
+    {
+        DECODE(packet.buf.data(), packet.len / StateBatch::RECORD_LEN, out);
+    }
+
+    // Checks the decoder gives exactly what the original decode does for every packet, and returns its best time per
+    // packet.
+    double Time(Decoder decode, const std::vector<Packet>& packets)
+    {
+        std::array<StateBatch::DecodedState, MAX_STATES> expected{};
+        std::array<StateBatch::DecodedState, MAX_STATES> decoded{};
+        for (const auto& packet : packets)
+        {
+            Original::Decode(packet, expected.data());
+            decode(packet, decoded.data());
+            for (size_t i = 0; i < packet.len / StateBatch::RECORD_LEN; i++)
+            {
+                Bench::Check(Same(expected[i], decoded[i]), "decoder matches the original decode");
+            }
+        }
+        return Bench::BestNanos(packets.size(), [&](size_t i)
+        {
+            decode(packets[i], decoded.data());
+            Bench::KeepAlive(decoded);
+        });
+    }
+} // namespace
+
+// Decodes captured full-state packets, from the pcap file given as the only argument, with the original per-state
+// decode and every StateBatch path the cpu supports, and times each. Without a capture it makes up packets of every
+// size. captures/states.pcap has a second of a local server's replies to 8 players moving around two zones.
+int main(int argc, char** argv)
+{
+    std::vector<Packet> packets = argc > 1 ? ReadCapture(argv[1]) : MakePackets();
+    Bench::Check(!packets.empty(), "there are full-state packets to decode");
+    size_t states = 0;
+    for (const auto& packet : packets)
+    {
+        states += packet.len / StateBatch::RECORD_LEN;
+    }
+    std::printf("%zu %s packets, %.1f states per packet\n", packets.size(), argc > 1 ? "captured" : "generated",
+        double(states) / double(packets.size()));
+
+    std::printf("original: %.1f ns per packet\n", Time(Original::Decode, packets));
+    std::printf("scalar: %.1f ns per packet\n", Time(Batch<StateBatch::DecodeScalar>, packets));
+#if defined(STATE_BATCH_X86)
+    if (__builtin_cpu_supports("ssse3"))
+    {
+        std::printf("SSSE3: %.1f ns per packet\n", Time(Batch<StateBatch::DecodeSsse3>, packets));
+    }
+    if (__builtin_cpu_supports("avx2"))
+    {
+        std::printf("AVX2: %.1f ns per packet\n", Time(Batch<StateBatch::DecodeAvx2>, packets));
+    }
+#endif
+    std::printf("selected path: %ls\n", StateBatch::PathName(StateBatch::SelectedPath()));
+    return 0;
+}
@@ -0,0 +1,157 @@
+#include <algorithm>
+#include <array>
+#include <cstdint>
+#include <cstdio>
+#include <iterator>
+#include <list>
+#include <random>
+#include <utility>
+#include <vector>
+
+#include "Bench.hpp"
+#include "StateBuffer.hpp"
+
+namespace
+{
+    // about the size of a ghost's State in Client.cpp
+    struct Sample
+    {
+        uint32_t millis;
+        std::array<double, 10> payload{};
+    };
+
+    const size_t MAX_STATES = 20;
+
+    // The std::list history that StateBuffer replaced, kept sorted by millis with the oldest dropped once it's full.
+    class ListHistory
+    {
+    public:
+        bool can_insert(uint32_t millis) const
+        {
+            for (const auto& s : _states)
+            {
+                if (s.millis == millis)
+                {
+                    return false;
+                }
+            }
+            return _states.size() < MAX_STATES || _states.front().millis < millis;
+        }
+
+        void insert(const Sample& s)
+        {
+            auto it = _states.end();
+            while (it != _states.begin() && std::prev(it)->millis > s.millis)
+            {
+                it--;
+            }
+            _states.insert(it, s);
+            if (_states.size() > MAX_STATES)
+            {
+                _states.pop_front();
+            }
+        }
+
+        // the state the old get_closest interpolated towards: the first one at or after millis
+        const Sample* at_or_after(uint32_t millis) const
+        {
+            for (const auto& s : _states)
+            {
+                if (s.millis >= millis)
+                {
+                    return &s;
+                }
+            }
+            return nullptr;
+        }
+
+        const std::list<Sample>& states() const
+        {
+            return _states;
+        }
+
+    private:
+        std::list<Sample> _states;
+    };
+
+    // States sent every 33 ms, each delayed by up to jitter ms on the way, so any within jitter of each other can
+    // arrive out of order, and 5% of them lost.
+    std::vector<uint32_t> Arrivals(size_t count, uint32_t jitter)
+    {
+        std::mt19937 rng(1);
+        std::vector<std::pair<uint32_t, uint32_t>> arrivals;
+        for (size_t i = 0; i < count; i++)
+        {
+            uint32_t millis = uint32_t(1000 + i * 33);
+            if (rng() % 20 != 0)
+            {
+                arrivals.emplace_back(millis + rng() % (jitter + 1), millis);
+            }
+        }
+        std::stable_sort(arrivals.begin(), arrivals.end());
+        std::vector<uint32_t> millis;
+        for (const auto& [arrived, sent] : arrivals)
+        {
+            millis.push_back(sent);
+        }
+        return millis;
+    }
+} // namespace
+
+// Feeds a ghost's states into both histories in the order they arrive, looking up where the ghost is after each one
+// like a frame does, and times both.
+int main()
+{
+    for (uint32_t jitter : { 0u, 50u, 200u })
+    {
+        std::vector<uint32_t> arrivals = Arrivals(100000, jitter);
+
+        StateBuffer::StateBuffer<Sample, MAX_STATES> buffer;
+        ListHistory list;
+        for (uint32_t millis : arrivals)
+        {
+            Bench::Check(buffer.can_insert(millis) == list.can_insert(millis), "can_insert matches the list");
+            if (buffer.can_insert(millis))
+            {
+                buffer.insert(Sample{ .millis = millis });
+                list.insert(Sample{ .millis = millis });
+            }
+            size_t i = 0;
+            for (const auto& s : list.states())
+            {
+                Bench::Check(buffer[i++].millis == s.millis, "buffer holds the same states as the list");
+            }
+        }
+
+        size_t n = arrivals.size();
+        double buffer_nanos = Bench::BestNanos(n, [&](size_t i)
+        {
+            if (i == 0)
+            {
+                buffer.clear();
+            }
+            uint32_t millis = arrivals[i];
+            if (buffer.can_insert(millis))
+            {
+                buffer.insert(Sample{ .millis = millis });
+            }
+            Bench::KeepAlive(buffer.lower_bound(millis - 100));
+        });
+        double list_nanos = Bench::BestNanos(n, [&](size_t i)
+        {
+            if (i == 0)
+            {
+                list = ListHistory();
+            }
+            uint32_t millis = arrivals[i];
+            if (list.can_insert(millis))
+            {
+                list.insert(Sample{ .millis = millis });
+            }
+            Bench::KeepAlive(list.at_or_after(millis - 100));
+        });
+        std::printf("jitter %3u ms: StateBuffer %.1f ns per state, std::list %.1f ns per state\n", jitter, buffer_nanos,
+            list_nanos);
+    }
+    return 0;
+}
@@ -7,6 +7,7 @@
 #include "Unreal/UFunction.hpp"
 #include "Unreal/World.hpp"
 
+#include "AllocationCounter.hpp"
 #include "Client.hpp"
 #include "Logger.hpp"
 #include "Settings.hpp"
@@ -16,6 +17,14 @@ class PseudoregaliaMultiplayerMod : public RC::CppUserModBase
 public:
     bool sync_items_hooked = false;
 
+    struct UpdateGhostsParams
+    {
+        RC::Unreal::FScriptArray ghost_info_raw;
+        RC::Unreal::TArray<uint8_t> to_remove;
+    };
+    // reused every frame so the arrays can keep their allocations
+    static inline UpdateGhostsParams update_ghosts_params{};
+
     PseudoregaliaMultiplayerMod() : CppUserModBase()
     {
         ModName = STR("PseudoregaliaMultiplayerMod");
@@ -64,17 +73,23 @@ public:
 
     static void sync_info(RC::Unreal::UnrealScriptFunctionCallableContext& context, void* customdata)
     {
+        auto allocations = AllocationCounter::Get();
+
         const auto& player_info = context.GetParams<FST_PlayerInfo>();
         auto millis = Client::SetPlayerInfo(player_info);
 
-        struct UpdateGhostsParams
+        auto& params = update_ghosts_params;
+        auto newly_spawned = Client::GetGhostInfo(millis, params.ghost_info_raw, params.to_remove);
+
+        // spawning ghosts copies their names, and the arrays may still be growing when ghosts are added or removed,
+        // but any other frame shouldn't allocate at all
+        if (newly_spawned == 0 && params.to_remove.Num() == 0 && AllocationCounter::Get() != allocations)
         {
-            RC::Unreal::FScriptArray ghost_info_raw;
-            RC::Unreal::TArray<uint8_t> to_remove;
-        };
-        auto params = std::make_unique<UpdateGhostsParams>();
-        Client::GetGhostInfo(millis, params->ghost_info_raw, params->to_remove);
-        if (params->ghost_info_raw.Num() == 0 && params->to_remove.Num() == 0)
+            Log(L"Frame made " + std::to_wstring(AllocationCounter::Get() - allocations) + L" heap allocation(s)",
+                LogType::Warning);
+        }
+
+        if (params.ghost_info_raw.Num() == 0 && params.to_remove.Num() == 0)
         {
             return;
         }
@@ -85,7 +100,7 @@ public:
             Log(L"Could not find function \"UpdateGhosts\" in \"BP_PM_Manager_C\"", LogType::Error);
             return;
         }
-        context.Context->ProcessEvent(update_ghosts, params.get());
+        context.Context->ProcessEvent(update_ghosts, &params);
     }
 
     static void nop(RC::Unreal::UnrealScriptFunctionCallableContext& context, void* customdata)
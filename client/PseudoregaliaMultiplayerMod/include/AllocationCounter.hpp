@@ -0,0 +1,10 @@
+#pragma once
+
+#include <cstdint>
+
+namespace AllocationCounter
+{
+    // Returns the number of heap allocations the calling thread has made through operator new. Counting is only done
+    // when the mod is built with PM_COUNT_ALLOCATIONS; otherwise this always returns 0.
+    uint64_t Get();
+}
@@ -0,0 +1,296 @@
+#pragma once
+
+#include <algorithm>
+#include <bit>
+#include <cstddef>
+#include <cstdint>
+
+namespace BitStream
+{
+    // Writes values of up to 64 bits into a byte buffer with no padding between them. Bits are filled least
+    // significant first, both within each value and within each byte. A value that doesn't fit in the rest of the
+    // buffer sets overflowed and isn't written, so a whole packet can be written before checking once.
+    class BitWriter
+    {
+    public:
+        BitWriter(uint8_t* data, size_t capacity) : _data(data), _capacity(capacity) {}
+
+        void write(uint64_t value, unsigned bits)
+        {
+            if (reserve(bits))
+            {
+                put(value, bits);
+            }
+        }
+
+        // Writes the low bytes bytes of value, most significant first.
+        void write_big_endian(uint32_t value, unsigned bytes)
+        {
+            if (reserve(bytes * 8))
+            {
+                put_big_endian(value, bytes);
+            }
+        }
+
+        void write_bool(bool value)
+        {
+            write(value ? 1 : 0, 1);
+        }
+
+        // Writes value as a 6 bit length followed by that many bits, so small values take few bits. value must be
+        // less than 2^63.
+        void write_varbits(uint64_t value)
+        {
+            unsigned bits = unsigned(64 - std::countl_zero(value));
+            write(bits, 6);
+            write(value, bits);
+        }
+
+        // Writes value with write_varbits after zigzag encoding it, so small negative values take few bits too.
+        void write_signed(int64_t value)
+        {
+            write_varbits((uint64_t(value) << 1) ^ uint64_t(value >> 63));
+        }
+
+        // Returns whether there's room for bits more bits, setting overflowed if not. Writing several values after one
+        // reserve and the unchecked puts below saves checking each one.
+        bool reserve(size_t bits)
+        {
+            if (_bits + bits > _capacity * 8)
+            {
+                _overflowed = true;
+                return false;
+            }
+            return true;
+        }
+
+        // write without checking for room
+        void put(uint64_t value, unsigned bits)
+        {
+            if (_bits % 8 == 0 && bits % 8 == 0)
+            {
+                // whole bytes at a byte boundary are just stores
+                uint8_t* out = _data + _bits / 8;
+                for (unsigned i = 0; i < bits / 8; i++)
+                {
+                    out[i] = uint8_t(value >> (i * 8));
+                }
+                _bits += bits;
+                return;
+            }
+            // a byte at a time, or whatever's left of the current byte
+            while (bits > 0)
+            {
+                unsigned offset = unsigned(_bits % 8);
+                unsigned chunk = std::min(bits, 8 - offset);
+                auto mask = uint8_t(((1u << chunk) - 1) << offset);
+                uint8_t& byte = _data[_bits / 8];
+                byte = uint8_t((byte & ~mask) | ((uint32_t(value) << offset) & mask));
+                value >>= chunk;
+                bits -= chunk;
+                _bits += chunk;
+            }
+        }
+
+        // write_big_endian without checking for room. At a byte boundary, as the fixed size formats always are, this
+        // is just a store per byte.
+        void put_big_endian(uint32_t value, unsigned bytes)
+        {
+            if (_bits % 8 != 0)
+            {
+                for (int shift = int(bytes) * 8 - 8; shift >= 0; shift -= 8)
+                {
+                    put(uint8_t(value >> shift), 8);
+                }
+                return;
+            }
+            uint8_t* out = _data + _bits / 8;
+            _bits += bytes * 8;
+            // spelled out for the common sizes, since not every optimization level unrolls the loop
+            switch (bytes)
+            {
+            case 1:
+                out[0] = uint8_t(value);
+                return;
+            case 4:
+                out[0] = uint8_t(value >> 24);
+                out[1] = uint8_t(value >> 16);
+                out[2] = uint8_t(value >> 8);
+                out[3] = uint8_t(value);
+                return;
+            }
+            for (unsigned i = 0; i < bytes; i++)
+            {
+                out[i] = uint8_t(value >> ((bytes - 1 - i) * 8));
+            }
+        }
+
+        size_t bits() const
+        {
+            return _bits;
+        }
+
+        // Returns the byte the next write starts in. Anything written there directly must be followed by a skip
+        // past it.
+        uint8_t* cursor() const
+        {
+            return _data + _bits / 8;
+        }
+
+        // Moves past bits bits without writing them. They must have been reserved.
+        void skip(size_t bits)
+        {
+            _bits += bits;
+        }
+
+        // the bytes written so far, counting a partly written last byte
+        size_t bytes() const
+        {
+            return (_bits + 7) / 8;
+        }
+
+        bool overflowed() const
+        {
+            return _overflowed;
+        }
+
+    private:
+        uint8_t* _data;
+        size_t _capacity;
+        size_t _bits = 0;
+        bool _overflowed = false;
+    };
+
+    // Reads values written by a BitWriter. Reading past the end of the buffer sets overflowed, and that read and
+    // every one after it returns zero.
+    class BitReader
+    {
+    public:
+        BitReader(const uint8_t* data, size_t len) : _data(data), _len(len) {}
+
+        uint64_t read(unsigned bits)
+        {
+            return reserve(bits) ? take(bits) : 0;
+        }
+
+        uint32_t read_big_endian(unsigned bytes)
+        {
+            return reserve(bytes * 8) ? take_big_endian(bytes) : 0;
+        }
+
+        bool read_bool()
+        {
+            return read(1) != 0;
+        }
+
+        uint64_t read_varbits()
+        {
+            return read(unsigned(read(6)));
+        }
+
+        int64_t read_signed()
+        {
+            uint64_t value = read_varbits();
+            return int64_t(value >> 1) ^ -int64_t(value & 1);
+        }
+
+        void skip(size_t bits)
+        {
+            if (reserve(bits))
+            {
+                _bits += bits;
+            }
+        }
+
+        size_t bits() const
+        {
+            return _bits;
+        }
+
+        // Returns the byte the next read starts in.
+        const uint8_t* cursor() const
+        {
+            return _data + _bits / 8;
+        }
+
+        // Returns whether there are bits more bits to read. If not, sets overflowed and moves to the end so every
+        // later read fails too.
+        bool reserve(size_t bits)
+        {
+            if (_bits + bits > _len * 8)
+            {
+                _overflowed = true;
+                _bits = _len * 8;
+                return false;
+            }
+            return true;
+        }
+
+        // read without checking that there's enough left
+        uint64_t take(unsigned bits)
+        {
+            uint64_t value = 0;
+            if (_bits % 8 == 0 && bits % 8 == 0)
+            {
+                const uint8_t* in = _data + _bits / 8;
+                for (unsigned i = 0; i < bits / 8; i++)
+                {
+                    value |= uint64_t(in[i]) << (i * 8);
+                }
+                _bits += bits;
+                return value;
+            }
+            unsigned shift = 0;
+            while (shift < bits)
+            {
+                unsigned offset = unsigned(_bits % 8);
+                unsigned chunk = std::min(bits - shift, 8 - offset);
+                uint64_t part = (_data[_bits / 8] >> offset) & ((1u << chunk) - 1);
+                value |= part << shift;
+                shift += chunk;
+                _bits += chunk;
+            }
+            return value;
+        }
+
+        // read_big_endian without checking that there's enough left
+        uint32_t take_big_endian(unsigned bytes)
+        {
+            uint32_t value = 0;
+            if (_bits % 8 != 0)
+            {
+                for (unsigned i = 0; i < bytes; i++)
+                {
+                    value = (value << 8) | uint32_t(take(8));
+                }
+                return value;
+            }
+            const uint8_t* in = _data + _bits / 8;
+            _bits += bytes * 8;
+            // see BitWriter::put_big_endian
+            switch (bytes)
+            {
+            case 1:
+                return in[0];
+            case 4:
+                return uint32_t(in[0]) << 24 | uint32_t(in[1]) << 16 | uint32_t(in[2]) << 8 | in[3];
+            }
+            for (unsigned i = 0; i < bytes; i++)
+            {
+                value = (value << 8) | in[i];
+            }
+            return value;
+        }
+
+        bool overflowed() const
+        {
+            return _overflowed;
+        }
+
+    private:
+        const uint8_t* _data;
+        size_t _len;
+        size_t _bits = 0;
+        bool _overflowed = false;
+    };
+} // namespace BitStream
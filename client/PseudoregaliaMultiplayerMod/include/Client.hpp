@@ -1,10 +1,13 @@
 #pragma once
 
+#include <cstddef>
+#include <optional>
 #include <string>
 
 #include "Unreal/FScriptArray.hpp"
 #include "Unreal/TArray.hpp"
 
+#include "LinkStats.hpp"
 #include "ST_PlayerInfo.hpp"
 
 namespace Client
@@ -12,5 +15,10 @@ namespace Client
     void OnSceneLoad(std::wstring);
     void Tick();
     uint32_t SetPlayerInfo(const FST_PlayerInfo&);
-    void GetGhostInfo(const uint32_t&, RC::Unreal::FScriptArray&, RC::Unreal::TArray<uint8_t>&);
+    // Returns the number of ghosts that were newly spawned, ie the number of ghosts whose name was filled in. Ghosts
+    // are given to the bp mod by a slot rather than their player id, since the bp mod's ids are a byte.
+    size_t GetGhostInfo(const uint32_t&, RC::Unreal::FScriptArray&, RC::Unreal::TArray<uint8_t>&);
+    // Returns what's arrived so far of the states the server numbered for a connected player's ghost, or nothing if
+    // there's no such ghost. Only delta packets are numbered. Must be called on the game thread.
+    std::optional<LinkStats::Summary> GetLinkStats(uint16_t);
 }
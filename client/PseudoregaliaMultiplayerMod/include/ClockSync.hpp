@@ -0,0 +1,121 @@
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <optional>
+
+namespace ClockSync
+{
+    // Estimates the server's millisecond clock from a local one using ping/pong exchanges. Each exchange gives a
+    // sample of the offset between the clocks, assuming the pong took half the round trip to come back. Only the
+    // sample with the smallest round trip in a recent window is trusted, since queueing delay only ever adds to the
+    // round trip and skews the offset. The drift between the two clocks is measured from how far the trusted offset has
+    // moved since the session started, so the estimate stays accurate between exchanges.
+    class ClockSync
+    {
+    public:
+        // Adds the result of one exchange: the ping was sent at local millis sent, the server stamped the pong with
+        // server_millis, and the pong came back at local millis received.
+        void add_sample(uint32_t sent, uint32_t server_millis, uint32_t received)
+        {
+            if (received < sent)
+            {
+                return;
+            }
+
+            uint32_t rtt = received - sent;
+            uint32_t local_mid = sent + rtt / 2;
+            _samples[_next] = Sample{ .rtt = rtt, .local = local_mid, .offset = int64_t(server_millis) - local_mid };
+            _next = (_next + 1) % WINDOW;
+            _count = std::min(_count + 1, WINDOW);
+
+            // oldest to newest, so the newest wins a tie and the trusted sample never moves back in time
+            size_t oldest = _count == WINDOW ? _next : 0;
+            const Sample* best = &_samples[oldest];
+            for (size_t i = 1; i < _count; i++)
+            {
+                const Sample& sample = _samples[(oldest + i) % WINDOW];
+                if (sample.rtt <= best->rtt)
+                {
+                    best = &sample;
+                }
+            }
+
+            _best = *best;
+            if (_count == WINDOW && !_anchor)
+            {
+                _anchor = _best;
+            }
+            else if (_anchor && _best.local - _anchor->local >= MIN_DRIFT_SPAN)
+            {
+                // each trusted offset can be off by a few millis, so drift is measured against the first full window's
+                // trusted sample; the longer the session, the more precise it gets
+                double measured = double(_best.offset - _anchor->offset) / double(_best.local - _anchor->local);
+                _drift = std::clamp(measured, -MAX_DRIFT, MAX_DRIFT);
+            }
+            _synced = true;
+        }
+
+        // whether there has been at least one sample, ie whether to_server means anything yet
+        bool synced() const
+        {
+            return _synced;
+        }
+
+        // Returns the estimated server millis at local millis.
+        uint32_t to_server(uint32_t local) const
+        {
+            return uint32_t(int64_t(local) + Offset(local));
+        }
+
+        // the round trip of the sample currently trusted
+        uint32_t rtt() const
+        {
+            return _best.rtt;
+        }
+
+        // how many millis the server clock gains on the local clock per local milli
+        double drift() const
+        {
+            return _drift;
+        }
+
+        // how many samples it takes to fill the window, after which exchanges can be less frequent
+        static const size_t WINDOW = 16;
+
+        size_t size() const
+        {
+            return _count;
+        }
+
+    private:
+        struct Sample
+        {
+            uint32_t rtt;
+            // the local millis halfway through the exchange, when the server is assumed to have stamped the pong
+            uint32_t local;
+            // server millis minus local millis at local
+            int64_t offset;
+        };
+
+        // trusted samples closer together than this are too noisy to measure drift from
+        static const uint32_t MIN_DRIFT_SPAN = 60000;
+        // real clocks drift by tens of ppm; anything past this is a bad measurement
+        static constexpr double MAX_DRIFT = 0.001;
+
+        std::array<Sample, WINDOW> _samples{};
+        size_t _next = 0;
+        size_t _count = 0;
+        Sample _best{};
+        std::optional<Sample> _anchor;
+        double _drift = 0.0;
+        bool _synced = false;
+
+        int64_t Offset(uint32_t local) const
+        {
+            return _best.offset + int64_t(_drift * (double(local) - double(_best.local)));
+        }
+    };
+} // namespace ClockSync
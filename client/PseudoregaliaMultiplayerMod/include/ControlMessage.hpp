@@ -0,0 +1,183 @@
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <utility>
+#include <variant>
+#include <vector>
+
+#include "nlohmann/json.hpp"
+
+#include "BitStream.hpp"
+
+namespace ControlMessage
+{
+    // The messages the server sends over the WebSocket, or over the control channel with the UDP transport. They're
+    // the ones in server-message-schema.json, and come either as JSON or, if the server agreed to the "binary" feature,
+    // in the binary encoding below. Matches message.rs in the server.
+    struct PlayerInfo
+    {
+        uint16_t id;
+        std::array<uint8_t, 3> color;
+        std::string name;
+    };
+
+    struct Connected
+    {
+        uint16_t id;
+        std::vector<std::string> features;
+        std::vector<PlayerInfo> players;
+    };
+
+    struct PlayerJoined
+    {
+        PlayerInfo player;
+    };
+
+    struct PlayerLeft
+    {
+        uint16_t id;
+    };
+
+    typedef std::variant<Connected, PlayerJoined, PlayerLeft> ServerMessage;
+
+    // a binary message is its type and then its fields in order, big-endian. strings are a 16 bit length and then
+    // their bytes, and lists are a 16 bit count and then their items. JSON messages always start with '{', which is
+    // never a type
+    enum class ServerType : uint8_t
+    {
+        Connected = 0,
+        PlayerJoined = 1,
+        PlayerLeft = 2,
+    };
+    // Connect is always JSON, since the client doesn't know yet whether the server supports anything else
+    enum class ClientType : uint8_t
+    {
+        Subscribe = 1,
+    };
+
+    inline bool IsBinary(std::string_view message)
+    {
+        return !message.empty() && message.front() != '{';
+    }
+
+    // Decodes a binary message. Returns nothing if it's cut short or of a type this client doesn't know.
+    inline std::optional<ServerMessage> ReadBinary(std::string_view message)
+    {
+        BitStream::BitReader reader(reinterpret_cast<const uint8_t*>(message.data()), message.size());
+        auto read_string = [&reader]
+        {
+            size_t len = reader.read_big_endian(2);
+            if (!reader.reserve(len * 8))
+            {
+                return std::string();
+            }
+            std::string s(reinterpret_cast<const char*>(reader.cursor()), len);
+            reader.skip(len * 8);
+            return s;
+        };
+        auto read_player = [&reader, &read_string]
+        {
+            PlayerInfo player{};
+            player.id = uint16_t(reader.read_big_endian(2));
+            for (auto& channel : player.color)
+            {
+                channel = uint8_t(reader.read_big_endian(1));
+            }
+            player.name = read_string();
+            return player;
+        };
+
+        std::optional<ServerMessage> decoded;
+        switch (ServerType(reader.read_big_endian(1)))
+        {
+        case ServerType::Connected:
+        {
+            Connected connected{};
+            connected.id = uint16_t(reader.read_big_endian(2));
+            size_t features = reader.read_big_endian(2);
+            for (size_t i = 0; i < features && !reader.overflowed(); i++)
+            {
+                connected.features.push_back(read_string());
+            }
+            size_t players = reader.read_big_endian(2);
+            // every player takes at least 7 bytes, so a bad count can't reserve much more than the message holds
+            connected.players.reserve(std::min(players, message.size() / 7));
+            for (size_t i = 0; i < players && !reader.overflowed(); i++)
+            {
+                connected.players.push_back(read_player());
+            }
+            decoded = std::move(connected);
+            break;
+        }
+        case ServerType::PlayerJoined:
+            decoded = PlayerJoined{ read_player() };
+            break;
+        case ServerType::PlayerLeft:
+            decoded = PlayerLeft{ uint16_t(reader.read_big_endian(2)) };
+            break;
+        }
+        if (reader.overflowed())
+        {
+            return std::nullopt;
+        }
+        return decoded;
+    }
+
+    // Parses a JSON message. Returns nothing if it's of a type this client doesn't know, and throws if it isn't
+    // valid JSON or is missing a field.
+    inline std::optional<ServerMessage> ParseJson(const std::string& message)
+    {
+        nlohmann::json j = nlohmann::json::parse(message);
+        auto parse_player = [](const nlohmann::json& field_player)
+        {
+            const auto& field_color = field_player.at("color");
+            return PlayerInfo{
+                .id = field_player.at("id").template get<uint16_t>(),
+                .color = { field_color.at(0).template get<uint8_t>(), field_color.at(1).template get<uint8_t>(),
+                    field_color.at(2).template get<uint8_t>() },
+                .name = field_player.at("name").template get<std::string>(),
+            };
+        };
+
+        const auto& field_type = j.at("type");
+        if (field_type == "Connected")
+        {
+            Connected connected{};
+            connected.id = j.at("id").template get<uint16_t>();
+            // older servers leave the features out
+            if (j.contains("features"))
+            {
+                connected.features = j["features"].template get<std::vector<std::string>>();
+            }
+            for (const auto& field_player : j.at("players"))
+            {
+                connected.players.push_back(parse_player(field_player));
+            }
+            return connected;
+        }
+        if (field_type == "PlayerJoined")
+        {
+            return PlayerJoined{ parse_player(j) };
+        }
+        if (field_type == "PlayerLeft")
+        {
+            return PlayerLeft{ j.at("id").template get<uint16_t>() };
+        }
+        return std::nullopt;
+    }
+
+    inline std::string WriteSubscribe(uint32_t zone)
+    {
+        std::string message(5, '\0');
+        BitStream::BitWriter writer(reinterpret_cast<uint8_t*>(message.data()), message.size());
+        writer.write_big_endian(uint8_t(ClientType::Subscribe), 1);
+        writer.write_big_endian(zone, 4);
+        return message;
+    }
+} // namespace ControlMessage
@@ -0,0 +1,243 @@
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <cstdint>
+
+#include "BitStream.hpp"
+#include "PacketLayout.hpp"
+
+namespace Delta
+{
+    // locations are sent as fixed point numbers with this many steps per unit
+    const double LOCATION_SCALE = 8.0;
+
+    // with the "short_keyframes" feature, a keyframe location inside a box of 2^SHORT_LOCATION_BITS steps on each axis
+    // centered on the origin, about 1.3 km across, is sent as offsets from the box's minimum corner. locations outside
+    // it are still sent in full, so the box only decides which keyframes are smaller
+    const unsigned SHORT_LOCATION_BITS = 20;
+    const int64_t SHORT_LOCATION_MIN = -(int64_t(1) << (SHORT_LOCATION_BITS - 1));
+
+    // A state the way it's sent in delta mode. Everything is an integer so that a state rebuilt from a baseline and a
+    // delta is exactly the state that was encoded, on every machine.
+    struct QuantizedState
+    {
+        uint32_t millis;
+        uint32_t zone;
+        std::array<int32_t, 3> location;
+        std::array<uint8_t, 3> rotation;
+    };
+
+    // everything in a keyframe after the bit that says it's one: zone, locations and rotations
+    typedef PacketLayout::Layout<
+        PacketLayout::Bits<32>,
+        PacketLayout::SignedBits<32>,
+        PacketLayout::SignedBits<32>,
+        PacketLayout::SignedBits<32>,
+        PacketLayout::Bits<8>,
+        PacketLayout::Bits<8>,
+        PacketLayout::Bits<8>
+    > Keyframe;
+
+    // the most bits EncodeChange can write: a new zone, three location changes that each need 33 bits, and three new
+    // rotation bytes
+    const size_t MAX_CHANGE_BITS = 1 + 32 + 3 * (6 + 33) + 3 * (1 + 8);
+    // the most bits Encode can write: the bigger of a short keyframe whose location is outside the short box and a
+    // delta with a full 32 bit millis gap and the biggest change
+    const size_t MAX_KEYFRAME_BITS = 2 + Keyframe::BITS;
+    const size_t MAX_DELTA_BITS = 1 + 6 + 32 + MAX_CHANGE_BITS;
+    const size_t MAX_ENCODED_BITS = std::max(MAX_KEYFRAME_BITS, MAX_DELTA_BITS);
+
+    // an update can also carry up to this many of the states sent before it, so the server can fill in any whose
+    // packets were lost (see EncodeRedundant)
+    const size_t MAX_REDUNDANT = 4;
+    const unsigned REDUNDANT_COUNT_BITS = 3;
+    static_assert(MAX_REDUNDANT < (1 << REDUNDANT_COUNT_BITS));
+
+    // the most bits EncodeRedundant can write, with a full 32 bit gap before each state
+    const size_t MAX_REDUNDANT_BITS = REDUNDANT_COUNT_BITS + MAX_REDUNDANT * (6 + 32 + MAX_CHANGE_BITS);
+
+    // Writes how state differs from other: the zone if it changed, the change in each location and each rotation byte
+    // that changed. other can be older or newer.
+    inline void EncodeChange(BitStream::BitWriter& writer, const QuantizedState& state, const QuantizedState& other)
+    {
+        writer.write_bool(state.zone != other.zone);
+        if (state.zone != other.zone)
+        {
+            writer.write(state.zone, 32);
+        }
+        for (size_t i = 0; i < 3; i++)
+        {
+            writer.write_signed(int64_t(state.location[i]) - int64_t(other.location[i]));
+        }
+        for (size_t i = 0; i < 3; i++)
+        {
+            writer.write_bool(state.rotation[i] != other.rotation[i]);
+            if (state.rotation[i] != other.rotation[i])
+            {
+                writer.write(state.rotation[i], 8);
+            }
+        }
+    }
+
+    // Returns whether every axis of location fits in a short keyframe.
+    inline bool IsShort(const std::array<int32_t, 3>& location)
+    {
+        for (int32_t l : location)
+        {
+            int64_t offset = int64_t(l) - SHORT_LOCATION_MIN;
+            if (offset < 0 || offset >= (int64_t(1) << SHORT_LOCATION_BITS))
+            {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    // Writes a short keyframe: the zone, whether the location is inside the short box and then the location as
+    // offsets into the box if it is or in full if it isn't, followed by the rotations.
+    inline void EncodeShort(BitStream::BitWriter& writer, const QuantizedState& state)
+    {
+        writer.write(state.zone, 32);
+        bool inside = IsShort(state.location);
+        writer.write_bool(inside);
+        for (size_t i = 0; i < 3; i++)
+        {
+            if (inside)
+            {
+                writer.write(uint64_t(int64_t(state.location[i]) - SHORT_LOCATION_MIN), SHORT_LOCATION_BITS);
+            }
+            else
+            {
+                writer.write(uint32_t(state.location[i]), 32);
+            }
+        }
+        for (uint8_t rotation : state.rotation)
+        {
+            writer.write(rotation, 8);
+        }
+    }
+
+    // Writes state relative to baseline, or as a keyframe if baseline is null. The state's millis isn't written, since
+    // packets send it in whatever way suits them, but a delta does say which baseline it's relative to.
+    // short_keyframes is whether both ends agreed on the "short_keyframes" feature.
+    inline void Encode(
+        BitStream::BitWriter& writer,
+        const QuantizedState& state,
+        const QuantizedState* baseline,
+        bool short_keyframes
+    ) {
+        writer.write_bool(baseline == nullptr);
+        if (!baseline)
+        {
+            if (short_keyframes)
+            {
+                EncodeShort(writer, state);
+                return;
+            }
+            const auto& l = state.location;
+            const auto& r = state.rotation;
+            Keyframe::write(writer, state.zone, l[0], l[1], l[2], r[0], r[1], r[2]);
+            return;
+        }
+
+        writer.write_varbits(state.millis - baseline->millis);
+        EncodeChange(writer, state, *baseline);
+    }
+
+    // Writes the count states before newest in sent, newest first, each as how many millis older it is than the state
+    // after it and then its change from that state. sent has to be sorted oldest first, like a StateBuffer, and end
+    // with the state sent just before newest. count must be at most MAX_REDUNDANT.
+    template<typename Buffer>
+    void EncodeRedundant(BitStream::BitWriter& writer, const QuantizedState& newest, const Buffer& sent, size_t count)
+    {
+        writer.write(count, REDUNDANT_COUNT_BITS);
+        const QuantizedState* after = &newest;
+        for (size_t i = 0; i < count; i++)
+        {
+            const QuantizedState& state = sent[sent.size() - 1 - i];
+            writer.write_varbits(after->millis - state.millis);
+            EncodeChange(writer, state, *after);
+            after = &state;
+        }
+    }
+
+    // Reads a keyframe written by EncodeShort.
+    inline void DecodeShort(BitStream::BitReader& reader, QuantizedState& state)
+    {
+        state.zone = uint32_t(reader.read(32));
+        bool inside = reader.read_bool();
+        for (size_t i = 0; i < 3; i++)
+        {
+            if (inside)
+            {
+                state.location[i] = int32_t(SHORT_LOCATION_MIN + int64_t(reader.read(SHORT_LOCATION_BITS)));
+            }
+            else
+            {
+                state.location[i] = int32_t(uint32_t(reader.read(32)));
+            }
+        }
+        for (uint8_t& rotation : state.rotation)
+        {
+            rotation = uint8_t(reader.read(8));
+        }
+    }
+
+    // Reads a state written by Encode whose millis is already known. find_baseline is called with the millis of the
+    // baseline a delta was written against and returns a pointer to it, or null if it isn't available. Returns
+    // whether the state could be rebuilt; either way, everything the state was written with is read, so the reader is
+    // left at whatever follows it.
+    template<typename F>
+    bool Decode(
+        BitStream::BitReader& reader,
+        uint32_t millis,
+        F find_baseline,
+        bool short_keyframes,
+        QuantizedState& state
+    ) {
+        state.millis = millis;
+        if (reader.read_bool())
+        {
+            if (short_keyframes)
+            {
+                DecodeShort(reader, state);
+                return !reader.overflowed();
+            }
+            auto [zone, x, y, z, roll, pitch, yaw] = Keyframe::read(reader);
+            state.zone = zone;
+            state.location = { x, y, z };
+            state.rotation = { uint8_t(roll), uint8_t(pitch), uint8_t(yaw) };
+            return !reader.overflowed();
+        }
+
+        uint32_t baseline_millis = millis - uint32_t(reader.read_varbits());
+        const QuantizedState* baseline = find_baseline(baseline_millis);
+        bool zone_changed = reader.read_bool();
+        uint32_t zone = zone_changed ? uint32_t(reader.read(32)) : 0;
+        std::array<int64_t, 3> location_deltas{};
+        for (auto& delta : location_deltas)
+        {
+            delta = reader.read_signed();
+        }
+        std::array<bool, 3> rotation_changed{};
+        std::array<uint8_t, 3> rotations{};
+        for (size_t i = 0; i < 3; i++)
+        {
+            rotation_changed[i] = reader.read_bool();
+            rotations[i] = rotation_changed[i] ? uint8_t(reader.read(8)) : 0;
+        }
+        if (!baseline || reader.overflowed())
+        {
+            return false;
+        }
+
+        state.zone = zone_changed ? zone : baseline->zone;
+        for (size_t i = 0; i < 3; i++)
+        {
+            state.location[i] = int32_t(int64_t(baseline->location[i]) + location_deltas[i]);
+            state.rotation[i] = rotation_changed[i] ? rotations[i] : baseline->rotation[i];
+        }
+        return true;
+    }
+} // namespace Delta
@@ -0,0 +1,233 @@
+#pragma once
+
+#include <array>
+#include <cstddef>
+
+#if defined(__AVX2__)
+#include <immintrin.h>
+#endif
+#if defined(__SSE2__) || defined(_M_X64) || defined(_M_AMD64)
+#define INTERPOLATION_SSE2
+#include <emmintrin.h>
+#endif
+
+namespace Interpolation
+{
+    // The inputs for interpolating the locations of a batch of ghosts, stored as parallel arrays so several entries
+    // can be processed at once. Entry i is interpolated between from_*[i] and to_*[i], which were sampled span[i]
+    // millis apart, at elapsed[i] millis after from_*[i] was sampled. The curve between them is a cubic Hermite
+    // spline leaving from_*[i] with tangent from_t*[i] and arriving at to_*[i] with tangent to_t*[i], where the
+    // tangents are velocities in units per milli multiplied by span[i]. A span of 0 means from_*[i] is used as is.
+    //
+    // If both tangents are to_* - from_*, the curve is the straight line through the two points, including for an
+    // elapsed past span, which is how entries are extrapolated.
+    template<size_t N>
+    struct Batch
+    {
+        alignas(32) std::array<double, N> elapsed;
+        alignas(32) std::array<double, N> span;
+        alignas(32) std::array<double, N> from_x;
+        alignas(32) std::array<double, N> from_y;
+        alignas(32) std::array<double, N> from_z;
+        alignas(32) std::array<double, N> to_x;
+        alignas(32) std::array<double, N> to_y;
+        alignas(32) std::array<double, N> to_z;
+        alignas(32) std::array<double, N> from_tx;
+        alignas(32) std::array<double, N> from_ty;
+        alignas(32) std::array<double, N> from_tz;
+        alignas(32) std::array<double, N> to_tx;
+        alignas(32) std::array<double, N> to_ty;
+        alignas(32) std::array<double, N> to_tz;
+    };
+
+    namespace Detail
+    {
+        // The four Hermite basis functions at pct, weighting from, from's tangent, to and to's tangent.
+        struct Basis
+        {
+            double from;
+            double from_t;
+            double to;
+            double to_t;
+        };
+
+        inline Basis HermiteBasis(double pct)
+        {
+            double pct2 = pct * pct;
+            double pct3 = pct2 * pct;
+            return Basis
+            {
+                .from = 2.0 * pct3 - 3.0 * pct2 + 1.0,
+                .from_t = pct3 - 2.0 * pct2 + pct,
+                .to = 3.0 * pct2 - 2.0 * pct3,
+                .to_t = pct3 - pct2,
+            };
+        }
+
+        inline double Hermite(double from, double from_t, double to, double to_t, const Basis& h)
+        {
+            return h.from * from + h.from_t * from_t + h.to * to + h.to_t * to_t;
+        }
+
+        template<size_t N>
+        void InterpolateScalar(const Batch<N>& batch, size_t i, double* out)
+        {
+            double pct = batch.span[i] > 0.0 ? batch.elapsed[i] / batch.span[i] : 0.0;
+            auto h = HermiteBasis(pct);
+            out[0] = Hermite(batch.from_x[i], batch.from_tx[i], batch.to_x[i], batch.to_tx[i], h);
+            out[1] = Hermite(batch.from_y[i], batch.from_ty[i], batch.to_y[i], batch.to_ty[i], h);
+            out[2] = Hermite(batch.from_z[i], batch.from_tz[i], batch.to_z[i], batch.to_tz[i], h);
+        }
+
+#if defined(INTERPOLATION_SSE2)
+        // Basis, for two entries at once.
+        struct BasisSse2
+        {
+            __m128d from;
+            __m128d from_t;
+            __m128d to;
+            __m128d to_t;
+        };
+
+        inline BasisSse2 HermiteBasis(__m128d pct)
+        {
+            __m128d pct2 = _mm_mul_pd(pct, pct);
+            __m128d pct3 = _mm_mul_pd(pct2, pct);
+            __m128d two = _mm_set1_pd(2.0);
+            __m128d three = _mm_set1_pd(3.0);
+            // to is 3 pct^2 - 2 pct^3, and from is 1 minus that
+            __m128d to = _mm_sub_pd(_mm_mul_pd(three, pct2), _mm_mul_pd(two, pct3));
+            __m128d to_t = _mm_sub_pd(pct3, pct2);
+            return BasisSse2
+            {
+                .from = _mm_sub_pd(_mm_set1_pd(1.0), to),
+                // from_t is pct^3 - 2 pct^2 + pct, or to_t - pct^2 + pct
+                .from_t = _mm_add_pd(_mm_sub_pd(to_t, pct2), pct),
+                .to = to,
+                .to_t = to_t,
+            };
+        }
+
+        inline __m128d Hermite(__m128d from, __m128d from_t, __m128d to, __m128d to_t, const BasisSse2& h)
+        {
+            __m128d a = _mm_add_pd(_mm_mul_pd(h.from, from), _mm_mul_pd(h.from_t, from_t));
+            __m128d b = _mm_add_pd(_mm_mul_pd(h.to, to), _mm_mul_pd(h.to_t, to_t));
+            return _mm_add_pd(a, b);
+        }
+
+        template<size_t N>
+        void InterpolateSse2(const Batch<N>& batch, size_t i, double* out, size_t stride)
+        {
+            __m128d span = _mm_loadu_pd(&batch.span[i]);
+            // dividing by a span of 0 gives inf or nan, but masking clears those lanes to a pct of 0
+            __m128d has_span = _mm_cmpgt_pd(span, _mm_setzero_pd());
+            __m128d pct = _mm_and_pd(has_span, _mm_div_pd(_mm_loadu_pd(&batch.elapsed[i]), span));
+            auto h = HermiteBasis(pct);
+
+            __m128d x = Hermite(_mm_loadu_pd(&batch.from_x[i]), _mm_loadu_pd(&batch.from_tx[i]),
+                _mm_loadu_pd(&batch.to_x[i]), _mm_loadu_pd(&batch.to_tx[i]), h);
+            __m128d y = Hermite(_mm_loadu_pd(&batch.from_y[i]), _mm_loadu_pd(&batch.from_ty[i]),
+                _mm_loadu_pd(&batch.to_y[i]), _mm_loadu_pd(&batch.to_ty[i]), h);
+            __m128d z = Hermite(_mm_loadu_pd(&batch.from_z[i]), _mm_loadu_pd(&batch.from_tz[i]),
+                _mm_loadu_pd(&batch.to_z[i]), _mm_loadu_pd(&batch.to_tz[i]), h);
+
+            double* out0 = out;
+            double* out1 = out + stride;
+            _mm_storel_pd(out0, x);
+            _mm_storel_pd(out0 + 1, y);
+            _mm_storel_pd(out0 + 2, z);
+            _mm_storeh_pd(out1, x);
+            _mm_storeh_pd(out1 + 1, y);
+            _mm_storeh_pd(out1 + 2, z);
+        }
+#endif
+
+#if defined(__AVX2__)
+        // Basis, for four entries at once.
+        struct BasisAvx2
+        {
+            __m256d from;
+            __m256d from_t;
+            __m256d to;
+            __m256d to_t;
+        };
+
+        inline BasisAvx2 HermiteBasis(__m256d pct)
+        {
+            __m256d pct2 = _mm256_mul_pd(pct, pct);
+            __m256d pct3 = _mm256_mul_pd(pct2, pct);
+            __m256d two = _mm256_set1_pd(2.0);
+            __m256d three = _mm256_set1_pd(3.0);
+            __m256d to = _mm256_sub_pd(_mm256_mul_pd(three, pct2), _mm256_mul_pd(two, pct3));
+            __m256d to_t = _mm256_sub_pd(pct3, pct2);
+            return BasisAvx2
+            {
+                .from = _mm256_sub_pd(_mm256_set1_pd(1.0), to),
+                .from_t = _mm256_add_pd(_mm256_sub_pd(to_t, pct2), pct),
+                .to = to,
+                .to_t = to_t,
+            };
+        }
+
+        inline __m256d Hermite(__m256d from, __m256d from_t, __m256d to, __m256d to_t, const BasisAvx2& h)
+        {
+            __m256d a = _mm256_add_pd(_mm256_mul_pd(h.from, from), _mm256_mul_pd(h.from_t, from_t));
+            __m256d b = _mm256_add_pd(_mm256_mul_pd(h.to, to), _mm256_mul_pd(h.to_t, to_t));
+            return _mm256_add_pd(a, b);
+        }
+
+        inline void StoreLanes(__m256d v, double* out, size_t stride)
+        {
+            __m128d lo = _mm256_castpd256_pd128(v);
+            __m128d hi = _mm256_extractf128_pd(v, 1);
+            _mm_storel_pd(out, lo);
+            _mm_storeh_pd(out + stride, lo);
+            _mm_storel_pd(out + 2 * stride, hi);
+            _mm_storeh_pd(out + 3 * stride, hi);
+        }
+
+        template<size_t N>
+        void InterpolateAvx2(const Batch<N>& batch, size_t i, double* out, size_t stride)
+        {
+            __m256d span = _mm256_loadu_pd(&batch.span[i]);
+            __m256d has_span = _mm256_cmp_pd(span, _mm256_setzero_pd(), _CMP_GT_OQ);
+            __m256d pct = _mm256_and_pd(has_span, _mm256_div_pd(_mm256_loadu_pd(&batch.elapsed[i]), span));
+            auto h = HermiteBasis(pct);
+
+            StoreLanes(Hermite(_mm256_loadu_pd(&batch.from_x[i]), _mm256_loadu_pd(&batch.from_tx[i]),
+                _mm256_loadu_pd(&batch.to_x[i]), _mm256_loadu_pd(&batch.to_tx[i]), h), out, stride);
+            StoreLanes(Hermite(_mm256_loadu_pd(&batch.from_y[i]), _mm256_loadu_pd(&batch.from_ty[i]),
+                _mm256_loadu_pd(&batch.to_y[i]), _mm256_loadu_pd(&batch.to_ty[i]), h), out + 1, stride);
+            StoreLanes(Hermite(_mm256_loadu_pd(&batch.from_z[i]), _mm256_loadu_pd(&batch.from_tz[i]),
+                _mm256_loadu_pd(&batch.to_z[i]), _mm256_loadu_pd(&batch.to_tz[i]), h), out + 2, stride);
+        }
+#endif
+    } // namespace Detail
+
+    // Interpolates the first n entries of batch. The x, y and z of entry i are written to out[i * stride],
+    // out[i * stride + 1] and out[i * stride + 2], so out can point straight at the location fields of an array of
+    // structs. Uses AVX2 and/or SSE2 when the target supports them, and plain scalar code for the remainder.
+    template<size_t N>
+    void Interpolate(const Batch<N>& batch, size_t n, double* out, size_t stride)
+    {
+        size_t i = 0;
+#if defined(__AVX2__)
+        for (; i + 4 <= n; i += 4)
+        {
+            Detail::InterpolateAvx2(batch, i, out + i * stride, stride);
+        }
+#endif
+#if defined(INTERPOLATION_SSE2)
+        for (; i + 2 <= n; i += 2)
+        {
+            Detail::InterpolateSse2(batch, i, out + i * stride, stride);
+        }
+#endif
+        for (; i < n; i++)
+        {
+            Detail::InterpolateScalar(batch, i, out + i * stride);
+        }
+    }
+} // namespace Interpolation
+
+#undef INTERPOLATION_SSE2
@@ -0,0 +1,147 @@
+#pragma once
+
+#include <algorithm>
+#include <bit>
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+
+namespace LinkStats
+{
+    // What a Tracker has seen of one sender's packets so far.
+    struct Summary
+    {
+        // distinct packets that arrived
+        uint64_t received = 0;
+        // packets that never arrived. a missing packet is only counted once it's too far behind the newest one to
+        // still be on its way, and uncounted if it turns up after all
+        uint64_t lost = 0;
+        uint64_t duplicates = 0;
+        // packets that arrived after a newer one, and the furthest behind the newest one any of them was
+        uint64_t reordered = 0;
+        uint64_t max_reorder_depth = 0;
+        // the smoothed difference in transit time between consecutive packets, in millis, as in RFC 3550
+        double jitter = 0.0;
+        // the fraction of the newest WINDOW packets that are missing so far
+        double recent_loss = 0.0;
+
+        double loss() const
+        {
+            return received + lost == 0 ? 0.0 : double(lost) / double(received + lost);
+        }
+    };
+
+    // Tells loss, reordering and duplicates apart from the sequence numbers of one sender's packets, which are BITS
+    // bits wide and wrap around. A bit mask remembers which of the newest WINDOW sequences have arrived, so a packet
+    // can be up to WINDOW - 1 sequences late before it's taken as lost.
+    template<unsigned BITS>
+    class Tracker
+    {
+    public:
+        static constexpr uint64_t WINDOW = 64;
+
+        // Records a packet. sent and arrived are in millis, on clocks that only need to run at the same rate. Packets
+        // that arrived at the same time, like several drained from the socket at once, aren't counted as reordered
+        // among themselves, since the order they're handled in says nothing about the network.
+        void add(uint64_t sequence, double sent, double arrived)
+        {
+            sequence &= MASK;
+            if (!_started)
+            {
+                _started = true;
+                _newest = sequence;
+                // nothing from before the first packet is expected
+                _arrived = ~uint64_t(0);
+                _span = 1;
+                _newest_arrived = arrived;
+                _summary.received++;
+                sample(sent, arrived);
+                return;
+            }
+
+            uint64_t ahead = (sequence - _newest) & MASK;
+            if (ahead != 0 && ahead < HALF)
+            {
+                // whatever this pushes out of the window without having arrived is lost
+                if (ahead >= WINDOW)
+                {
+                    _summary.lost += WINDOW - std::popcount(_arrived) + (ahead - WINDOW);
+                    _arrived = 1;
+                }
+                else
+                {
+                    _summary.lost += ahead - std::popcount(_arrived >> (WINDOW - ahead));
+                    _arrived = (_arrived << ahead) | 1;
+                }
+                _newest = sequence;
+                _span = std::min(_span + ahead, WINDOW);
+                _newest_arrived = arrived;
+                _summary.received++;
+                sample(sent, arrived);
+                return;
+            }
+
+            uint64_t behind = (_newest - sequence) & MASK;
+            if (behind < WINDOW)
+            {
+                if ((_arrived >> behind) & 1)
+                {
+                    _summary.duplicates++;
+                    return;
+                }
+                _arrived |= uint64_t(1) << behind;
+            }
+            else if (_summary.lost > 0)
+            {
+                // it was already counted as lost
+                _summary.lost--;
+            }
+            _summary.received++;
+            if (arrived != _newest_arrived)
+            {
+                _summary.reordered++;
+                _summary.max_reorder_depth = std::max(_summary.max_reorder_depth, behind);
+            }
+            sample(sent, arrived);
+        }
+
+        Summary summary() const
+        {
+            Summary summary = _summary;
+            if (_started)
+            {
+                summary.recent_loss = double(WINDOW - std::popcount(_arrived)) / double(_span);
+            }
+            return summary;
+        }
+
+    private:
+        static_assert(BITS >= 8 && BITS <= 32);
+        static constexpr uint64_t MASK = (uint64_t(1) << BITS) - 1;
+        // sequences more than this far ahead of the newest are taken as behind it instead
+        static constexpr uint64_t HALF = uint64_t(1) << (BITS - 1);
+        static_assert(WINDOW < HALF);
+
+        void sample(double sent, double arrived)
+        {
+            double transit = arrived - sent;
+            if (_has_transit)
+            {
+                _summary.jitter += (std::abs(transit - _transit) - _summary.jitter) / 16.0;
+            }
+            _transit = transit;
+            _has_transit = true;
+        }
+
+        bool _started = false;
+        uint64_t _newest = 0;
+        // bit i is set if the sequence i before the newest has arrived
+        uint64_t _arrived = 0;
+        // how many sequences the window covers since the first packet, up to WINDOW
+        uint64_t _span = 0;
+        double _newest_arrived = 0.0;
+        double _transit = 0.0;
+        bool _has_transit = false;
+        Summary _summary;
+    };
+} // namespace LinkStats
@@ -0,0 +1,237 @@
+#pragma once
+
+#include <array>
+#include <bit>
+#include <cstddef>
+#include <cstdint>
+#include <tuple>
+#include <type_traits>
+#include <utility>
+
+#include "BitStream.hpp"
+
+namespace PacketLayout
+{
+    // the biggest UDP payload that's guaranteed not to be fragmented on any path
+    constexpr size_t MAX_DATAGRAM_LEN = 508;
+
+    // Each field type below describes one value on the wire: BITS is how many bits it takes, value_type is what it's
+    // written from and read into, and put and take convert between the two. They don't check for room themselves;
+    // fields are combined into packets with Layout, which checks once for all of them.
+
+    // An unsigned integer in N bits.
+    template<unsigned N>
+    struct Bits
+    {
+        static_assert(N > 0 && N <= 32);
+        static constexpr size_t BITS = N;
+        typedef uint32_t value_type;
+
+        static void put(BitStream::BitWriter& writer, uint32_t value)
+        {
+            writer.put(value, N);
+        }
+
+        static uint32_t take(BitStream::BitReader& reader)
+        {
+            return uint32_t(reader.take(N));
+        }
+    };
+
+    // A two's complement signed integer in N bits.
+    template<unsigned N>
+    struct SignedBits
+    {
+        static_assert(N > 0 && N <= 32);
+        static constexpr size_t BITS = N;
+        typedef int32_t value_type;
+
+        static void put(BitStream::BitWriter& writer, int32_t value)
+        {
+            writer.put(uint32_t(value), N);
+        }
+
+        static int32_t take(BitStream::BitReader& reader)
+        {
+            // shift the sign bit to the top so shifting back down extends it
+            return int32_t(uint32_t(reader.take(N)) << (32 - N)) >> (32 - N);
+        }
+    };
+
+    // An unsigned integer of type T in its own size, most significant byte first, like the 24 byte state format.
+    template<typename T>
+    struct BigEndian
+    {
+        static_assert(std::is_unsigned_v<T> && sizeof(T) <= 4);
+        static constexpr size_t BITS = sizeof(T) * 8;
+        typedef T value_type;
+
+        static void put(BitStream::BitWriter& writer, T value)
+        {
+            writer.put_big_endian(value, sizeof(T));
+        }
+
+        static T take(BitStream::BitReader& reader)
+        {
+            return T(reader.take_big_endian(sizeof(T)));
+        }
+    };
+
+    typedef BigEndian<uint8_t> U8;
+    typedef BigEndian<uint16_t> U16;
+    typedef BigEndian<uint32_t> U32;
+
+    // A double sent as a big endian float.
+    struct F32
+    {
+        static constexpr size_t BITS = 32;
+        typedef double value_type;
+
+        static void put(BitStream::BitWriter& writer, double value)
+        {
+            U32::put(writer, std::bit_cast<uint32_t>(float(value)));
+        }
+
+        static double take(BitStream::BitReader& reader)
+        {
+            return double(std::bit_cast<float>(U32::take(reader)));
+        }
+    };
+
+    // A double in [MIN, MAX) mapped onto N bits, rounding down. Values outside the range wrap around, which is what
+    // angles want.
+    template<int MIN, int MAX, unsigned N>
+    struct Quantized
+    {
+        static_assert(MIN < MAX && N > 0 && N <= 32);
+        static constexpr size_t BITS = N;
+        typedef double value_type;
+
+        static uint32_t quantize(double value)
+        {
+            double scaled = (value - double(MIN)) * double(STEPS) / double(MAX - MIN);
+            return uint32_t(int64_t(scaled)) & uint32_t(STEPS - 1);
+        }
+
+        static double dequantize(uint32_t steps)
+        {
+            return double(steps) * double(MAX - MIN) / double(STEPS) + double(MIN);
+        }
+
+        static void put(BitStream::BitWriter& writer, double value)
+        {
+            writer.put(quantize(value), N);
+        }
+
+        static double take(BitStream::BitReader& reader)
+        {
+            return dequantize(uint32_t(reader.take(N)));
+        }
+
+    private:
+        static constexpr uint64_t STEPS = uint64_t(1) << N;
+    };
+
+    // A packet, or part of one, made of Fields in order. Its size is known at compile time, so packets can be checked
+    // against MAX_DATAGRAM_LEN with static_assert.
+    template<typename... Fields>
+    struct Layout
+    {
+        static constexpr size_t BITS = (Fields::BITS + ... + 0);
+        // the bytes it takes on its own, rounding up
+        static constexpr size_t BYTES = (BITS + 7) / 8;
+        typedef std::tuple<typename Fields::value_type...> values;
+
+        // Writes every field, or nothing and sets overflowed if they don't all fit.
+        static void write(BitStream::BitWriter& writer, const typename Fields::value_type&... values)
+        {
+            if (!writer.reserve(BITS))
+            {
+                return;
+            }
+            if constexpr (BYTE_FIELDS)
+            {
+                if (writer.bits() % 8 == 0)
+                {
+                    uint8_t* out = writer.cursor();
+                    StoreAll(out, std::index_sequence_for<Fields...>{}, values...);
+                    writer.skip(BITS);
+                    return;
+                }
+            }
+            (Fields::put(writer, values), ...);
+        }
+
+        // Reads every field, or returns zeroes and sets overflowed if they aren't all there. Unpack the result with a
+        // structured binding.
+        static values read(BitStream::BitReader& reader)
+        {
+            if (!reader.reserve(BITS))
+            {
+                return values{};
+            }
+            if constexpr (BYTE_FIELDS)
+            {
+                if (reader.bits() % 8 == 0)
+                {
+                    const uint8_t* in = reader.cursor();
+                    reader.skip(BITS);
+                    return LoadAll(in, std::index_sequence_for<Fields...>{});
+                }
+            }
+            // a braced list is evaluated left to right, so the fields are read in order
+            return values{ Fields::take(reader)... };
+        }
+
+        static void skip(BitStream::BitReader& reader)
+        {
+            reader.skip(BITS);
+        }
+
+    private:
+        // When every field is whole bytes, as in the fixed size formats, each one's byte offset is known at compile
+        // time. Each field is then read or written through its own stream over just its bytes, which the compiler
+        // folds down to plain loads and stores; going through the caller's stream would make it track the position
+        // in memory, since stores through a byte pointer could change it as far as it knows.
+        static constexpr bool BYTE_FIELDS = ((Fields::BITS % 8 == 0) && ...);
+
+        static constexpr std::array<size_t, sizeof...(Fields)> OFFSETS = []
+        {
+            std::array<size_t, sizeof...(Fields)> offsets{};
+            std::array<size_t, sizeof...(Fields)> bits{ Fields::BITS... };
+            size_t at = 0;
+            for (size_t i = 0; i < offsets.size(); i++)
+            {
+                offsets[i] = at / 8;
+                at += bits[i];
+            }
+            return offsets;
+        }();
+
+        template<typename F>
+        static void StoreAt(uint8_t* out, const typename F::value_type& value)
+        {
+            BitStream::BitWriter writer(out, F::BITS / 8);
+            F::put(writer, value);
+        }
+
+        template<typename F>
+        static typename F::value_type LoadAt(const uint8_t* in)
+        {
+            BitStream::BitReader reader(in, F::BITS / 8);
+            return F::take(reader);
+        }
+
+        template<size_t... I>
+        static void StoreAll(uint8_t* out, std::index_sequence<I...>, const typename Fields::value_type&... values)
+        {
+            (StoreAt<Fields>(out + OFFSETS[I], values), ...);
+        }
+
+        template<size_t... I>
+        static values LoadAll(const uint8_t* in, std::index_sequence<I...>)
+        {
+            return values{ LoadAt<Fields>(in + OFFSETS[I])... };
+        }
+    };
+} // namespace PacketLayout
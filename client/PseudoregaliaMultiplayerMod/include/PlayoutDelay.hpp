@@ -0,0 +1,63 @@
+#pragma once
+
+#include <algorithm>
+#include <cstddef>
+
+namespace PlayoutDelay
+{
+    // Picks how far behind the newest state a ghost should be played so that it only runs out of states to
+    // interpolate towards about underrun_target of the time. Each sample is how late the ghost could have been played
+    // without running out when a new latest state arrived: its transit time plus the gap since the previous latest
+    // state, so both jitter and lost states push it up. The delay is a streaming estimate of the (1 - underrun_target)
+    // quantile of those samples, which needs no history: every sample nudges the estimate towards it, with steps
+    // weighted so the estimate settles where that fraction of samples lands above it.
+    class PlayoutDelay
+    {
+    public:
+        explicit PlayoutDelay(double underrun_target)
+            : _quantile(1.0 - std::clamp(underrun_target, MIN_UNDERRUN_TARGET, MAX_UNDERRUN_TARGET))
+        {
+        }
+
+        void add_sample(double late_millis)
+        {
+            if (_samples < WARMUP)
+            {
+                // the stochastic estimate is slow to come down from a bad guess, so it starts at the worst of the
+                // first few samples, which is already close to a high quantile
+                _delay = _samples == 0 ? late_millis : std::max(_delay, late_millis);
+                _samples++;
+                return;
+            }
+
+            if (late_millis > _delay)
+            {
+                _delay += STEP * _quantile;
+            }
+            else
+            {
+                _delay -= STEP * (1.0 - _quantile);
+            }
+            _delay = std::clamp(_delay, 0.0, MAX_DELAY);
+        }
+
+        // the current delay in millis
+        double delay() const
+        {
+            return _delay;
+        }
+
+    private:
+        static constexpr double MIN_UNDERRUN_TARGET = 0.001;
+        static constexpr double MAX_UNDERRUN_TARGET = 0.5;
+        static const size_t WARMUP = 32;
+        // how far one sample can move the estimate, in millis
+        static constexpr double STEP = 1.0;
+        // past this, the ghost is too far behind to be worth showing smoothly anyway
+        static constexpr double MAX_DELAY = 1000.0;
+
+        double _quantile;
+        double _delay = 0.0;
+        size_t _samples = 0;
+    };
+} // namespace PlayoutDelay
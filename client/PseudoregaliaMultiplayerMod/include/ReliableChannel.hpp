@@ -0,0 +1,235 @@
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <utility>
+
+namespace ReliableChannel
+{
+    // With the UDP transport, messages that would otherwise go over the WebSocket go in control packets, which start
+    // with two of this byte. No other packet in either direction does: a narrow id is never 255, a wide id's high byte
+    // never is, and the byte after a delta packet's sequence never has IS_CONTROL set. Matches reliable.rs in the
+    // server.
+    const uint8_t MARKER = 255;
+
+    // a control packet is the marker, flags and an ack, which is how many fragments have arrived in order so far. if it
+    // has a fragment, the fragment's sequence and bytes follow. messages are split into as many fragments as they
+    // need, each but the last with MORE set
+    const size_t HEADER_LEN = 5;
+    const size_t FRAGMENT_HEADER_LEN = 7;
+    const uint8_t IS_CONTROL = 128;
+    const uint8_t HAS_FRAGMENT = 1;
+    const uint8_t MORE = 2;
+    // set if the sender is done with the channel and won't answer anything on it again
+    const uint8_t CLOSE = 4;
+
+    inline bool IsControl(const uint8_t* buf, size_t len)
+    {
+        return len >= HEADER_LEN && buf[0] == MARKER && buf[1] == MARKER && (buf[2] & IS_CONTROL);
+    }
+
+    // One end of an ordered, reliable stream of messages over UDP. Fragments are numbered and sent again until the
+    // other end acks them, and ones that arrive out of order are held until the ones before them turn up. Packets are
+    // at most MAX_PACKET_LEN bytes. Nothing here touches a socket; poll hands packets to a callback to send.
+    template<size_t MAX_PACKET_LEN>
+    class Channel
+    {
+    public:
+        typedef std::chrono::steady_clock::time_point time_point;
+
+        explicit Channel(const time_point& now) : _resend_at(now), _last_sent(now), _last_heard(now) {}
+
+        // Queues a message to be sent by the next poll.
+        void send(std::string_view message)
+        {
+            do
+            {
+                size_t len = std::min(message.size(), MAX_FRAGMENT_LEN);
+                bool more = len < message.size();
+                std::string bytes(message.substr(0, len));
+                _unacked.push_back(Fragment{ .sequence = _next_sequence++, .more = more, .bytes = std::move(bytes) });
+                message.remove_prefix(len);
+            } while (!message.empty());
+        }
+
+        // Handles a control packet from the other end, calling on_message with each message it completed, in order.
+        // Returns false if the other end closed the channel.
+        template<typename F>
+        bool receive(const uint8_t* buf, size_t len, const time_point& now, F&& on_message)
+        {
+            if (!IsControl(buf, len))
+            {
+                return true;
+            }
+            _last_heard = now;
+            uint8_t flags = buf[2];
+            if (flags & CLOSE)
+            {
+                return false;
+            }
+
+            uint16_t ack = ReadU16(buf + 3);
+            while (!_unacked.empty())
+            {
+                // acked if it's before ack, going by whichever way round is closer
+                uint16_t behind = ack - _unacked.front().sequence;
+                if (behind == 0 || behind > UINT16_MAX / 2)
+                {
+                    break;
+                }
+                _unacked.pop_front();
+            }
+
+            if (!(flags & HAS_FRAGMENT) || len < FRAGMENT_HEADER_LEN)
+            {
+                return true;
+            }
+            // anything with a fragment gets acked, even a duplicate, since the ack for it may be lost
+            _ack_due = true;
+            uint16_t sequence = ReadU16(buf + 5);
+            if (uint16_t(sequence - _received) >= WINDOW)
+            {
+                return true;
+            }
+            std::string bytes(reinterpret_cast<const char*>(buf + FRAGMENT_HEADER_LEN), len - FRAGMENT_HEADER_LEN);
+            _early.insert_or_assign(sequence, Early{ .more = bool(flags & MORE), .bytes = std::move(bytes) });
+            for (auto it = _early.find(_received); it != _early.end(); it = _early.find(_received))
+            {
+                _received++;
+                _partial += it->second.bytes;
+                bool more = it->second.more;
+                _early.erase(it);
+                if (!more)
+                {
+                    on_message(_partial);
+                    _partial.clear();
+                }
+            }
+            return true;
+        }
+
+        // Sends whatever is due through send, which takes a pointer and a length: fragments that haven't been sent
+        // yet, all unacked ones if it's time to resend them, and otherwise an ack if one is due.
+        template<typename F>
+        void poll(const time_point& now, F&& send)
+        {
+            bool resend = now >= _resend_at;
+            bool sent = false;
+            size_t i = 0;
+            for (auto& fragment : _unacked)
+            {
+                if (i++ == WINDOW)
+                {
+                    break;
+                }
+                if (fragment.sent && !resend)
+                {
+                    continue;
+                }
+                fragment.sent = true;
+                std::array<uint8_t, MAX_PACKET_LEN> packet{};
+                WriteHeader(packet.data(), IS_CONTROL | HAS_FRAGMENT | (fragment.more ? MORE : 0));
+                WriteU16(packet.data() + 5, fragment.sequence);
+                std::copy(fragment.bytes.begin(), fragment.bytes.end(), packet.begin() + FRAGMENT_HEADER_LEN);
+                send(packet.data(), FRAGMENT_HEADER_LEN + fragment.bytes.size());
+                sent = true;
+            }
+            if (sent)
+            {
+                _resend_at = now + RESEND;
+            }
+            else if (_ack_due || now - _last_sent >= KEEPALIVE)
+            {
+                std::array<uint8_t, HEADER_LEN> packet{};
+                WriteHeader(packet.data(), IS_CONTROL);
+                send(packet.data(), HEADER_LEN);
+                sent = true;
+            }
+            if (sent)
+            {
+                _ack_due = false;
+                _last_sent = now;
+            }
+        }
+
+        // Sends a packet through send that tells the other end this one is done with the channel.
+        template<typename F>
+        void close(F&& send) const
+        {
+            std::array<uint8_t, HEADER_LEN> packet{};
+            WriteHeader(packet.data(), IS_CONTROL | CLOSE);
+            send(packet.data(), HEADER_LEN);
+        }
+
+        bool timed_out(const time_point& now) const
+        {
+            return now - _last_heard >= TIMEOUT;
+        }
+
+    private:
+        static_assert(MAX_PACKET_LEN > FRAGMENT_HEADER_LEN);
+        static constexpr size_t MAX_FRAGMENT_LEN = MAX_PACKET_LEN - FRAGMENT_HEADER_LEN;
+        // how many fragments can be sent without being acked, and how far ahead of the next one in order a fragment can
+        // arrive and still be kept
+        static const uint16_t WINDOW = 32;
+        // unacked fragments are sent again this long after they were last sent
+        static constexpr auto RESEND = std::chrono::milliseconds(250);
+        // an ack goes out at least this often, so the other end knows this one is still there
+        static constexpr auto KEEPALIVE = std::chrono::milliseconds(1000);
+        // the other end is given up on after hearing nothing from it for this long
+        static constexpr auto TIMEOUT = std::chrono::milliseconds(5000);
+
+        struct Fragment
+        {
+            uint16_t sequence;
+            bool more;
+            std::string bytes;
+            bool sent = false;
+        };
+
+        struct Early
+        {
+            bool more;
+            std::string bytes;
+        };
+
+        static uint16_t ReadU16(const uint8_t* buf)
+        {
+            return uint16_t((buf[0] << 8) | buf[1]);
+        }
+
+        static void WriteU16(uint8_t* buf, uint16_t value)
+        {
+            buf[0] = uint8_t(value >> 8);
+            buf[1] = uint8_t(value);
+        }
+
+        void WriteHeader(uint8_t* buf, uint8_t flags) const
+        {
+            buf[0] = MARKER;
+            buf[1] = MARKER;
+            buf[2] = flags;
+            WriteU16(buf + 3, _received);
+        }
+
+        uint16_t _next_sequence = 0;
+        // fragments the other end hasn't acked yet, oldest first; only the first WINDOW are sent
+        std::deque<Fragment> _unacked;
+        time_point _resend_at;
+        // how many fragments have arrived in order, which wraps, and the ones that arrived early
+        uint16_t _received = 0;
+        std::unordered_map<uint16_t, Early> _early;
+        // the fragments of a message whose last fragment hasn't arrived yet
+        std::string _partial;
+        bool _ack_due = false;
+        time_point _last_sent;
+        time_point _last_heard;
+    };
+} // namespace ReliableChannel
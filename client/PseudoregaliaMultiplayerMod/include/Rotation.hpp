@@ -0,0 +1,115 @@
+#pragma once
+
+#include <cmath>
+
+namespace Rotation
+{
+    // A unit quaternion, for interpolating rotations without the wraparound and gimbal problems of euler angles.
+    struct Quat
+    {
+        double w;
+        double x;
+        double y;
+        double z;
+    };
+
+    namespace Detail
+    {
+        constexpr double PI = 3.14159265358979323846;
+        constexpr double DEG_TO_RAD = PI / 180.0;
+        constexpr double RAD_TO_DEG = 180.0 / PI;
+    }
+
+    // Converts a rotator, in degrees, to a quaternion. x, y and z are roll, pitch and yaw, the same as a broken
+    // rotator in blueprints, and the conversion matches FRotator::Quaternion.
+    inline Quat FromRotator(double x, double y, double z)
+    {
+        double sr = std::sin(x * Detail::DEG_TO_RAD / 2.0);
+        double cr = std::cos(x * Detail::DEG_TO_RAD / 2.0);
+        double sp = std::sin(y * Detail::DEG_TO_RAD / 2.0);
+        double cp = std::cos(y * Detail::DEG_TO_RAD / 2.0);
+        double sy = std::sin(z * Detail::DEG_TO_RAD / 2.0);
+        double cy = std::cos(z * Detail::DEG_TO_RAD / 2.0);
+        return Quat
+        {
+            .w = cr * cp * cy + sr * sp * sy,
+            .x = cr * sp * sy - sr * cp * cy,
+            .y = -cr * sp * cy - sr * cp * sy,
+            .z = cr * cp * sy - sr * sp * cy,
+        };
+    }
+
+    // Converts a quaternion back to a rotator in degrees, matching FQuat::Rotator. See FromRotator for the order of
+    // x, y and z.
+    inline void ToRotator(const Quat& q, double& x, double& y, double& z)
+    {
+        // past this, pitch is close enough to straight up or down that roll and yaw can't be told apart
+        const double SINGULARITY_THRESHOLD = 0.4999995;
+
+        double singularity_test = q.z * q.x - q.w * q.y;
+        double yaw_y = 2.0 * (q.w * q.z + q.x * q.y);
+        double yaw_x = 1.0 - 2.0 * (q.y * q.y + q.z * q.z);
+        z = std::atan2(yaw_y, yaw_x) * Detail::RAD_TO_DEG;
+        if (singularity_test < -SINGULARITY_THRESHOLD)
+        {
+            y = -90.0;
+            x = std::remainder(-z - 2.0 * std::atan2(q.x, q.w) * Detail::RAD_TO_DEG, 360.0);
+        }
+        else if (singularity_test > SINGULARITY_THRESHOLD)
+        {
+            y = 90.0;
+            x = std::remainder(z - 2.0 * std::atan2(q.x, q.w) * Detail::RAD_TO_DEG, 360.0);
+        }
+        else
+        {
+            y = std::asin(2.0 * singularity_test) * Detail::RAD_TO_DEG;
+            x = std::atan2(-2.0 * (q.w * q.x + q.y * q.z), 1.0 - 2.0 * (q.x * q.x + q.y * q.y)) * Detail::RAD_TO_DEG;
+        }
+    }
+
+    // Spherically interpolates from a to b along the shorter arc. t is clamped to [0, 1].
+    inline Quat Slerp(const Quat& a, const Quat& b, double t)
+    {
+        t = t < 0.0 ? 0.0 : (t > 1.0 ? 1.0 : t);
+
+        // q and -q are the same rotation; flipping b when they point apart takes the shorter arc
+        double dot = a.w * b.w + a.x * b.x + a.y * b.y + a.z * b.z;
+        double sign = 1.0;
+        if (dot < 0.0)
+        {
+            dot = -dot;
+            sign = -1.0;
+        }
+
+        double wa;
+        double wb;
+        if (dot > 0.9995)
+        {
+            // nearly the same rotation, where the sines below lose precision; a normalized lerp is just as good
+            wa = 1.0 - t;
+            wb = t;
+        }
+        else
+        {
+            double theta = std::acos(dot);
+            double sin_theta = std::sin(theta);
+            wa = std::sin((1.0 - t) * theta) / sin_theta;
+            wb = std::sin(t * theta) / sin_theta;
+        }
+        wb *= sign;
+
+        Quat q
+        {
+            .w = wa * a.w + wb * b.w,
+            .x = wa * a.x + wb * b.x,
+            .y = wa * a.y + wb * b.y,
+            .z = wa * a.z + wb * b.z,
+        };
+        double length = std::sqrt(q.w * q.w + q.x * q.x + q.y * q.y + q.z * q.z);
+        q.w /= length;
+        q.x /= length;
+        q.y /= length;
+        q.z /= length;
+        return q;
+    }
+} // namespace Rotation
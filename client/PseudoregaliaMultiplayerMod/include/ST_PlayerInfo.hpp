@@ -11,7 +11,7 @@ struct FST_PlayerInfo
     double rotation_x;                // 0x0018 (size: 0x8)
     double rotation_y;                // 0x0020 (size: 0x8)
     double rotation_z;                // 0x0028 (size: 0x8)
-    RC::Unreal::FString name;         // 0x0030 (size: 0x10)
+    RC::Unreal::FString name;         // 0x0030 (size: 0x10) only filled in on the frame a ghost is spawned
     uint8_t id;                       // 0x0040 (size: 0x1)
     uint8_t red;                      // 0x0041 (size: 0x1)
     uint8_t green;                    // 0x0042 (size: 0x1)
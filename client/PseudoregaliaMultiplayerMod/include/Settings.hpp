@@ -10,4 +10,13 @@ namespace Settings
     const std::string& GetPort();
     const std::array<uint8_t, 3>& GetColor();
     const std::string& GetName();
+    bool GetThreadedNetwork();
+    double GetUnderrunTarget();
+    double GetExtrapolationMillis();
+    double GetSendRate();
+    double GetSendErrorThreshold();
+    bool GetDeltaCompression();
+    double GetSendRedundancy();
+    bool GetSnapshots();
+    bool GetUdpTransport();
 }
@@ -0,0 +1,262 @@
+#pragma once
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+
+#include "PacketLayout.hpp"
+
+#if defined(_M_X64) || defined(__x86_64__)
+#define STATE_BATCH_X86 1
+#include <immintrin.h>
+#if defined(_MSC_VER)
+#include <intrin.h>
+#endif
+#endif
+
+// msvc lets any function use any intrinsic, but gcc and clang only allow them in functions built for that instruction
+// set
+#if defined(STATE_BATCH_X86) && defined(__GNUC__)
+#define STATE_BATCH_TARGET(isa) __attribute__((target(isa)))
+#else
+#define STATE_BATCH_TARGET(isa)
+#endif
+
+namespace StateBatch
+{
+    // each rotation is a byte, so -180 maps to 0 and just under 180 maps to 255
+    typedef PacketLayout::Quantized<-180, 180, 8> Rotator;
+
+    // The 24 byte state format: the sender's id and the state's millis, then its zone, location and rotation.
+    typedef PacketLayout::Layout<PacketLayout::U8, PacketLayout::U32> Header;
+    typedef PacketLayout::Layout<
+        PacketLayout::U32,
+        PacketLayout::F32,
+        PacketLayout::F32,
+        PacketLayout::F32,
+        Rotator,
+        Rotator,
+        Rotator
+    > Body;
+    const size_t RECORD_LEN = Header::BYTES + Body::BYTES;
+    static_assert(RECORD_LEN == 24);
+    // The start of a record up to its transform, which is all a state from another zone needs.
+    typedef PacketLayout::Layout<PacketLayout::U8, PacketLayout::U32, PacketLayout::U32> Prefix;
+
+    struct DecodedState
+    {
+        uint32_t millis;
+        uint32_t zone;
+        std::array<double, 3> location;
+        std::array<double, 3> rotation;
+        uint8_t id;
+    };
+
+    enum class Path : uint8_t
+    {
+        Scalar,
+        Ssse3,
+        Avx2,
+    };
+
+    inline const wchar_t* PathName(Path path)
+    {
+        switch (path)
+        {
+        case Path::Ssse3:
+            return L"SSSE3";
+        case Path::Avx2:
+            return L"AVX2";
+        default:
+            return L"scalar";
+        }
+    }
+
+    // Decodes states through the generic layouts, for cpus without SSSE3.
+    inline void DecodeScalar(const uint8_t* data, size_t count, DecodedState* out)
+    {
+        BitStream::BitReader reader(data, count * RECORD_LEN);
+        for (size_t i = 0; i < count; i++)
+        {
+            auto [id, millis] = Header::read(reader);
+            auto [zone, x, y, z, rotation_x, rotation_y, rotation_z] = Body::read(reader);
+            out[i] = DecodedState
+            {
+                .millis = millis,
+                .zone = zone,
+                .location = { x, y, z },
+                .rotation = { rotation_x, rotation_y, rotation_z },
+                .id = id,
+            };
+        }
+    }
+
+#if defined(STATE_BATCH_X86)
+    // Each record is read as two overlapping 16 byte loads, one at its start and one 8 bytes in, so the last record
+    // in a packet never reads past its end. A byte shuffle then swaps every big endian field into place in one step.
+    // From the first load, millis and zone:
+    #define STATE_BATCH_HEADER_ORDER 4, 3, 2, 1, 8, 7, 6, 5, -1, -1, -1, -1, -1, -1, -1, -1
+    // and from the second, the three location floats and each rotation byte widened to an int32:
+    #define STATE_BATCH_LOCATION_ORDER 4, 3, 2, 1, 8, 7, 6, 5, 12, 11, 10, 9, -1, -1, -1, -1
+    #define STATE_BATCH_ROTATION_ORDER 13, -1, -1, -1, 14, -1, -1, -1, 15, -1, -1, -1, -1, -1, -1, -1
+
+    // Rotator::dequantize as a multiply and add. Both are exact for byte steps, so the results match it bit for bit.
+    const double ROTATION_STEP = 360.0 / 256.0;
+    const double ROTATION_MIN = -180.0;
+
+    STATE_BATCH_TARGET("ssse3")
+    inline void DecodeSsse3(const uint8_t* data, size_t count, DecodedState* out)
+    {
+        const __m128i header_order = _mm_setr_epi8(STATE_BATCH_HEADER_ORDER);
+        const __m128i location_order = _mm_setr_epi8(STATE_BATCH_LOCATION_ORDER);
+        const __m128i rotation_order = _mm_setr_epi8(STATE_BATCH_ROTATION_ORDER);
+        const __m128d step = _mm_set1_pd(ROTATION_STEP);
+        const __m128d min = _mm_set1_pd(ROTATION_MIN);
+        for (size_t i = 0; i < count; i++)
+        {
+            const uint8_t* record = data + i * RECORD_LEN;
+            __m128i front = _mm_loadu_si128(reinterpret_cast<const __m128i*>(record));
+            __m128i back = _mm_loadu_si128(reinterpret_cast<const __m128i*>(record + 8));
+            DecodedState& state = out[i];
+            state.id = record[0];
+
+            __m128i header = _mm_shuffle_epi8(front, header_order);
+            state.millis = uint32_t(_mm_cvtsi128_si32(header));
+            state.zone = uint32_t(_mm_cvtsi128_si32(_mm_srli_si128(header, 4)));
+
+            __m128 location = _mm_castsi128_ps(_mm_shuffle_epi8(back, location_order));
+            _mm_storeu_pd(&state.location[0], _mm_cvtps_pd(location));
+            _mm_store_sd(&state.location[2], _mm_cvtps_pd(_mm_movehl_ps(location, location)));
+
+            __m128i steps = _mm_shuffle_epi8(back, rotation_order);
+            __m128d rotation_xy = _mm_add_pd(_mm_mul_pd(_mm_cvtepi32_pd(steps), step), min);
+            __m128d rotation_z = _mm_add_pd(_mm_mul_pd(_mm_cvtepi32_pd(_mm_srli_si128(steps, 8)), step), min);
+            _mm_storeu_pd(&state.rotation[0], rotation_xy);
+            _mm_store_sd(&state.rotation[2], rotation_z);
+        }
+    }
+
+    // Stores the first three doubles of value.
+    STATE_BATCH_TARGET("avx2")
+    inline void Store3(double* out, __m256d value)
+    {
+        _mm_storeu_pd(out, _mm256_castpd256_pd128(value));
+        _mm_store_sd(out + 2, _mm256_extractf128_pd(value, 1));
+    }
+
+    // Loads 16 bytes from first into the low half and 16 bytes from the next record into the high half.
+    STATE_BATCH_TARGET("avx2")
+    inline __m256i LoadPair(const uint8_t* first)
+    {
+        __m128i low = _mm_loadu_si128(reinterpret_cast<const __m128i*>(first));
+        __m128i high = _mm_loadu_si128(reinterpret_cast<const __m128i*>(first + RECORD_LEN));
+        return _mm256_inserti128_si256(_mm256_castsi128_si256(low), high, 1);
+    }
+
+    // Fills in one record's state from its half of the shuffled registers.
+    STATE_BATCH_TARGET("avx2")
+    inline void StoreHalf(const uint8_t* record, __m128i header, __m128 location, __m128i steps, DecodedState& state)
+    {
+        state.id = record[0];
+        state.millis = uint32_t(_mm_cvtsi128_si32(header));
+        state.zone = uint32_t(_mm_cvtsi128_si32(_mm_srli_si128(header, 4)));
+        Store3(state.location.data(), _mm256_cvtps_pd(location));
+        __m256d rotation = _mm256_cvtepi32_pd(steps);
+        rotation = _mm256_add_pd(_mm256_mul_pd(rotation, _mm256_set1_pd(ROTATION_STEP)), _mm256_set1_pd(ROTATION_MIN));
+        Store3(state.rotation.data(), rotation);
+    }
+
+    // Like DecodeSsse3, but two records at a time, one in each half of the 256 bit registers. The location floats and
+    // rotation steps of a record are widened to doubles in a single instruction each.
+    STATE_BATCH_TARGET("avx2")
+    inline void DecodeAvx2(const uint8_t* data, size_t count, DecodedState* out)
+    {
+        const __m256i header_order = _mm256_setr_epi8(STATE_BATCH_HEADER_ORDER, STATE_BATCH_HEADER_ORDER);
+        const __m256i location_order = _mm256_setr_epi8(STATE_BATCH_LOCATION_ORDER, STATE_BATCH_LOCATION_ORDER);
+        const __m256i rotation_order = _mm256_setr_epi8(STATE_BATCH_ROTATION_ORDER, STATE_BATCH_ROTATION_ORDER);
+        size_t i = 0;
+        for (; i + 2 <= count; i += 2)
+        {
+            const uint8_t* record = data + i * RECORD_LEN;
+            __m256i front = LoadPair(record);
+            __m256i back = LoadPair(record + 8);
+            __m256i header = _mm256_shuffle_epi8(front, header_order);
+            __m256 location = _mm256_castsi256_ps(_mm256_shuffle_epi8(back, location_order));
+            __m256i steps = _mm256_shuffle_epi8(back, rotation_order);
+            StoreHalf(
+                record,
+                _mm256_castsi256_si128(header),
+                _mm256_castps256_ps128(location),
+                _mm256_castsi256_si128(steps),
+                out[i]);
+            StoreHalf(
+                record + RECORD_LEN,
+                _mm256_extracti128_si256(header, 1),
+                _mm256_extractf128_ps(location, 1),
+                _mm256_extracti128_si256(steps, 1),
+                out[i + 1]);
+        }
+        if (i < count)
+        {
+            DecodeSsse3(data + i * RECORD_LEN, count - i, out + i);
+        }
+    }
+
+    #undef STATE_BATCH_HEADER_ORDER
+    #undef STATE_BATCH_LOCATION_ORDER
+    #undef STATE_BATCH_ROTATION_ORDER
+#endif
+
+    // Returns the fastest path this cpu supports.
+    inline Path DetectPath()
+    {
+#if defined(STATE_BATCH_X86) && defined(_MSC_VER)
+        int info[4];
+        __cpuid(info, 0);
+        int max_leaf = info[0];
+        __cpuid(info, 1);
+        bool ssse3 = info[2] & (1 << 9);
+        // avx registers also need the os to save them on context switches
+        bool os_avx = (info[2] & (1 << 27)) && (info[2] & (1 << 28)) && (_xgetbv(0) & 6) == 6;
+        bool avx2 = false;
+        if (os_avx && max_leaf >= 7)
+        {
+            __cpuidex(info, 7, 0);
+            avx2 = info[1] & (1 << 5);
+        }
+        return avx2 ? Path::Avx2 : ssse3 ? Path::Ssse3 : Path::Scalar;
+#elif defined(STATE_BATCH_X86)
+        // also checks that the os saves avx registers
+        return __builtin_cpu_supports("avx2") ? Path::Avx2
+            : __builtin_cpu_supports("ssse3") ? Path::Ssse3
+            : Path::Scalar;
+#else
+        return Path::Scalar;
+#endif
+    }
+
+    inline Path SelectedPath()
+    {
+        static const Path path = DetectPath();
+        return path;
+    }
+
+    // Decodes count consecutive records from data into out in one pass, using the fastest path the cpu supports.
+    inline void Decode(const uint8_t* data, size_t count, DecodedState* out)
+    {
+#if defined(STATE_BATCH_X86)
+        switch (SelectedPath())
+        {
+        case Path::Avx2:
+            DecodeAvx2(data, count, out);
+            return;
+        case Path::Ssse3:
+            DecodeSsse3(data, count, out);
+            return;
+        default:
+            break;
+        }
+#endif
+        DecodeScalar(data, count, out);
+    }
+} // namespace StateBatch
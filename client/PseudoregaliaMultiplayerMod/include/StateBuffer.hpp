@@ -0,0 +1,122 @@
+#pragma once
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <utility>
+
+namespace StateBuffer
+{
+    // A fixed-capacity ring buffer that keeps its elements sorted by their millis field, oldest first. Storage is
+    // inline, so nothing is allocated after construction. T must have a uint32_t millis member.
+    template<typename T, size_t CAPACITY>
+    class StateBuffer
+    {
+        static_assert(CAPACITY > 0);
+
+    public:
+        size_t size() const
+        {
+            return _size;
+        }
+
+        bool empty() const
+        {
+            return _size == 0;
+        }
+
+        void clear()
+        {
+            _head = 0;
+            _size = 0;
+        }
+
+        // i is a logical index, so 0 is always the oldest element and size() - 1 is always the newest
+        const T& operator[](size_t i) const
+        {
+            return _elems[Physical(i)];
+        }
+
+        const T& front() const
+        {
+            return (*this)[0];
+        }
+
+        const T& back() const
+        {
+            return (*this)[_size - 1];
+        }
+
+        // Returns the logical index of the first element whose millis is not less than millis, or size() if there is
+        // no such element.
+        size_t lower_bound(uint32_t millis) const
+        {
+            size_t lo = 0;
+            size_t hi = _size;
+            while (lo < hi)
+            {
+                size_t mid = lo + (hi - lo) / 2;
+                if ((*this)[mid].millis < millis)
+                {
+                    lo = mid + 1;
+                }
+                else
+                {
+                    hi = mid;
+                }
+            }
+            return lo;
+        }
+
+        // Returns whether an element with this millis would be kept by insert, ie it isn't a duplicate and, if the
+        // buffer is full, it isn't older than everything already in it.
+        bool can_insert(uint32_t millis) const
+        {
+            // most elements arrive in order, so check for a new latest element before searching
+            if (_size == 0 || millis > back().millis)
+            {
+                return true;
+            }
+
+            size_t i = lower_bound(millis);
+            if (i < _size && (*this)[i].millis == millis)
+            {
+                return false;
+            }
+            return _size < CAPACITY || front().millis < millis;
+        }
+
+        // should only be called if can_insert returns true; otherwise the buffer can include duplicates or the oldest
+        // element can be dropped in favor of an even older one
+        void insert(T elem)
+        {
+            size_t i = (_size == 0 || elem.millis > back().millis) ? _size : lower_bound(elem.millis);
+            if (_size == CAPACITY)
+            {
+                // drop the oldest element; can_insert guarantees elem doesn't belong before it, so i is at least 1
+                _head = Physical(1);
+                _size--;
+                i--;
+            }
+
+            // shift everything after the insertion point back by one; this is at most CAPACITY moves, but elements
+            // usually arrive in order so it's almost always zero
+            for (size_t j = _size; j > i; j--)
+            {
+                _elems[Physical(j)] = std::move(_elems[Physical(j - 1)]);
+            }
+            _elems[Physical(i)] = std::move(elem);
+            _size++;
+        }
+
+    private:
+        std::array<T, CAPACITY> _elems{};
+        size_t _head = 0;
+        size_t _size = 0;
+
+        size_t Physical(size_t i) const
+        {
+            return (_head + i) % CAPACITY;
+        }
+    };
+} // namespace StateBuffer
@@ -1,37 +1,185 @@
 #pragma once
 
+#include <span>
+#include <vector>
+
 #include <boost/asio.hpp>
 #include <boost/array.hpp>
-#include <boost/bind.hpp>
+
+#if defined(__linux__)
+#include <sys/socket.h>
+#endif
 
 namespace UdpSocket
 {
     using boost::asio::ip::udp;
 
+    // Storage for one outstanding asio handler at a time. Handlers that fit are constructed here instead of on the
+    // heap; anything bigger, or a second handler while the first is still alive, falls back to operator new and is
+    // counted in overflows.
+    class HandlerMemory
+    {
+    public:
+        HandlerMemory() = default;
+        HandlerMemory(const HandlerMemory&) = delete;
+        HandlerMemory& operator=(const HandlerMemory&) = delete;
+
+        void* allocate(std::size_t size)
+        {
+            if (!_in_use && size <= sizeof(_storage))
+            {
+                _in_use = true;
+                return &_storage;
+            }
+            overflows++;
+            return ::operator new(size);
+        }
+
+        void deallocate(void* pointer)
+        {
+            if (pointer == &_storage)
+            {
+                _in_use = false;
+            }
+            else
+            {
+                ::operator delete(pointer);
+            }
+        }
+
+        uint64_t overflows = 0;
+
+    private:
+        // big enough for a send or receive op on both the reactor and IOCP backends
+        alignas(std::max_align_t) unsigned char _storage[512];
+        bool _in_use = false;
+    };
+
+    // A minimal allocator that gets its memory from a HandlerMemory, for binding to handlers with bind_allocator.
+    template<typename T>
+    class HandlerAllocator
+    {
+    public:
+        typedef T value_type;
+
+        explicit HandlerAllocator(HandlerMemory& memory) : _memory(memory) {}
+
+        template<typename U>
+        HandlerAllocator(const HandlerAllocator<U>& other) noexcept : _memory(other._memory) {}
+
+        bool operator==(const HandlerAllocator& other) const noexcept
+        {
+            return &_memory == &other._memory;
+        }
+
+        bool operator!=(const HandlerAllocator& other) const noexcept
+        {
+            return &_memory != &other._memory;
+        }
+
+        T* allocate(std::size_t n) const
+        {
+            return static_cast<T*>(_memory.allocate(sizeof(T) * n));
+        }
+
+        void deallocate(T* pointer, std::size_t) const
+        {
+            _memory.deallocate(pointer);
+        }
+
+    private:
+        template<typename> friend class HandlerAllocator;
+
+        HandlerMemory& _memory;
+    };
+
+    template<size_t RECV>
+    struct Datagram
+    {
+        boost::array<uint8_t, RECV> buf;
+        size_t len;
+    };
+
+    struct Stats
+    {
+        // times the receive queue was drained, and the total datagrams read across all of them
+        uint64_t drains = 0;
+        uint64_t datagrams = 0;
+        // most datagrams read in a single drain
+        uint64_t max_drain = 0;
+        // datagrams that didn't fit in the receive buffer and were dropped
+        uint64_t truncated = 0;
+        // sends that were dropped because every send buffer was still in flight
+        uint64_t send_pool_exhausted = 0;
+        // handlers that didn't fit in their preallocated memory and went to the heap
+        uint64_t handler_overflows = 0;
+    };
+
     // A simple wrapper around boost udp sockets with a similar interface to wswrap
     template<size_t SEND, size_t RECV>
     class UdpSocket
     {
     public:
-        // this will still be fired if the message doesn't fit inside the buffer, so use the len param to handle that
-        // before reading from the buffer
-        typedef std::function<void(const boost::array<uint8_t, RECV>&, size_t)> on_recv_handler;
+        // receives every datagram that was waiting on the socket at once, oldest first. a datagram that didn't fit
+        // inside the buffer may still be included with the length of the buffer, so check len before reading
+        typedef std::function<void(std::span<const Datagram<RECV>>)> on_recv_handler;
         typedef std::function<void(const std::string&)> on_err_handler;
+        typedef std::function<void(const boost::system::error_code&, const udp::endpoint&)> on_resolve_handler;
 
-        UdpSocket(const std::string& address, const std::string& port, on_recv_handler on_recv, on_err_handler on_err)
-            : _socket(_io_service), _resolver(_io_service), _endpoint(*_resolver.resolve({ udp::v4(), address, port }))
-            , _on_recv(on_recv), _on_err(on_err)
+        UdpSocket(on_recv_handler on_recv, on_err_handler on_err)
+            : _socket(_io_service), _resolver(_io_service), _recv_batch(2 * RECV_BATCH), _on_recv(on_recv),
+              _on_err(on_err)
         {
             _socket.open(udp::v4());
+            // the first datagram of a drain is waited for asynchronously; the rest are read without blocking
+            _socket.non_blocking(true);
+        }
+
+        // Starts looking up address and port in the background. on_resolve is called from Poll or RunUntil once the
+        // lookup finishes, with the endpoint sends will go to. Nothing should be sent before it succeeds.
+        void AsyncResolve(const std::string& address, const std::string& port, on_resolve_handler on_resolve)
+        {
+            _resolver.async_resolve(udp::v4(), address, port,
+                [this, on_resolve](const boost::system::error_code& error, udp::resolver::results_type results)
+                {
+                    if (!error)
+                    {
+                        // a successful lookup always has at least one result
+                        _endpoint = *results.begin();
+                    }
+                    on_resolve(error, _endpoint);
+                });
         }
 
-        void Send(const boost::array<uint8_t, SEND>& buf, size_t len = SEND)
+        // Copies buf into a free send buffer and starts sending it. Nothing is allocated; if every send buffer is still
+        // in flight, the send is dropped and counted in Stats::send_pool_exhausted. Returns whether the send started.
+        bool Send(const boost::array<uint8_t, SEND>& buf, size_t len = SEND)
         {
-            auto shared_buf = std::make_shared<boost::array<uint8_t, SEND>>(buf);
-            // the buffer doesn't take ownership of the shared_ptr, so we pass it to HandleSend so it stays alive until
-            // the callback fires
-            _socket.async_send_to(boost::asio::buffer(*shared_buf, len), _endpoint,
-                boost::bind(&UdpSocket::HandleSend, this, shared_buf, boost::asio::placeholders::error));
+            SendSlot* slot = nullptr;
+            for (auto& send_slot : _send_slots)
+            {
+                if (!send_slot.in_use)
+                {
+                    slot = &send_slot;
+                    break;
+                }
+            }
+            if (!slot)
+            {
+                _stats.send_pool_exhausted++;
+                return false;
+            }
+
+            slot->in_use = true;
+            slot->buf = buf;
+            _socket.async_send_to(boost::asio::buffer(slot->buf, len), _endpoint,
+                boost::asio::bind_allocator(HandlerAllocator<int>(slot->memory),
+                    [this, slot](const boost::system::error_code& error, std::size_t)
+                    {
+                        slot->in_use = false;
+                        HandleSend(error);
+                    }));
+            return true;
         }
 
         void Poll()
@@ -41,30 +189,69 @@ namespace UdpSocket
             _io_service.reset();
         }
 
+        // Runs handlers until deadline, waiting for new ones to become ready. Returns early if there is no pending work,
+        // which is the case between the lookup finishing and the first send starting to receive.
+        void RunUntil(const std::chrono::steady_clock::time_point& deadline)
+        {
+            _io_service.run_until(deadline);
+            _io_service.restart();
+        }
+
+        Stats GetStats() const
+        {
+            Stats stats = _stats;
+            stats.handler_overflows = _recv_memory.overflows;
+            for (const auto& slot : _send_slots)
+            {
+                stats.handler_overflows += slot.memory.overflows;
+            }
+            return stats;
+        }
+
     private:
+        // the most datagrams read by one call while draining
+        static const size_t RECV_BATCH = 32;
+
+        // updates go out once a frame and each send normally completes within the next poll, so a handful of buffers
+        // covers even a long hitch
+        static const size_t SEND_SLOTS = 8;
+
+        struct SendSlot
+        {
+            boost::array<uint8_t, SEND> buf{};
+            HandlerMemory memory;
+            bool in_use = false;
+        };
+
         boost::asio::io_service _io_service;
         udp::socket _socket;
         udp::resolver _resolver;
         udp::endpoint _endpoint;
         udp::endpoint _sender_endpoint;
-        boost::array<uint8_t, RECV> _recv_buf{};
+        // every datagram of the current drain. it grows when a drain is longer than any before, eg after a hitch, and
+        // keeps its size, so drains don't allocate once it's big enough. the socket's receive buffer bounds it
+        std::vector<Datagram<RECV>> _recv_batch;
+        HandlerMemory _recv_memory;
+        std::array<SendSlot, SEND_SLOTS> _send_slots{};
         bool _started_receive = false;
+        Stats _stats{};
 
         on_recv_handler _on_recv;
         on_err_handler _on_err;
 
         void StartReceive()
         {
-            _socket.async_receive_from(boost::asio::buffer(_recv_buf), _sender_endpoint,
-                boost::bind(&UdpSocket::HandleReceive, this, boost::asio::placeholders::error,
-                    boost::asio::placeholders::bytes_transferred));
+            _socket.async_receive_from(boost::asio::buffer(_recv_batch[0].buf), _sender_endpoint,
+                boost::asio::bind_allocator(HandlerAllocator<int>(_recv_memory),
+                    [this](const boost::system::error_code& error, std::size_t len) { HandleReceive(error, len); }));
         }
 
         void HandleReceive(const boost::system::error_code& error, std::size_t len)
         {
             if (!error || error == boost::asio::error::message_size)
             {
-                _on_recv(_recv_buf, len);
+                _recv_batch[0].len = len;
+                Drain(1);
             }
             else
             {
@@ -74,7 +261,103 @@ namespace UdpSocket
             StartReceive();
         }
 
-        void HandleSend(std::shared_ptr<boost::array<uint8_t, SEND>>, const boost::system::error_code& error)
+        // Reads every datagram still waiting on the socket and hands them all to on_recv at once, so it can pick the
+        // newest of the whole drain. The first count entries of _recv_batch have already been filled.
+        void Drain(size_t count)
+        {
+            while (true)
+            {
+                if (_recv_batch.size() < count + RECV_BATCH)
+                {
+                    _recv_batch.resize(count + RECV_BATCH);
+                }
+                // every slot the read was given was used, so there may be more waiting
+                bool more = false;
+                count += ReadAvailable(count, more);
+                if (!more)
+                {
+                    break;
+                }
+            }
+            _on_recv(std::span<const Datagram<RECV>>(_recv_batch.data(), count));
+
+            _stats.drains++;
+            _stats.datagrams += count;
+            _stats.max_drain = std::max(_stats.max_drain, uint64_t(count));
+        }
+
+#if defined(__linux__)
+        // Reads up to RECV_BATCH waiting datagrams into _recv_batch from index start with a single recvmmsg call.
+        // Returns how many were kept, and sets more if the call filled every slot it was given, truncated datagrams
+        // included.
+        size_t ReadAvailable(size_t start, bool& more)
+        {
+            std::array<mmsghdr, RECV_BATCH> headers{};
+            std::array<iovec, RECV_BATCH> vecs{};
+            size_t max = RECV_BATCH;
+            for (size_t i = 0; i < max; i++)
+            {
+                vecs[i].iov_base = _recv_batch[start + i].buf.data();
+                vecs[i].iov_len = RECV;
+                headers[i].msg_hdr.msg_iov = &vecs[i];
+                headers[i].msg_hdr.msg_iovlen = 1;
+            }
+
+            int read = ::recvmmsg(_socket.native_handle(), headers.data(), unsigned(max), MSG_DONTWAIT, nullptr);
+            if (read <= 0)
+            {
+                // nothing left to read, or an error the next async receive will report
+                return 0;
+            }
+            more = size_t(read) == max;
+
+            // drop truncated datagrams by compacting the ones that fit towards the front
+            size_t kept = 0;
+            for (size_t i = 0; i < size_t(read); i++)
+            {
+                if (headers[i].msg_hdr.msg_flags & MSG_TRUNC)
+                {
+                    _stats.truncated++;
+                    continue;
+                }
+                if (kept != i)
+                {
+                    _recv_batch[start + kept].buf = _recv_batch[start + i].buf;
+                }
+                _recv_batch[start + kept].len = headers[i].msg_len;
+                kept++;
+            }
+            return kept;
+        }
+#else
+        // Reads waiting datagrams into _recv_batch from index start until none are left or RECV_BATCH have been read.
+        // Returns how many were read, and sets more if it stopped at RECV_BATCH.
+        size_t ReadAvailable(size_t start, bool& more)
+        {
+            size_t read = 0;
+            while (read < RECV_BATCH)
+            {
+                boost::system::error_code error;
+                auto& datagram = _recv_batch[start + read];
+                datagram.len = _socket.receive_from(boost::asio::buffer(datagram.buf), _sender_endpoint, 0, error);
+                if (error == boost::asio::error::message_size)
+                {
+                    _stats.truncated++;
+                    continue;
+                }
+                if (error)
+                {
+                    // would_block means the queue is empty; anything else will be reported by the next async receive
+                    break;
+                }
+                read++;
+            }
+            more = read == RECV_BATCH;
+            return read;
+        }
+#endif
+
+        void HandleSend(const boost::system::error_code& error)
         {
             if (error)
             {
@@ -88,7 +371,6 @@ namespace UdpSocket
                 StartReceive();
                 _started_receive = true;
             }
-
         }
     };
 } // namespace UdpSocket
@@ -0,0 +1,48 @@
+#include "AllocationCounter.hpp"
+
+#ifdef PM_COUNT_ALLOCATIONS
+
+#include <cstdlib>
+#include <new>
+
+namespace
+{
+    // thread local so allocations made by other threads don't show up when checking the game thread
+    thread_local uint64_t allocations = 0;
+}
+
+// Replacing these replaces allocations for the whole mod. The array and nothrow forms call these by default, so they
+// get counted too.
+void* operator new(std::size_t size)
+{
+    allocations++;
+    if (void* ptr = std::malloc(size == 0 ? 1 : size))
+    {
+        return ptr;
+    }
+    throw std::bad_alloc();
+}
+
+void operator delete(void* ptr) noexcept
+{
+    std::free(ptr);
+}
+
+void operator delete(void* ptr, std::size_t) noexcept
+{
+    std::free(ptr);
+}
+
+uint64_t AllocationCounter::Get()
+{
+    return allocations;
+}
+
+#else
+
+uint64_t AllocationCounter::Get()
+{
+    return 0;
+}
+
+#endif
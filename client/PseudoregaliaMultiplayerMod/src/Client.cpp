@@ -2,10 +2,14 @@
 
 #include "Client.hpp"
 
-#include <bit>
+#include <atomic>
+#include <bitset>
 #include <chrono>
+#include <cmath>
 #include <codecvt>
+#include <cstring>
 #include <queue>
+#include <thread>
 
 #define WSWRAP_NO_SSL
 #define WSWRAP_NO_COMPRESSION
@@ -16,29 +20,142 @@
 #include "wswrap.hpp"
 #include "nlohmann/json.hpp"
 
+#include <boost/lockfree/spsc_queue.hpp>
+
 #include "Unreal/FString.hpp"
 
+#include "ClockSync.hpp"
+#include "ControlMessage.hpp"
+#include "Delta.hpp"
+#include "Interpolation.hpp"
+#include "LinkStats.hpp"
 #include "Logger.hpp"
+#include "PacketLayout.hpp"
+#include "PlayoutDelay.hpp"
+#include "ReliableChannel.hpp"
+#include "Rotation.hpp"
 #include "Settings.hpp"
+#include "StateBatch.hpp"
+#include "StateBuffer.hpp"
 #include "UdpSocket.hpp"
 
 namespace
 {
-    const size_t STATE_LEN = 24;
-    const size_t MAX_STATES_PER_PACKET = 21;
+    using PacketLayout::Layout;
+    using PacketLayout::U8;
+    using PacketLayout::U16;
+    using PacketLayout::U32;
+    using StateBatch::Rotator;
+
+    // a state is the sender's id and the state's millis, then its zone, location and rotation (see StateBatch.hpp)
+    typedef StateBatch::Header StateHeader;
+    typedef StateBatch::Body StateBody;
+    const size_t STATE_LEN = StateBatch::RECORD_LEN;
+    const size_t MAX_STATES_PER_PACKET = PacketLayout::MAX_DATAGRAM_LEN / STATE_LEN;
     const size_t MIN_SERVER_PACKET_LEN = STATE_LEN;
     const size_t MAX_SERVER_PACKET_LEN = MAX_STATES_PER_PACKET * STATE_LEN;
+    static_assert(STATE_LEN == 24 && MAX_STATES_PER_PACKET == 21);
+    // how many states to keep for each player
+    const size_t MAX_STATES = 20;
 
-    const size_t SEND = MIN_SERVER_PACKET_LEN;
+    // a ping is our id and the local millis it was sent at; a pong echoes those millis back followed by the server's
+    // millis. neither length is a multiple of STATE_LEN, so they can't be mistaken for states
+    typedef Layout<U8, U32> Ping;
+    // with wide ids, everything we send starts with WIDE_ID_MARKER, which is never a narrow id, and then our 16 bit id
+    // in place of the usual byte
+    const uint8_t WIDE_ID_MARKER = 255;
+    typedef Layout<U8, U16, U32> WidePing;
+    typedef Layout<U32, U32> Pong;
+    const size_t PING_LEN = Ping::BYTES;
+    const size_t PONG_LEN = Pong::BYTES;
+    static_assert(PING_LEN % STATE_LEN != 0 && PONG_LEN % STATE_LEN != 0);
+    // a poll is just our id, sent instead of an update that was suppressed so the server still replies with states
+    typedef Layout<U8> Poll;
+    const size_t POLL_LEN = Poll::BYTES;
+
+    // in delta mode (see Delta.hpp), an update is our id, flags, the sequence of the newest server packet we fully
+    // decoded, a mask of which packets before that one we also fully decoded if the server agreed to it, our own
+    // sequence if the server agreed to number packets, the update's millis and then its state, and a poll is the same
+    // without the millis and state. the server's packets are a sequence, flags, the millis of the newest of our updates
+    // the server has, a state count, the millis the states are relative to and the tick number if it's a snapshot,
+    // followed by each state's id (16 bits with wide ids, 8 otherwise), its 8 bit sequence if numbered, millis offset
+    // and state
+    typedef Layout<U8, U8, U16> DeltaHeader;
+    typedef Layout<U8, U16, U8, U16> WideDeltaHeader;
+    typedef Layout<U32> DeltaAckMask;
+    typedef Layout<U16> DeltaSequence;
+    typedef Layout<U32> DeltaMillis;
+    typedef Layout<U16, U8, U32, U8, U32> DeltaPacketHeader;
+    typedef Layout<U32> DeltaTick;
+    // the longest a poll can be
+    const size_t DELTA_POLL_LEN = WideDeltaHeader::BYTES + DeltaAckMask::BYTES + DeltaSequence::BYTES;
+    const size_t DELTA_UPDATE_HEADER_LEN = DELTA_POLL_LEN + DeltaMillis::BYTES;
+    const size_t DELTA_PACKET_HEADER_LEN = DeltaPacketHeader::BYTES;
+    const uint8_t DELTA_HAS_STATE = 1;
+    const uint8_t DELTA_HAS_ACK = 2;
+    // set if the state is followed by earlier ones, see Delta::EncodeRedundant
+    const uint8_t DELTA_HAS_REDUNDANT = 4;
+    const uint8_t DELTA_HAS_SEQUENCE = 8;
+    const uint8_t DELTA_HAS_ACK_MASK = 16;
+    const uint8_t DELTA_PACKET_HAS_ACK = 1;
+    // if the server agreed to "snapshots", it sends everyone's states once a tick rather than in reply to our packets.
+    // tick n is at n * TICK_MILLIS on the server's clock
+    const uint8_t DELTA_PACKET_IS_SNAPSHOT = 2;
+    const uint32_t TICK_MILLIS = 33;
+    static_assert(DELTA_PACKET_HEADER_LEN > PONG_LEN);
+
+    // big enough for a delta update with a keyframe and as many earlier states as it can repeat, which is the biggest
+    // packet we send
+    const size_t SEND = DELTA_UPDATE_HEADER_LEN + (Delta::MAX_ENCODED_BITS + Delta::MAX_REDUNDANT_BITS + 7) / 8;
     const size_t RECV = MAX_SERVER_PACKET_LEN;
+    static_assert(SEND >= STATE_LEN && SEND <= PacketLayout::MAX_DATAGRAM_LEN);
+    static_assert(SEND >= DELTA_UPDATE_HEADER_LEN + (Delta::MAX_DELTA_BITS + Delta::MAX_REDUNDANT_BITS + 7) / 8);
+
+    enum class ConnectStage : uint8_t;
+    void EnterStage(ConnectStage);
+    void CheckStageTimeout(const std::chrono::steady_clock::time_point&);
+    void LogConnectTimings();
+
+    bool OpenSockets();
+    void OnResolve(const boost::system::error_code&, const boost::asio::ip::udp::endpoint&);
+    void CloseSockets();
+    void RunNetThread();
+    void DrainNetThread();
 
     void OnOpen();
+    void SendSubscription();
+    void SendControlMessage(const std::string&, bool);
+    void PollControl();
+    void SendControlPacket(const uint8_t*, size_t);
     void OnClose();
     void OnMessage(const std::string&);
+    void HandleMessage(const std::string&);
+    void HandleConnected(const ControlMessage::Connected&);
+    void HandlePlayerJoined(const ControlMessage::PlayerJoined&);
+    void HandlePlayerLeft(const ControlMessage::PlayerLeft&);
     void OnError(const std::string&);
 
-    void OnRecv(const boost::array<uint8_t, RECV>&, size_t);
+    void OnRecv(std::span<const UdpSocket::Datagram<RECV>>);
+    void HandleControlPacket(const boost::array<uint8_t, RECV>&, size_t);
+    void DecodePong(const boost::array<uint8_t, RECV>&, const std::chrono::steady_clock::time_point&);
+    struct ReceivedPong;
+    void HandlePong(const ReceivedPong&);
+    struct ReceivedTick;
+    void HandleTick(const ReceivedTick&);
+    size_t DecodePacket(const boost::array<uint8_t, RECV>&, size_t, const std::chrono::steady_clock::time_point&);
+    size_t DecodeDeltaPacket(
+        const boost::array<uint8_t, RECV>&,
+        size_t,
+        const std::chrono::steady_clock::time_point&);
+    void RecordAck(uint16_t);
+    struct ReceivedState;
+    void DeliverState(const ReceivedState&);
+    bool WantsState(uint16_t, uint32_t);
+    void ApplyState(const ReceivedState&);
+    void TrackSequence(uint16_t, uint8_t, uint32_t, const std::chrono::steady_clock::time_point&);
     void OnErr(const std::string&);
+    struct Ghost;
+    void LogGhostStats(const Ghost&);
 
     std::wstring ToWide(const std::string&);
     uint32_t HashW(const std::wstring&);
@@ -46,265 +163,839 @@ namespace
     RC::Unreal::FString ToFString(const std::string& input);
 
     typedef std::chrono::steady_clock::time_point steady_time_point;
-    uint32_t MillisSinceStart(const steady_time_point&);
+    uint32_t LocalMillis(const steady_time_point&);
+    uint32_t ServerMillis(const steady_time_point&);
     steady_time_point AdvanceNanos();
-    bool TrySendUpdate(const FST_PlayerInfo&, const uint32_t&);
-    void SendUpdate(const FST_PlayerInfo&, const uint32_t&);
-
-    void SerializeU8(uint8_t, boost::array<uint8_t, SEND>&, size_t&);
-    void SerializeU32(uint32_t, boost::array<uint8_t, SEND>&, size_t&);
-    void SerializeF32(float, boost::array<uint8_t, SEND>&, size_t&);
-    void SerializeLocator(double, boost::array<uint8_t, SEND>&, size_t&);
-    void SerializeRotator(double, boost::array<uint8_t, SEND>&, size_t&);
-
-    uint8_t DeserializeU8(const boost::array<uint8_t, RECV>&, size_t&);
-    uint32_t DeserializeU32(const boost::array<uint8_t, RECV>&, size_t&);
-    float DeserializeF32(const boost::array<uint8_t, RECV>&, size_t&);
-    double DeserializeLocator(const boost::array<uint8_t, RECV>&, size_t&);
-    double DeserializeRotator(const boost::array<uint8_t, RECV>&, size_t&);
+    struct Transform;
+    bool TrySendUpdate(const Transform&, const uint32_t&);
+    void SendUpdate(const Transform&, uint32_t);
+    void SendDeltaUpdate(const Transform&, uint32_t);
+    bool ShouldSuppress(const Transform&, uint32_t);
+    void SendPoll();
+    void WriteDeltaHeader(uint8_t, BitStream::BitWriter&);
+    void SendPing(const steady_time_point&);
+    void SendPacket(const boost::array<uint8_t, SEND>&, size_t);
+
+    Delta::QuantizedState Quantize(const Transform&, uint32_t, uint32_t);
+    Transform Dequantize(const Delta::QuantizedState&);
+    const Delta::QuantizedState* FindQuantized(
+        const StateBuffer::StateBuffer<Delta::QuantizedState, MAX_STATES>&,
+        uint32_t);
 
     bool queue_connect = false;
-    bool queue_disconnect = false;
+    // atomic because the net thread can set it when the WebSocket closes
+    std::atomic<bool> queue_disconnect = false;
+    // the zone to tell the server we're in, or -1 if there's nothing new to tell it. set on the game thread and sent by
+    // whichever thread owns ws
+    std::atomic<int64_t> queued_subscription = -1;
+    // whether the server agreed to binary messages, so Subscribe goes out as one. set on the game thread before the
+    // first subscription is queued
+    std::atomic<bool> binary_messages = false;
     wswrap::WS* ws = nullptr;
+    // with the UDP transport, carries the messages that would otherwise go over ws, and is owned the same way
+    std::optional<ReliableChannel::Channel<SEND>> control = {};
     UdpSocket::UdpSocket<SEND, RECV>* udp = nullptr;
 
-    const size_t MAX_STATES = 20;
-    const size_t MAX_OFFSETS = 100;
+    // The steps of connecting to the server, in order. Each one starts when the one before it finishes, and nothing
+    // in between blocks, so the whole sequence is spread across as many ticks as it takes.
+    enum class ConnectStage : uint8_t
+    {
+        // not connected and not trying to be
+        Idle,
+        // looking up the server address
+        Resolving,
+        // waiting for the WebSocket to open
+        OpeningWebSocket,
+        // Connect has been sent, waiting for Connected
+        AwaitingConnected,
+        // have an id, waiting for the clock to sync and the first update to go out
+        AwaitingFirstSend,
+        Connected,
+    };
+    const size_t CONNECT_STAGES = size_t(ConnectStage::Connected) + 1;
+
+    // atomic because the net thread advances the stages up to AwaitingConnected in threaded mode
+    std::atomic<ConnectStage> connect_stage = ConnectStage::Idle;
+    // when each stage of the current attempt was entered, in steady_clock ticks so they can be atomic. a stage's entry
+    // is written before connect_stage, so it's always valid for the current stage and every stage before it
+    std::array<std::atomic<int64_t>, CONNECT_STAGES> stage_entered = {};
+    // how long each stage may take before the attempt is given up on, or 0 for no limit. the first update isn't limited
+    // because it waits on the game, eg for a level to finish loading
+    const std::array<std::chrono::milliseconds, CONNECT_STAGES> STAGE_TIMEOUTS = {
+        std::chrono::milliseconds(0),
+        std::chrono::milliseconds(5000),
+        std::chrono::milliseconds(5000),
+        std::chrono::milliseconds(5000),
+        std::chrono::milliseconds(0),
+        std::chrono::milliseconds(0),
+    };
 
-    // some value in milliseconds to buffer when calculating millis to use for ghosts; causes delay, which can
-    // allow more time for packets to arrive
-    // TODO make this configurable, or auto calculate per ghost?
-    const int64_t GHOST_MILLIS_BUFFER = 100;
+    // whether the player is in a file and so should be connected; lost connections are only retried while this is set
+    bool wants_connection = false;
+    // when the next reconnect attempt is due, if one is scheduled
+    std::optional<std::chrono::steady_clock::time_point> reconnect_at = {};
+    // the wait before the next reconnect attempt, which doubles after every failed attempt up to the max and goes back
+    // to the min once a connection is fully established
+    const auto RECONNECT_BACKOFF_MIN = std::chrono::milliseconds(1000);
+    const auto RECONNECT_BACKOFF_MAX = std::chrono::milliseconds(30000);
+    std::chrono::milliseconds reconnect_backoff = RECONNECT_BACKOFF_MIN;
+
+    // whether the current connection runs on the net thread; this is only changed while the net thread isn't running.
+    // while it is running, only the net thread touches ws and udp, and it talks to the game thread through the queues
+    // below
+    bool threaded = false;
+    std::thread net_thread;
+    std::atomic<bool> stop_net_thread = false;
+    // how long the net thread waits for packets before checking the WebSocket and outbound queue again
+    const auto NET_THREAD_INTERVAL = std::chrono::milliseconds(1);
+
+    // an update is always sent at least this often, even when suppression would skip it, so that the server and other
+    // clients know we're still around
+    const uint32_t KEEPALIVE_MILLIS = 1000;
+    // gaps between states longer than this count as suppressed rather than lost when measuring a ghost's delay
+    const uint32_t MAX_SAMPLED_GAP_MILLIS = 250;
+    // the server sends far away ghosts' states less often, so a ghost is extrapolated for at least about as long as
+    // the gaps between its states, up to this, rather than stopping partway through every gap
+    const uint32_t MAX_GAP_HORIZON_MILLIS = 1000;
+
+    // when extrapolating, velocity is estimated between the newest state and the newest one at least this much older,
+    // which smooths out noise in individual states
+    const uint32_t VELOCITY_WINDOW_MILLIS = 50;
+    // after a ghost has been extrapolated, the jump to where new states say it is gets spread out; the remaining error
+    // shrinks by a factor of e every BLEND_MILLIS
+    const double BLEND_MILLIS = 80.0;
+    // an error bigger than this is a teleport, not a bad guess, so it isn't blended
+    const double MAX_BLEND_DISTANCE = 1000.0;
+
+    // The parts of a player's info that change from frame to frame. Name and color are only stored once per ghost, so
+    // this is all that needs to be kept in the history.
+    struct Transform
+    {
+        double location_x;
+        double location_y;
+        double location_z;
+        double rotation_x;
+        double rotation_y;
+        double rotation_z;
+
+        static Transform FromPlayerInfo(const FST_PlayerInfo& info)
+        {
+            return Transform
+            {
+                .location_x = info.location_x,
+                .location_y = info.location_y,
+                .location_z = info.location_z,
+                .rotation_x = info.rotation_x,
+                .rotation_y = info.rotation_y,
+                .rotation_z = info.rotation_z,
+            };
+        }
+    };
 
     struct State
     {
-        FST_PlayerInfo info;
+        Transform transform;
         uint32_t zone;
         uint32_t millis;
+        // transform's rotation as a quaternion, filled in when the state is given to its ghost
+        Rotation::Quat orientation;
+    };
+
+    // A state decoded from a server packet that hasn't been given to its ghost yet.
+    struct ReceivedState
+    {
+        uint16_t id;
+        State state;
+        steady_time_point received;
+        // the sequence the server gave this state among the ghost's states sent to us, if it numbers them
+        std::optional<uint8_t> sequence;
+        // the server's millis at the tick this state was sent in, if it came in a snapshot
+        std::optional<uint32_t> tick_millis;
+    };
+
+    // A pong decoded from a server packet that hasn't been given to the clock yet.
+    struct ReceivedPong
+    {
+        uint32_t sent;
+        uint32_t server_millis;
+        steady_time_point received;
+    };
+
+    // The tick of a snapshot packet and when it arrived, which hasn't been given to snapshot_playout yet.
+    struct ReceivedTick
+    {
+        uint32_t millis;
+        steady_time_point received;
+    };
+
+    // A packet for the net thread to send; len is at most SEND.
+    struct OutboundPacket
+    {
+        boost::array<uint8_t, SEND> buf;
+        size_t len;
+    };
+
+    // these hold up to a few frames of traffic; if the game thread falls further behind than that, new items are
+    // dropped, which is no worse than the packets being lost
+    boost::lockfree::spsc_queue<ReceivedState, boost::lockfree::capacity<1024>> inbound_states;
+    boost::lockfree::spsc_queue<ReceivedPong, boost::lockfree::capacity<16>> inbound_pongs;
+    boost::lockfree::spsc_queue<ReceivedTick, boost::lockfree::capacity<64>> inbound_ticks;
+    boost::lockfree::spsc_queue<std::string, boost::lockfree::capacity<64>> inbound_messages;
+    boost::lockfree::spsc_queue<OutboundPacket, boost::lockfree::capacity<16>> outbound_packets;
+
+    // The two states a ghost should be interpolated between at millis. from and to are the same state if millis is
+    // before the oldest state or if the states around millis are in different zones. If millis is past the newest
+    // state, to is the newest state and from is an older one to estimate velocity from, so interpolating with millis
+    // past to carries on along the same line.
+    struct Span
+    {
+        const State* from;
+        const State* to;
+        // whichever of from and to is closer to millis; rotation is taken from this state when it can't be
+        // interpolated, ie when from and to are the same or millis is past to
+        const State* closer;
+        uint32_t millis;
+        // the ghost's velocity at from and to, in units per milli, which shape the curve between them
+        std::array<double, 3> from_velocity{};
+        std::array<double, 3> to_velocity{};
     };
 
     struct Ghost
     {
-        uint8_t id = 0;
+        uint16_t id = 0;
         std::array<uint8_t, 3> color{};
         RC::Unreal::FString name;
-        std::list<State> states;
-
-        // offsets provide a way to figure out syncing. the offset is meant to guess at how far off a player's
-        // millisecond counter is from our own. these two fields let us easily check the average offset over the last
-        // MAX_OFFSETS messages received
-        int64_t total_offset = 0;
-        std::deque<uint64_t> offsets;
-
-        State cached_state{};
+        StateBuffer::StateBuffer<State, MAX_STATES> states;
+
+        // how far behind the server's clock to play this ghost. every client stamps its states with the server's clock,
+        // so this covers the time from the ghost sending a state to us receiving it, plus enough slack for jitter and
+        // lost states that the ghost rarely runs out of states to interpolate towards
+        PlayoutDelay::PlayoutDelay playout{ Settings::GetUnderrunTarget() };
+
+        // frames this ghost was shown, and how many of those it had run out of states, ie was played past its newest
+        uint64_t frames = 0;
+        uint64_t underruns = 0;
+        // loss, reordering and jitter of the states the server sends us for this ghost, if it numbers them
+        LinkStats::Tracker<8> link;
+        // the smoothed gap between this ghost's newest states, in millis
+        double gap = 0.0;
+
+        // what was shown last frame, for blending back after extrapolating
+        std::array<double, 3> shown{};
+        uint32_t shown_millis = 0;
+        uint32_t shown_newest = 0;
+        bool shown_extrapolated = false;
+        // added to the interpolated location and decayed towards 0 each frame
+        std::array<double, 3> correction{};
+
+        // Forgets the ghost's states and everything worked out from them, but keeps its stats for LogGhostStats.
+        void reset()
+        {
+            states.clear();
+            playout = PlayoutDelay::PlayoutDelay{ Settings::GetUnderrunTarget() };
+            gap = 0.0;
+            shown = {};
+            shown_millis = 0;
+            shown_newest = 0;
+            shown_extrapolated = false;
+            correction = {};
+        }
 
         bool can_insert(uint32_t ghost_millis) const
         {
-            auto eq = [&](const State& state) { return state.millis == ghost_millis; };
-            return std::find_if(states.begin(), states.end(), eq) == states.end()
-                && (states.size() < MAX_STATES || states.front().millis < ghost_millis);
+            return states.can_insert(ghost_millis);
         }
 
         // should only be called if can_insert returns true; otherwise states can include duplicates or this function
         // can be unnecessarily called with a state that would be dropped anyway
+        // millis is the server's clock when s was received, or at the tick it was sent in if it came in a snapshot
         void insert(State& s, const uint32_t& millis)
         {
-            // this is a new latest state, so update offset calculation
-            if (states.size() == 0 || s.millis > states.back().millis)
+            // this is a new latest state, so update the playout delay. the ghost could have been played up to the
+            // previous latest state without running out, which it passed the gap between them ago
+            if (states.empty() || s.millis > states.back().millis)
             {
-                int64_t offset = int64_t(s.millis) - int64_t(millis);
-                total_offset += offset;
-                offsets.push_back(offset);
-                if (offsets.size() > MAX_OFFSETS)
+                int64_t late = int64_t(millis) - int64_t(s.millis);
+                // a longer gap means the sender was suppressing updates, during which the ghost is extrapolated along
+                // exactly the path the sender saw, so running out then isn't something the delay needs to cover
+                if (!states.empty() && s.millis - states.back().millis <= MAX_SAMPLED_GAP_MILLIS)
+                {
+                    late += int64_t(s.millis - states.back().millis);
+                }
+                playout.add_sample(double(late));
+                if (!states.empty())
                 {
-                    total_offset -= offsets.front();
-                    offsets.pop_front();
+                    uint32_t last_gap = std::min(s.millis - states.back().millis, MAX_GAP_HORIZON_MILLIS);
+                    gap += (double(last_gap) - gap) / 8.0;
                 }
             }
-            
-            s.info.name = name;
-            s.info.id = id;
-            s.info.red = color[0];
-            s.info.green = color[1];
-            s.info.blue = color[2];
-
-            // insert after the first element that has a lower millis to keep the list sorted
-            // reverse find because we're more likely to be inserting towards the back of the list
-            auto less = [&](const State& state) { return state.millis < s.millis; };
-            auto it = std::find_if(states.rbegin(), states.rend(), less);
-            states.insert(it.base(), s);
-
-            if (states.size() > MAX_STATES)
+
+            s.orientation = Rotation::FromRotator(s.transform.rotation_x, s.transform.rotation_y,
+                s.transform.rotation_z);
+            // the buffer keeps itself sorted and drops the oldest state once it's full
+            states.insert(std::move(s));
+        }
+
+        std::optional<Span> get_span(const uint32_t& millis) const
+        {
+            if (states.empty())
             {
-                states.pop_front();
+                return {};
             }
+
+            uint32_t ghost_millis = uint32_t(int64_t(millis) - int64_t(playout.delay()));
+            return get_closest(ghost_millis);
         }
 
-        const State& get_state() const
+        Span get_closest(const uint32_t& ghost_millis) const
         {
-            return cached_state;
+            if (ghost_millis <= states.front().millis)
+            {
+                const State* front = &states.front();
+                return Span{ .from = front, .to = front, .closer = front, .millis = ghost_millis };
+            }
+            if (ghost_millis >= states.back().millis)
+            {
+                return get_extrapolated(ghost_millis);
+            }
+
+            // ghost_millis is strictly between front and back here, so i is between 1 and size - 1
+            size_t i = states.lower_bound(ghost_millis);
+            const State* upper = &states[i];
+            const State* lower = &states[i - 1];
+
+            uint32_t lower_dist = ghost_millis - lower->millis;
+            uint32_t upper_dist = upper->millis - ghost_millis;
+            const State* closer = lower_dist < upper_dist ? lower : upper;
+            if (lower->zone != upper->zone)
+            {
+                // if the two closest states differ by zone, just use the closer one
+                return Span{ .from = closer, .to = closer, .closer = closer, .millis = ghost_millis };
+            }
+            return Span
+            {
+                .from = lower,
+                .to = upper,
+                .closer = closer,
+                .millis = ghost_millis,
+                .from_velocity = velocity_at(i - 1),
+                .to_velocity = velocity_at(i),
+            };
         }
 
-        std::optional<State> refresh_state(const uint32_t& millis)
+        // Estimates the ghost's velocity at states[i] from the states on either side of it, or just the one side if
+        // it's the oldest or newest state or the other side is in a different zone.
+        std::array<double, 3> velocity_at(size_t i) const
         {
-            if (states.size() == 0 || offsets.size() == 0)
+            const State& at = states[i];
+            const State& before = i > 0 && states[i - 1].zone == at.zone ? states[i - 1] : at;
+            const State& after = i + 1 < states.size() && states[i + 1].zone == at.zone ? states[i + 1] : at;
+            if (&before == &after)
             {
                 return {};
             }
+            double millis = double(after.millis - before.millis);
+            return
+            {
+                (after.transform.location_x - before.transform.location_x) / millis,
+                (after.transform.location_y - before.transform.location_y) / millis,
+                (after.transform.location_z - before.transform.location_z) / millis,
+            };
+        }
+
+        // Returns the span for a ghost_millis past the newest state. The ghost keeps moving at the velocity it had
+        // leading up to the newest state, but only for so long; after that it waits at the last guess.
+        Span get_extrapolated(const uint32_t& ghost_millis) const
+        {
+            const State* back = &states.back();
+            uint32_t horizon = uint32_t(Settings::GetExtrapolationMillis());
+            if (horizon != 0)
+            {
+                horizon = std::max(horizon, uint32_t(gap));
+            }
+            uint32_t millis = ghost_millis - back->millis > horizon ? back->millis + horizon : ghost_millis;
 
-            int64_t average_offset = total_offset / int64_t(offsets.size());
-            uint32_t ghost_millis = uint32_t(int64_t(millis) + average_offset - GHOST_MILLIS_BUFFER);
-            cached_state = get_closest(ghost_millis);
-            return cached_state;
+            // the newest state at least VELOCITY_WINDOW_MILLIS older than back, or the oldest if none are, as long as
+            // it's in the same zone
+            const State* base = back;
+            for (size_t i = states.size() - 1; i-- > 0;)
+            {
+                if (states[i].zone != back->zone)
+                {
+                    break;
+                }
+                base = &states[i];
+                if (back->millis - base->millis >= VELOCITY_WINDOW_MILLIS)
+                {
+                    break;
+                }
+            }
+            if (horizon == 0 || base == back)
+            {
+                return Span{ .from = back, .to = back, .closer = back, .millis = millis };
+            }
+            // the same velocity at both ends makes the curve a straight line
+            double span_millis = double(back->millis - base->millis);
+            std::array<double, 3> velocity =
+            {
+                (back->transform.location_x - base->transform.location_x) / span_millis,
+                (back->transform.location_y - base->transform.location_y) / span_millis,
+                (back->transform.location_z - base->transform.location_z) / span_millis,
+            };
+            return Span
+            {
+                .from = base,
+                .to = back,
+                .closer = back,
+                .millis = millis,
+                .from_velocity = velocity,
+                .to_velocity = velocity,
+            };
         }
 
-        State get_closest(const uint32_t& ghost_millis) const
+        // Applies the blend-back correction to location, which was just interpolated for millis, and remembers what was
+        // shown. was_shown is whether the ghost was shown last frame, without which there's nothing to blend from.
+        void blend(double* location, uint32_t millis, bool extrapolated, bool was_shown)
         {
-            if (ghost_millis <= states.front().millis)
+            uint32_t newest = states.back().millis;
+            if (!was_shown)
             {
-                return states.front();
+                correction = {};
             }
-            if (ghost_millis >= states.back().millis)
+            else if (shown_extrapolated && newest != shown_newest)
+            {
+                // new states arrived while the ghost was being extrapolated, so the guess was probably a bit off. start
+                // from where the guess left the ghost and blend towards where the states say it is
+                double distance_squared = 0.0;
+                for (size_t k = 0; k < 3; k++)
+                {
+                    correction[k] = shown[k] - location[k];
+                    distance_squared += correction[k] * correction[k];
+                }
+                if (distance_squared > MAX_BLEND_DISTANCE * MAX_BLEND_DISTANCE)
+                {
+                    correction = {};
+                }
+            }
+            else if (correction != std::array<double, 3>{})
+            {
+                double decay = std::exp(-double(int32_t(millis - shown_millis)) / BLEND_MILLIS);
+                for (auto& c : correction)
+                {
+                    c *= decay;
+                }
+            }
+
+            for (size_t k = 0; k < 3; k++)
             {
-                return states.back();
+                location[k] += correction[k];
+                shown[k] = location[k];
             }
+            shown_millis = millis;
+            shown_newest = newest;
+            shown_extrapolated = extrapolated;
+        }
+    };
+
+    // the server keeps ids below this, so a slot for every possible id lets ghosts be indexed directly instead of
+    // hashed
+    const size_t MAX_GHOSTS = 1024;
+    // the bp mod knows ghosts by a byte, so at most this many can be shown at once. each shown ghost borrows one of
+    // these slots for as long as it's spawned
+    const size_t MAX_SPAWNED = 256;
+
+    // A set of ghost ids stored as a bitset. Iterating skips over empty ids a word at a time.
+    struct GhostSet
+    {
+        std::array<uint64_t, MAX_GHOSTS / 64> words{};
+
+        void set(uint16_t id)
+        {
+            words[id / 64] |= uint64_t(1) << (id % 64);
+        }
+
+        void reset(uint16_t id)
+        {
+            words[id / 64] &= ~(uint64_t(1) << (id % 64));
+        }
+
+        bool test(uint16_t id) const
+        {
+            return id < MAX_GHOSTS && ((words[id / 64] >> (id % 64)) & 1);
+        }
 
-            auto ge = [&](const State& state) { return state.millis >= ghost_millis; };
-            auto it = std::find_if(states.cbegin(), states.cend(), ge);
-            const State& upper = *it;
-            --it;
-            const State& lower = *it;
+        void clear()
+        {
+            words = {};
+        }
 
-            uint32_t lower_dist = ghost_millis - lower.millis;
-            uint32_t upper_dist = upper.millis - ghost_millis;
-            bool lower_is_closer = lower_dist < upper_dist;
-            if (lower.zone != upper.zone)
+        // Returns the ids in this set that aren't in other.
+        GhostSet without(const GhostSet& other) const
+        {
+            GhostSet result;
+            for (size_t i = 0; i < words.size(); i++)
             {
-                // if the two closest states differ by zone, just return the closer one
-                return lower_is_closer ? lower : upper;
+                result.words[i] = words[i] & ~other.words[i];
             }
+            return result;
+        }
 
-            // distance from lower as a percentage
-            double pct = double(lower_dist) / double(lower_dist + upper_dist);
-            return State
+        // Calls f with each id in the set in ascending order.
+        template<typename F>
+        void for_each(F f) const
+        {
+            for (size_t i = 0; i < words.size(); i++)
             {
-                .info = FST_PlayerInfo
+                for (uint64_t bits = words[i]; bits != 0; bits &= bits - 1)
                 {
-                    // interpolate location between lower and upper based on percent
-                    .location_x = lower.info.location_x + (upper.info.location_x - lower.info.location_x) * pct,
-                    .location_y = lower.info.location_y + (upper.info.location_y - lower.info.location_y) * pct,
-                    .location_z = lower.info.location_z + (upper.info.location_z - lower.info.location_z) * pct,
-                    // don't sweat interpolating rotation, just take the closer one
-                    .rotation_x = lower_is_closer ? lower.info.rotation_x : upper.info.rotation_x,
-                    .rotation_y = lower_is_closer ? lower.info.rotation_y : upper.info.rotation_y,
-                    .rotation_z = lower_is_closer ? lower.info.rotation_z : upper.info.rotation_z,
-                    .name = name,
-                    .id = id,
-                    .red = color[0],
-                    .green = color[1],
-                    .blue = color[2],
-                },
-                .zone = lower.zone,
-                .millis = ghost_millis,
-            };
+                    f(uint16_t(i * 64 + std::countr_zero(bits)));
+                }
+            }
+        }
+    };
+
+    // All ghosts, with a slot for each possible id. The per-ghost history and identity are kept in ghosts, while the
+    // per-frame interpolation inputs of the ghosts being shown are gathered into batch so they can be processed
+    // together.
+    struct GhostStore
+    {
+        std::array<Ghost, MAX_GHOSTS> ghosts{};
+
+        Interpolation::Batch<MAX_SPAWNED> batch{};
+
+        // ghosts of currently connected players
+        GhostSet present{};
+        // ghosts the bp mod currently has an actor for, and the slot each of them has
+        GhostSet spawned{};
+        std::array<uint8_t, MAX_GHOSTS> slots{};
+        // the ghosts holding a slot and the slots they hold
+        GhostSet slotted{};
+        std::bitset<MAX_SPAWNED> used_slots{};
+
+        bool contains(uint16_t id) const
+        {
+            return present.test(id);
+        }
+
+        Ghost& at(uint16_t id)
+        {
+            return ghosts[id];
+        }
+
+        void add(uint16_t id, const std::array<uint8_t, 3>& color, RC::Unreal::FString&& name)
+        {
+            // the server never hands out ids this high
+            if (id >= MAX_GHOSTS)
+            {
+                return;
+            }
+            ghosts[id] = Ghost{ .id = id, .color = color, .name = std::move(name) };
+            present.set(id);
+        }
+
+        void remove(uint16_t id)
+        {
+            if (id < MAX_GHOSTS)
+            {
+                present.reset(id);
+            }
+        }
+
+        // Gives a ghost that's about to be spawned a slot, or leaves it the one it already holds. Returns false if
+        // they're all taken.
+        bool take_slot(uint16_t id)
+        {
+            if (slotted.test(id))
+            {
+                return true;
+            }
+            for (size_t slot = 0; slot < MAX_SPAWNED; slot++)
+            {
+                if (!used_slots.test(slot))
+                {
+                    used_slots.set(slot);
+                    slots[id] = uint8_t(slot);
+                    slotted.set(id);
+                    return true;
+                }
+            }
+            return false;
+        }
+
+        void free_slot(uint16_t id)
+        {
+            if (slotted.test(id))
+            {
+                used_slots.reset(slots[id]);
+                slotted.reset(id);
+            }
+        }
+
+        // forgets every actor and gives back every slot, for when the actors are already gone
+        void clear_spawned()
+        {
+            spawned.clear();
+            slotted.clear();
+            used_slots.reset();
+        }
+
+        // removes every ghost but leaves spawned as is, since the bp mod still needs to be told to delete the actors
+        void clear()
+        {
+            present.clear();
+        }
+
+        // Puts the interpolation inputs for span into entry i of batch.
+        void gather(size_t i, const Span& span)
+        {
+            batch.elapsed[i] = double(span.millis - span.from->millis);
+            batch.span[i] = double(span.to->millis - span.from->millis);
+            batch.from_x[i] = span.from->transform.location_x;
+            batch.from_y[i] = span.from->transform.location_y;
+            batch.from_z[i] = span.from->transform.location_z;
+            batch.to_x[i] = span.to->transform.location_x;
+            batch.to_y[i] = span.to->transform.location_y;
+            batch.to_z[i] = span.to->transform.location_z;
+            batch.from_tx[i] = span.from_velocity[0] * batch.span[i];
+            batch.from_ty[i] = span.from_velocity[1] * batch.span[i];
+            batch.from_tz[i] = span.from_velocity[2] * batch.span[i];
+            batch.to_tx[i] = span.to_velocity[0] * batch.span[i];
+            batch.to_ty[i] = span.to_velocity[1] * batch.span[i];
+            batch.to_tz[i] = span.to_velocity[2] * batch.span[i];
         }
     };
 
-    uint32_t current_zone;
+    // atomic because the net thread drops states from other zones as it decodes them
+    std::atomic<uint32_t> current_zone = 0;
     // if an update isn't ready to be sent when created, it gets stored here
-    std::optional<std::pair<FST_PlayerInfo, uint32_t>> queued_update = {};
+    std::optional<std::pair<Transform, uint32_t>> queued_update = {};
 
     // the id given in the Connected message; this value being defined means a full connection has been established
-    std::optional<uint8_t> id = {};
-    std::unordered_map<uint8_t, Ghost> ghosts = {};
-    std::unordered_set<uint8_t> spawned_ghosts = {};
-
-    // about 1/60 seconds, in nanoseconds because that's what steady_clock uses
-    const int64_t NANOS_PER_UPDATE = 16666667;
-    // the first value marks the time the first update was sent after connecting; the second value marks the last time
-    // the client checked if it could send an update and is used to increment nanos
-    std::optional<std::pair<steady_time_point, steady_time_point>> timers = {};
-    // keeps track of nanoseconds accrued for updates; an update can only be fired if it exceeds NANOS_PER_UPDATE
+    std::optional<uint16_t> id = {};
+    GhostStore ghosts = {};
+
+    // the ghost in each entry of the interpolation batch, and whether it's being extrapolated this frame
+    std::array<uint16_t, MAX_SPAWNED> batch_ids = {};
+    std::array<bool, MAX_SPAWNED> batch_extrapolated = {};
+
+    // how many states each ghost has had decoded from the current drain, which OnRecv is handed all at once
+    std::array<uint8_t, MAX_GHOSTS> batch_state_counts = {};
+    // receive batches at least this big mean packets backed up, eg after a hitch, so they get logged
+    const size_t BACKLOG_LOG_THRESHOLD = 8;
+
+    // the time between updates, from the send rate setting, in nanoseconds because that's what steady_clock uses
+    int64_t nanos_per_update = 16666667;
+    // marks the last time the client checked if it could send an update and is used to increment nanos; this value
+    // being defined means the first update has been sent
+    std::optional<steady_time_point> timers = {};
+    // keeps track of nanoseconds accrued for updates; an update can only be fired if it exceeds nanos_per_update
     int64_t nanos = 0;
+    // the millis of the last update sent, which the next one must be stamped after
+    std::optional<uint32_t> last_sent_millis = {};
+
+    // our own updates as other clients have them, so we can tell what they'll extrapolate and skip updates that
+    // wouldn't change it by much
+    Ghost sent_ghost = {};
+    struct SendStats
+    {
+        uint64_t updates = 0;
+        // updates skipped because other clients' extrapolation was already close enough
+        uint64_t suppressed = 0;
+        // updates that were only sent because KEEPALIVE_MILLIS had passed
+        uint64_t keepalives = 0;
+    };
+    SendStats send_stats = {};
+
+    // the zero of our own millisecond clock, set when the Connected message arrives
+    std::optional<steady_time_point> clock_epoch = {};
+    // maps our millisecond clock onto the server's, which every client stamps its states with so they share a timeline
+    ClockSync::ClockSync server_clock = {};
+    // pings go out quickly until the clock has a full window of samples, then slow down to track drift
+    const auto PING_INTERVAL_FAST = std::chrono::milliseconds(100);
+    const auto PING_INTERVAL = std::chrono::milliseconds(2000);
+    steady_time_point next_ping = {};
+
+    // whether the server agreed to delta packets for this connection. it's set before id, so it's settled before any
+    // UDP packet is sent or received
+    std::atomic<bool> delta_mode = false;
+    // whether delta mode keyframes send locations as 20 bit offsets when they can (see Delta::EncodeShort); set with
+    // delta_mode
+    std::atomic<bool> delta_short_keyframes = false;
+    // how many of our earlier updates each delta update repeats, or 0 if the server didn't agree to "redundancy"; set
+    // with delta_mode
+    std::atomic<size_t> delta_redundancy = 0;
+    // whether delta packets in both directions carry sequence numbers, for LinkStats; set with delta_mode
+    std::atomic<bool> delta_sequenced = false;
+    // the sequence of our next delta update or poll
+    uint16_t delta_next_sequence = 0;
+    // in delta mode, a keyframe of our state goes out at least this often even if the server keeps acking
+    const uint32_t KEYFRAME_MILLIS = 1000;
+    // our own updates in delta mode, to encode new ones against whichever the server says it has
+    StateBuffer::StateBuffer<Delta::QuantizedState, MAX_STATES> delta_sent = {};
+    std::optional<uint32_t> last_keyframe_millis = {};
+    // whether ids in packets to and from the server are 16 bits, and whether our acks carry a mask of the packets
+    // before the acked one that we also decoded; set with delta_mode
+    std::atomic<bool> delta_wide = false;
+    std::atomic<bool> delta_ack_mask = false;
+    // the sequence of the newest server packet whose states were all decoded in the low 16 bits, and a mask of which of
+    // the 32 packets before it were too above that, where bit i is the packet i + 1 before it; or -1 for none yet. both
+    // are packed into one value so the game thread never sends a mask that goes with a different sequence. written by
+    // whichever thread decodes packets and read by the game thread when sending
+    std::atomic<int64_t> delta_acks = -1;
+    // the millis of the newest of our updates the server has, or -1 for none yet; threaded like delta_acks
+    std::atomic<int64_t> delta_acked_millis = -1;
+    // set if the server agreed to send us snapshots. states are then stamped with the tick they were sent in, so each
+    // ghost's own playout delay only covers the trip to the server and the wait for a tick, and this one, shared by
+    // every ghost, covers the trip from the server to us. only touched by the game thread
+    std::optional<PlayoutDelay::PlayoutDelay> snapshot_playout = {};
+    // recent states decoded from each player, which the server's deltas are relative to. the server only deltas
+    // against states it still stores, and it stores as many as this holds. only touched by whichever thread decodes
+    // packets
+    std::array<StateBuffer::StateBuffer<Delta::QuantizedState, MAX_STATES>, MAX_GHOSTS> delta_history = {};
+    // set on the game thread when a new scene loads, and cleared by whichever thread decodes packets once it's cleared
+    // delta_history. that happens before it decodes anything the server sent after our Subscribe, which makes the
+    // server forget what we have too
+    std::atomic<bool> queued_history_reset = false;
 }
 
 void Client::OnSceneLoad(std::wstring level)
 {
-    // we clear spawned_ghosts here because being in a new scene means they're all gone anyway
-    spawned_ghosts.clear();
+    // we clear spawned ghosts here because being in a new scene means they're all gone anyway
+    ghosts.clear_spawned();
     current_zone = HashW(level);
+    // states from the old zone are no use here, and from now on the server only sends states from the new one, so
+    // every ghost starts over, down to the states its deltas are decoded against
+    ghosts.present.for_each([](uint16_t ghost_id) { ghosts.at(ghost_id).reset(); });
+    queued_history_reset = true;
+    if (id)
+    {
+        queued_subscription = current_zone;
+    }
     if (level == L"TitleScreen" || level == L"EndScreen")
     {
+        wants_connection = false;
         queue_disconnect = true;
     }
     else
     {
+        wants_connection = true;
         queue_connect = true;
     }
 }
 
 void Client::Tick()
 {
+    auto now = std::chrono::steady_clock::now();
+    CheckStageTimeout(now);
     if (queue_disconnect)
     {
-        if (ws)
+        if (threaded)
         {
-            delete ws;
-            ws = nullptr;
-            delete udp;
-            udp = nullptr;
+            stop_net_thread = true;
+            net_thread.join();
+            threaded = false;
+            inbound_states.reset();
+            inbound_pongs.reset();
+            inbound_ticks.reset();
+            inbound_messages.reset();
+            outbound_packets.reset();
+        }
+        else
+        {
+            CloseSockets();
+        }
 
-            id.reset();
-            ghosts.clear();
-            // don't clear spawned_ghosts because we need to tell the bp mod to delete the actors
+        id.reset();
+        ghosts.present.for_each([](uint16_t ghost_id) { LogGhostStats(ghosts.at(ghost_id)); });
+        ghosts.clear();
 
-            timers.reset();
-            nanos = 0;
+        timers.reset();
+        nanos = 0;
+        queued_update.reset();
+        last_sent_millis.reset();
+        if (send_stats.updates != 0)
+        {
+            Log(L"Sent " + std::to_wstring(send_stats.updates) + L" updates (" + std::to_wstring(send_stats.keepalives)
+                + L" only as keepalives) and suppressed " + std::to_wstring(send_stats.suppressed));
+        }
+        sent_ghost.states.clear();
+        send_stats = {};
+        clock_epoch.reset();
+        server_clock = {};
+        next_ping = {};
+        delta_mode = false;
+        binary_messages = false;
+        delta_short_keyframes = false;
+        delta_redundancy = 0;
+        delta_sequenced = false;
+        delta_next_sequence = 0;
+        delta_sent.clear();
+        last_keyframe_millis.reset();
+        delta_wide = false;
+        delta_ack_mask = false;
+        delta_acks = -1;
+        delta_acked_millis = -1;
+        if (snapshot_playout)
+        {
+            Log(L"Snapshot playout delay " + std::to_wstring(int64_t(snapshot_playout->delay())) + L" ms");
+            snapshot_playout.reset();
+        }
+        for (auto& history : delta_history)
+        {
+            history.clear();
         }
         queue_disconnect = false;
+
+        bool was_connecting = connect_stage != ConnectStage::Idle;
+        EnterStage(ConnectStage::Idle);
+        if (!wants_connection)
+        {
+            reconnect_at.reset();
+            reconnect_backoff = RECONNECT_BACKOFF_MIN;
+        }
+        else if (was_connecting)
+        {
+            reconnect_at = now + reconnect_backoff;
+            Log(L"Reconnecting in " + std::to_wstring(reconnect_backoff.count()) + L" ms", LogType::Loud);
+            reconnect_backoff = std::min(reconnect_backoff * 2, RECONNECT_BACKOFF_MAX);
+        }
+    }
+    if (reconnect_at && now >= *reconnect_at)
+    {
+        reconnect_at.reset();
+        queue_connect = true;
     }
     if (queue_connect)
     {
-        if (!ws)
+        // a scene load while a reconnect is scheduled tries right away instead of waiting out the backoff
+        if (wants_connection && connect_stage == ConnectStage::Idle)
         {
-            const auto& address = Settings::GetAddress();
-            const auto& port = Settings::GetPort();
-            auto uri = "ws://" + address + ":" + port;
-            try
-            {
-                ws = new wswrap::WS(uri, OnOpen, OnClose, OnMessage, OnError);
-            }
-            catch (const boost::system::system_error& ex)
-            {
-                ws = nullptr;
-                Log(L"Error creating WebSocket: " + ToWide(ex.code().message()), LogType::Error);
-            }
-            catch (const std::exception& ex)
-            {
-                ws = nullptr;
-                Log(L"Error creating WebSocket: " + ToWide(ex.what()), LogType::Error);
-            }
-            try
-            {
-                udp = new UdpSocket::UdpSocket<SEND, RECV>(address, port, OnRecv, OnErr);
-            }
-            catch (const boost::system::system_error& ex)
+            reconnect_at.reset();
+            nanos_per_update = int64_t(1000000000.0 / Settings::GetSendRate());
+            EnterStage(ConnectStage::Resolving);
+            if (Settings::GetThreadedNetwork())
             {
-                delete ws;
-                ws = nullptr;
-                udp = nullptr;
-                Log(L"Error creating UDP socket: " + ToWide(ex.code().message()), LogType::Error);
+                threaded = true;
+                stop_net_thread = false;
+                net_thread = std::thread(RunNetThread);
             }
-            catch (const std::exception& ex)
+            else if (!OpenSockets())
             {
-                delete ws;
-                ws = nullptr;
-                udp = nullptr;
-                Log(L"Error creating UDP socket: " + ToWide(ex.what()), LogType::Error);
+                // clean up and schedule a retry on the next tick
+                queue_disconnect = true;
             }
         }
         queue_connect = false;
     }
+    if (threaded)
+    {
+        DrainNetThread();
+    }
+    if (id && now >= next_ping)
+    {
+        SendPing(now);
+        next_ping = now + (server_clock.size() < ClockSync::ClockSync::WINDOW ? PING_INTERVAL_FAST : PING_INTERVAL);
+    }
     if (id && timers)
     {
         AdvanceNanos();
@@ -317,167 +1008,610 @@ void Client::Tick()
             }
         }
     }
-    if (ws)
+    if (!threaded && udp)
     {
-        ws->poll();
+        // ws and control don't exist until the lookup finishes
+        if (ws)
+        {
+            ws->poll();
+            SendSubscription();
+        }
+        else if (control)
+        {
+            SendSubscription();
+            PollControl();
+        }
         udp->Poll();
     }
 }
 
 uint32_t Client::SetPlayerInfo(const FST_PlayerInfo& info)
 {
-    if (!id)
+    // updates are stamped with the server's clock, so they can't go out until it's known
+    if (!id || !server_clock.synced())
     {
         return 0u;
     }
+    auto transform = Transform::FromPlayerInfo(info);
     if (timers)
     {
         auto now = AdvanceNanos();
-        auto millis = MillisSinceStart(now);
-        bool sent = TrySendUpdate(info, millis);
+        auto millis = ServerMillis(now);
+        bool sent = TrySendUpdate(transform, millis);
         if (!sent)
         {
-            queued_update = { info, millis };
+            queued_update = { transform, millis };
         }
         return millis;
     }
     else
     {
         auto now = std::chrono::steady_clock::now();
-        timers = { now, now };
-        SendUpdate(info, 0u);
-        return 0u;
+        timers = now;
+        auto millis = ServerMillis(now);
+        SendUpdate(transform, millis);
+        EnterStage(ConnectStage::Connected);
+        LogConnectTimings();
+        reconnect_backoff = RECONNECT_BACKOFF_MIN;
+        return millis;
     }
 }
 
-void Client::GetGhostInfo(
+size_t Client::GetGhostInfo(
     const uint32_t& millis,
     RC::Unreal::FScriptArray& ghost_info_raw,
     RC::Unreal::TArray<uint8_t>& to_remove
 ) {
     auto& ghost_info = *reinterpret_cast<RC::Unreal::TArray<FST_PlayerInfo>*>(&ghost_info_raw);
+    if (threaded)
+    {
+        // pick up anything that arrived since Tick so ghosts are as fresh as possible
+        DrainNetThread();
+    }
+    // the arrays are reused every frame; Reset keeps their allocations so they stop allocating once they're big enough
+    ghost_info.Reset();
+    to_remove.Reset();
+
+    // FST_PlayerInfo starts with its three location doubles, so the interpolation kernel can write straight into the
+    // array given to the bp mod; everything else is filled in here while gathering
+    static_assert(offsetof(FST_PlayerInfo, location_x) == 0);
+    static_assert(offsetof(FST_PlayerInfo, location_y) == sizeof(double));
+    static_assert(offsetof(FST_PlayerInfo, location_z) == 2 * sizeof(double));
+    static_assert(sizeof(FST_PlayerInfo) % sizeof(double) == 0);
+
+    // with snapshots, ghosts are also held back by how long snapshots take to get here, which their own delays don't
+    // cover
+    uint32_t playout_millis = millis;
+    if (snapshot_playout)
+    {
+        playout_millis -= uint32_t(snapshot_playout->delay());
+    }
 
-    for (auto& [id, ghost] : ghosts)
+    GhostSet visible{};
+    size_t first = ghost_info.Num();
+    size_t count = 0;
+    size_t newly_spawned = 0;
+    ghosts.present.for_each([&](uint16_t ghost_id)
     {
-        const auto& state = ghost.refresh_state(millis);
-        if (!state || state->zone != current_zone)
+        Ghost& ghost = ghosts.at(ghost_id);
+        auto span = ghost.get_span(playout_millis);
+        if (!span || span->from->zone != current_zone)
         {
-            continue;
+            return;
+        }
+        // a ghost that isn't spawned yet needs a slot first; if they're all taken, it waits for one to free up
+        bool spawning = !ghosts.spawned.test(ghost_id);
+        if (spawning && !ghosts.take_slot(ghost_id))
+        {
+            return;
         }
 
-        ghost_info.Add(state->info);
-        spawned_ghosts.insert(id);
-    }
+        bool extrapolated = span->millis > ghost.states.back().millis;
+        ghost.frames++;
+        if (extrapolated)
+        {
+            ghost.underruns++;
+        }
 
-    for (auto it = spawned_ghosts.begin(); it != spawned_ghosts.end(); )
-    {
-        if (!ghosts.contains(*it) || ghosts.at(*it).get_state().zone != current_zone)
+        ghosts.gather(count, *span);
+        batch_ids[count] = ghost_id;
+        batch_extrapolated[count] = extrapolated;
+        count++;
+        const auto& closer = span->closer->transform;
+        double rotation_x = closer.rotation_x;
+        double rotation_y = closer.rotation_y;
+        double rotation_z = closer.rotation_z;
+        if (span->from != span->to && span->millis <= span->to->millis)
         {
-            to_remove.Add(*it);
-            it = spawned_ghosts.erase(it);
+            double pct = double(span->millis - span->from->millis) / double(span->to->millis - span->from->millis);
+            auto orientation = Rotation::Slerp(span->from->orientation, span->to->orientation, pct);
+            Rotation::ToRotator(orientation, rotation_x, rotation_y, rotation_z);
         }
-        else
+        int index = ghost_info.Add(FST_PlayerInfo
+        {
+            .rotation_x = rotation_x,
+            .rotation_y = rotation_y,
+            .rotation_z = rotation_z,
+            .id = ghosts.slots[ghost_id],
+            .red = ghost.color[0],
+            .green = ghost.color[1],
+            .blue = ghost.color[2],
+        });
+        // the bp mod only reads the name when it spawns the actor, so it's only copied for new ghosts; every other
+        // frame it's left empty, which doesn't allocate
+        if (spawning)
         {
-            ++it;
+            ghost_info[index].name = ghost.name;
+            newly_spawned++;
         }
+        visible.set(ghost_id);
+    });
+
+    if (count != 0)
+    {
+        // take the pointer after adding everything since Add can reallocate
+        double* out = &ghost_info.GetData()[first].location_x;
+        Interpolation::Interpolate(ghosts.batch, count, out, sizeof(FST_PlayerInfo) / sizeof(double));
+
+        for (size_t i = 0; i < count; i++)
+        {
+            auto& info = ghost_info[int(first + i)];
+            uint16_t ghost_id = batch_ids[i];
+            ghosts.at(ghost_id).blend(&info.location_x, millis, batch_extrapolated[i], ghosts.spawned.test(ghost_id));
+        }
+    }
+
+    ghosts.spawned.without(visible).for_each([&](uint16_t ghost_id)
+    {
+        to_remove.Add(ghosts.slots[ghost_id]);
+        ghosts.free_slot(ghost_id);
+    });
+    ghosts.spawned = visible;
+    return newly_spawned;
+}
+
+std::optional<LinkStats::Summary> Client::GetLinkStats(uint16_t ghost_id)
+{
+    if (!ghosts.contains(ghost_id))
+    {
+        return {};
     }
+    return ghosts.at(ghost_id).link.summary();
 }
 
 namespace
 {
 
-void OnOpen()
+void EnterStage(ConnectStage stage)
 {
-    Log(L"WebSocket connection established", LogType::Loud);
-    const auto& color = Settings::GetColor();
-    const auto& name = Settings::GetName();
-    nlohmann::json j = {
-        {"type", "Connect"},
-        {"color", color},
-        {"name", name},
-    };
-    ws->send_text(j.dump());
+    stage_entered[size_t(stage)] = std::chrono::steady_clock::now().time_since_epoch().count();
+    connect_stage = stage;
 }
 
-void OnClose()
+// Gives up on the current connection attempt if its stage has gone on for too long.
+void CheckStageTimeout(const steady_time_point& now)
 {
-    Log(L"Disconnected from server", LogType::Loud);
+    ConnectStage stage = connect_stage;
+    auto timeout = STAGE_TIMEOUTS[size_t(stage)];
+    if (timeout.count() == 0 || queue_disconnect)
+    {
+        return;
+    }
+
+    auto entered = steady_time_point(steady_time_point::duration(stage_entered[size_t(stage)]));
+    if (now - entered < timeout)
+    {
+        return;
+    }
+
+    std::wstring doing;
+    switch (stage)
+    {
+    case ConnectStage::Resolving: doing = L"looking up the server address"; break;
+    case ConnectStage::OpeningWebSocket: doing = L"opening the WebSocket"; break;
+    case ConnectStage::AwaitingConnected: doing = L"waiting for the Connected message"; break;
+    default: doing = L"connecting"; break;
+    }
+    Log(L"Timed out after " + std::to_wstring(timeout.count()) + L" ms " + doing, LogType::Warning);
     queue_disconnect = true;
 }
 
-void OnMessage(const std::string& message)
+// Logs how long each stage of the attempt that just finished took.
+void LogConnectTimings()
 {
-    // TODO add schema validation? this function assumes a valid message
-    nlohmann::json j = nlohmann::json::parse(message);
-    const auto& field_type = j["type"];
-    if (field_type == "Connected")
+    auto millis_between = [](ConnectStage from, ConnectStage to)
     {
-        if (id)
-        {
-            Log(L"Received Connected message after connection was already established", LogType::Warning);
-            queue_disconnect = true;
-            return;
-        }
-
-        id = j["id"].template get<uint8_t>();
+        auto ticks = steady_time_point::duration(stage_entered[size_t(to)] - stage_entered[size_t(from)]);
+        return std::to_wstring(std::chrono::duration_cast<std::chrono::milliseconds>(ticks).count()) + L" ms";
+    };
+    Log(L"Connected in " + millis_between(ConnectStage::Resolving, ConnectStage::Connected)
+        + L" (lookup " + millis_between(ConnectStage::Resolving, ConnectStage::OpeningWebSocket)
+        + (Settings::GetUdpTransport() ? L", UDP " : L", WebSocket ")
+        + millis_between(ConnectStage::OpeningWebSocket, ConnectStage::AwaitingConnected)
+        + L", Connected " + millis_between(ConnectStage::AwaitingConnected, ConnectStage::AwaitingFirstSend)
+        + L", clock sync and first update " + millis_between(ConnectStage::AwaitingFirstSend, ConnectStage::Connected)
+        + L")", LogType::Loud);
+}
 
-        auto& field_players = j["players"];
-        for (auto it = field_players.begin(); it != field_players.end(); ++it)
-        {
-            auto player_name = (*it)["name"].template get<std::string>();
-            auto player_id = (*it)["id"].template get<uint8_t>();
+// Creates udp and starts looking up the server address. The rest of the connection is driven by callbacks, starting
+// with OnResolve. Returns false if the socket couldn't be created.
+bool OpenSockets()
+{
+    try
+    {
+        udp = new UdpSocket::UdpSocket<SEND, RECV>(OnRecv, OnErr);
+    }
+    catch (const boost::system::system_error& ex)
+    {
+        udp = nullptr;
+        Log(L"Error creating UDP socket: " + ToWide(ex.code().message()), LogType::Error);
+        return false;
+    }
+    catch (const std::exception& ex)
+    {
+        udp = nullptr;
+        Log(L"Error creating UDP socket: " + ToWide(ex.what()), LogType::Error);
+        return false;
+    }
+    udp->AsyncResolve(Settings::GetAddress(), Settings::GetPort(), OnResolve);
+    return true;
+}
 
-            const auto& field_color = (*it)["color"];
-            auto red = field_color[0].template get<uint8_t>();
-            auto green = field_color[1].template get<uint8_t>();
-            auto blue = field_color[2].template get<uint8_t>();
-            
-            ghosts[player_id] = Ghost
-            {
-                .id = player_id,
-                .color = { red, green, blue },
-                .name = ToFString(player_name)
-            };
+void OnResolve(const boost::system::error_code& error, const boost::asio::ip::udp::endpoint& endpoint)
+{
+    if (error)
+    {
+        Log(L"Error looking up server address: " + ToWide(error.message()), LogType::Error);
+        queue_disconnect = true;
+        return;
+    }
+
+    EnterStage(ConnectStage::OpeningWebSocket);
+    if (Settings::GetUdpTransport())
+    {
+        // there's nothing to open, since Connect goes straight to the address that was just looked up
+        control.emplace(std::chrono::steady_clock::now());
+        OnOpen();
+        return;
+    }
+    // connect to the address that was just looked up so wswrap doesn't do a blocking lookup of its own
+    auto uri = "ws://" + endpoint.address().to_string() + ":" + Settings::GetPort();
+    try
+    {
+        ws = new wswrap::WS(uri, OnOpen, OnClose, OnMessage, OnError);
+    }
+    catch (const boost::system::system_error& ex)
+    {
+        ws = nullptr;
+        Log(L"Error creating WebSocket: " + ToWide(ex.code().message()), LogType::Error);
+        queue_disconnect = true;
+    }
+    catch (const std::exception& ex)
+    {
+        ws = nullptr;
+        Log(L"Error creating WebSocket: " + ToWide(ex.what()), LogType::Error);
+        queue_disconnect = true;
+    }
+}
+
+void CloseSockets()
+{
+    if (udp)
+    {
+        auto stats = udp->GetStats();
+        if (stats.send_pool_exhausted != 0 || stats.handler_overflows != 0)
+        {
+            Log(L"UDP socket dropped " + std::to_wstring(stats.send_pool_exhausted) + L" send(s) to an exhausted pool and "
+                + std::to_wstring(stats.handler_overflows) + L" handler(s) overflowed to the heap", LogType::Warning);
         }
+    }
 
-        Log(L"Received Connected message with player id " + std::to_wstring(*id), LogType::Loud);
+    delete ws;
+    ws = nullptr;
+    if (control && udp)
+    {
+        // best effort, so the server doesn't have to wait for the channel to time out
+        control->close(SendControlPacket);
+    }
+    control.reset();
+    if (udp && connect_stage == ConnectStage::Resolving)
+    {
+        // destroying the socket joins asio's lookup thread, which would wait out the lookup that's taking too long
+        std::thread([stale = udp] { delete stale; }).detach();
+    }
+    else
+    {
+        delete udp;
     }
-    else if (field_type == "PlayerJoined")
+    udp = nullptr;
+}
+
+// The body of the net thread, which owns ws and udp for as long as it runs.
+void RunNetThread()
+{
+    if (!OpenSockets())
     {
-        if (!id)
+        // let the game thread clean up and schedule a retry
+        queue_disconnect = true;
+        return;
+    }
+
+    while (!stop_net_thread)
+    {
+        auto deadline = std::chrono::steady_clock::now() + NET_THREAD_INTERVAL;
+        // ws and control don't exist until the lookup finishes
+        if (ws)
         {
-            Log(L"Received PlayerJoined message before Connected message", LogType::Warning);
-            queue_disconnect = true;
-            return;
+            ws->poll();
+            SendSubscription();
         }
+        else if (control)
+        {
+            SendSubscription();
+            PollControl();
+        }
+        udp->RunUntil(deadline);
+        outbound_packets.consume_all([](const OutboundPacket& packet) { udp->Send(packet.buf, packet.len); });
+        // RunUntil returns early if there's nothing to wait on yet, ie before the first send
+        std::this_thread::sleep_until(deadline);
+    }
 
-        auto player_name = j["name"].template get<std::string>();
-        auto player_id = j["id"].template get<uint8_t>();
+    CloseSockets();
+}
 
-        const auto& field_color = j["color"];
-        auto red = field_color[0].template get<uint8_t>();
-        auto green = field_color[1].template get<uint8_t>();
-        auto blue = field_color[2].template get<uint8_t>();
-        
-        ghosts[player_id] = Ghost{ .id = player_id, .color = { red, green, blue }, .name = ToFString(player_name)};
+// Applies everything the net thread has received. Messages go first so a ghost that just joined exists before its
+// states are applied, and pongs go before states so they're placed with the newest clock estimate.
+void DrainNetThread()
+{
+    inbound_messages.consume_all(HandleMessage);
+    inbound_pongs.consume_all(HandlePong);
+    inbound_ticks.consume_all(HandleTick);
+    inbound_states.consume_all(ApplyState);
+}
 
-        Log(L"Received PlayerJoined message with id " + std::to_wstring(player_id) + L" (" + ToWide(player_name) + L")",
-            LogType::Loud);
+void OnOpen()
+{
+    Log(control ? L"Connecting over UDP" : L"WebSocket connection established", LogType::Loud);
+    EnterStage(ConnectStage::AwaitingConnected);
+    const auto& color = Settings::GetColor();
+    const auto& name = Settings::GetName();
+    // servers that don't know a feature ignore it, and older ones ignore the whole field
+    auto features = nlohmann::json::array();
+    if (Settings::GetDeltaCompression())
+    {
+        features.push_back("delta");
+        features.push_back("short_keyframes");
+        if (Settings::GetSendRedundancy() >= 1.0)
+        {
+            features.push_back("redundancy");
+        }
+        features.push_back("sequence");
+        features.push_back("wide_ids");
+        features.push_back("ack_mask");
+        if (Settings::GetSnapshots())
+        {
+            features.push_back("snapshots");
+        }
+    }
+    features.push_back("tiers");
+    features.push_back("binary");
+    nlohmann::json j = {
+        {"type", "Connect"},
+        {"color", color},
+        {"name", name},
+        {"features", features},
+    };
+    SendControlMessage(j.dump(), false);
+}
+
+// Tells the server which zone's states to send us, if the game thread queued a new one. Must be called by whichever
+// thread owns ws.
+void SendSubscription()
+{
+    int64_t zone = queued_subscription.exchange(-1);
+    if (zone < 0)
+    {
+        return;
+    }
+    if (binary_messages)
+    {
+        SendControlMessage(ControlMessage::WriteSubscribe(uint32_t(zone)), true);
+        return;
+    }
+    nlohmann::json j = {
+        {"type", "Subscribe"},
+        {"zone", uint32_t(zone)},
+    };
+    SendControlMessage(j.dump(), false);
+}
+
+// Sends a message to the server over whichever of ws and control this connection uses, in a binary WebSocket frame if
+// it's binary. Must be called by whichever thread owns them.
+void SendControlMessage(const std::string& message, bool binary)
+{
+    if (control)
+    {
+        control->send(message);
+        PollControl();
+        return;
+    }
+    if (binary)
+    {
+        ws->send_binary(message);
+        return;
     }
-    else if (field_type == "PlayerLeft")
+    ws->send_text(message);
+}
+
+// Sends whatever control has due, or gives up on the connection if the server has stopped answering.
+void PollControl()
+{
+    // sending a message polls too, so control may have just been given up on
+    if (!control)
+    {
+        return;
+    }
+    auto now = std::chrono::steady_clock::now();
+    if (control->timed_out(now))
     {
-        if (!id)
+        Log(L"Timed out waiting to hear from the server over UDP", LogType::Warning);
+        // nothing more is sent on a channel the server may have already dropped
+        control.reset();
+        OnClose();
+        return;
+    }
+    control->poll(now, SendControlPacket);
+}
+
+void SendControlPacket(const uint8_t* data, size_t len)
+{
+    boost::array<uint8_t, SEND> buf{};
+    std::copy(data, data + len, buf.begin());
+    udp->Send(buf, len);
+}
+
+void OnClose()
+{
+    Log(L"Disconnected from server", LogType::Loud);
+    queue_disconnect = true;
+}
+
+void OnMessage(const std::string& message)
+{
+    if (threaded)
+    {
+        if (!inbound_messages.push(message))
+        {
+            Log(L"Dropped WebSocket message because the game thread is too far behind", LogType::Warning);
+        }
+        return;
+    }
+    HandleMessage(message);
+}
+
+void HandleMessage(const std::string& message)
+{
+    std::optional<ControlMessage::ServerMessage> decoded;
+    if (ControlMessage::IsBinary(message))
+    {
+        decoded = ControlMessage::ReadBinary(message);
+        if (!decoded)
         {
-            Log(L"Received PlayerLeft message before Connected message", LogType::Warning);
-            queue_disconnect = true;
+            Log(L"Ignored a binary message that couldn't be decoded", LogType::Warning);
             return;
         }
+    }
+    else
+    {
+        decoded = ControlMessage::ParseJson(message);
+    }
+
+    if (!decoded)
+    {
+        return;
+    }
+    if (auto connected = std::get_if<ControlMessage::Connected>(&*decoded))
+    {
+        HandleConnected(*connected);
+    }
+    else if (auto joined = std::get_if<ControlMessage::PlayerJoined>(&*decoded))
+    {
+        HandlePlayerJoined(*joined);
+    }
+    else if (auto left = std::get_if<ControlMessage::PlayerLeft>(&*decoded))
+    {
+        HandlePlayerLeft(*left);
+    }
+}
 
-        auto player_id = j["id"].template get<uint8_t>();
-        ghosts.erase(player_id);
+void HandleConnected(const ControlMessage::Connected& connected)
+{
+    if (id)
+    {
+        Log(L"Received Connected message after connection was already established", LogType::Warning);
+        queue_disconnect = true;
+        return;
+    }
+
+    // the server lists the features it agreed to; older servers leave the field out
+    bool delta = false;
+    bool short_keyframes = false;
+    bool redundancy = false;
+    bool sequence = false;
+    bool wide_ids = false;
+    bool ack_mask = false;
+    bool snapshots = false;
+    bool binary = false;
+    for (const auto& feature : connected.features)
+    {
+        delta = delta || feature == "delta";
+        short_keyframes = short_keyframes || feature == "short_keyframes";
+        redundancy = redundancy || feature == "redundancy";
+        sequence = sequence || feature == "sequence";
+        wide_ids = wide_ids || feature == "wide_ids";
+        ack_mask = ack_mask || feature == "ack_mask";
+        snapshots = snapshots || feature == "snapshots";
+        binary = binary || feature == "binary";
+    }
+    delta_mode = delta;
+    delta_short_keyframes = delta && short_keyframes;
+    delta_redundancy = delta && redundancy ? size_t(Settings::GetSendRedundancy()) : 0;
+    delta_sequenced = delta && sequence;
+    delta_wide = delta && wide_ids;
+    delta_ack_mask = delta && ack_mask;
+    if (delta && snapshots)
+    {
+        snapshot_playout.emplace(Settings::GetUnderrunTarget());
+    }
+    binary_messages = binary;
+    id = connected.id;
+    clock_epoch = std::chrono::steady_clock::now();
+    queued_subscription = current_zone;
+
+    for (const auto& player : connected.players)
+    {
+        ghosts.add(player.id, player.color, ToFString(player.name));
+    }
+
+    std::wstring packets = delta_mode
+        ? (delta_short_keyframes ? L" using delta packets with short keyframes" : L" using delta packets")
+        : L" decoding states with " + std::wstring(StateBatch::PathName(StateBatch::SelectedPath()));
+    Log(L"Received Connected message with player id " + std::to_wstring(*id) + packets, LogType::Loud);
+    EnterStage(ConnectStage::AwaitingFirstSend);
+}
+
+void HandlePlayerJoined(const ControlMessage::PlayerJoined& joined)
+{
+    if (!id)
+    {
+        Log(L"Received PlayerJoined message before Connected message", LogType::Warning);
+        queue_disconnect = true;
+        return;
+    }
+
+    const auto& player = joined.player;
+    ghosts.add(player.id, player.color, ToFString(player.name));
+
+    Log(L"Received PlayerJoined message with id " + std::to_wstring(player.id) + L" (" + ToWide(player.name) + L")",
+        LogType::Loud);
+}
+
+void HandlePlayerLeft(const ControlMessage::PlayerLeft& left)
+{
+    if (!id)
+    {
+        Log(L"Received PlayerLeft message before Connected message", LogType::Warning);
+        queue_disconnect = true;
+        return;
+    }
 
-        Log(L"Received PlayerLeft message with id " + std::to_wstring(player_id), LogType::Loud);
+    if (ghosts.contains(left.id))
+    {
+        LogGhostStats(ghosts.at(left.id));
     }
+    ghosts.remove(left.id);
+
+    Log(L"Received PlayerLeft message with id " + std::to_wstring(left.id), LogType::Loud);
 }
 
 void OnError(const std::string& error_message)
@@ -485,51 +1619,398 @@ void OnError(const std::string& error_message)
     Log(L"WebSocket error: " + ToWide(error_message), LogType::Error);
 }
 
-void OnRecv(const boost::array<uint8_t, RECV>& buf, size_t len)
+void OnRecv(std::span<const UdpSocket::Datagram<RECV>> datagrams)
 {
-    if (len < MIN_SERVER_PACKET_LEN || len > MAX_SERVER_PACKET_LEN || len % STATE_LEN != 0)
+    auto received = std::chrono::steady_clock::now();
+    if (queued_history_reset.exchange(false))
     {
-        Log(L"Received packet of invalid size " + std::to_wstring(len), LogType::Warning);
+        for (auto& history : delta_history)
+        {
+            history.clear();
+        }
+    }
+
+    // decode newest first so each ghost keeps its newest states; older ones past what its history can hold would just
+    // be pushed out again, so they're dropped without being decoded
+    // messages go first and in order, the same as they would from ws before any states in the same batch
+    for (const auto& datagram : datagrams)
+    {
+        if (control && ReliableChannel::IsControl(datagram.buf.data(), datagram.len))
+        {
+            HandleControlPacket(datagram.buf, datagram.len);
+        }
+    }
+
+    batch_state_counts.fill(0);
+    size_t dropped = 0;
+    for (auto it = datagrams.rbegin(); it != datagrams.rend(); ++it)
+    {
+        // checked before pongs, which could be the same length
+        if (ReliableChannel::IsControl(it->buf.data(), it->len))
+        {
+            continue;
+        }
+        if (it->len == PONG_LEN)
+        {
+            DecodePong(it->buf, received);
+            continue;
+        }
+        if (delta_mode)
+        {
+            dropped += DecodeDeltaPacket(it->buf, it->len, received);
+            continue;
+        }
+        dropped += DecodePacket(it->buf, it->len, received);
+    }
+
+    if (datagrams.size() >= BACKLOG_LOG_THRESHOLD)
+    {
+        Log(L"Drained " + std::to_wstring(datagrams.size()) + L" backed up packets; dropped " + std::to_wstring(dropped)
+            + L" stale states");
+    }
+}
+
+void HandleControlPacket(const boost::array<uint8_t, RECV>& buf, size_t len)
+{
+    bool open = control->receive(buf.data(), len, std::chrono::steady_clock::now(), OnMessage);
+    if (!open)
+    {
+        Log(L"The server closed the connection", LogType::Warning);
+        control.reset();
+        OnClose();
         return;
     }
+    // acks whatever just arrived
+    PollControl();
+}
 
-    if (!timers)
+void DecodePong(const boost::array<uint8_t, RECV>& buf, const steady_time_point& received)
+{
+    BitStream::BitReader reader(buf.data(), PONG_LEN);
+    auto [sent, server_millis] = Pong::read(reader);
+    ReceivedPong pong{ .sent = sent, .server_millis = server_millis, .received = received };
+    if (threaded)
+    {
+        inbound_pongs.push(pong);
+    }
+    else
     {
+        HandlePong(pong);
+    }
+}
+
+void HandlePong(const ReceivedPong& pong)
+{
+    if (!clock_epoch)
+    {
+        // a pong from before a reconnect
         return;
     }
-    auto millis = MillisSinceStart(std::chrono::steady_clock::now());
 
-    size_t pos = 0;
+    bool was_synced = server_clock.synced();
+    server_clock.add_sample(pong.sent, pong.server_millis, LocalMillis(pong.received));
+    if (!was_synced && server_clock.synced())
+    {
+        Log(L"Synced clock with server; round trip is " + std::to_wstring(server_clock.rtt()) + L" ms", LogType::Loud);
+    }
+}
+
+// Decodes the states in one server packet and applies them to ghosts or queues them for the game thread. Returns how
+// many states were dropped as stale.
+size_t DecodePacket(const boost::array<uint8_t, RECV>& buf, size_t len, const steady_time_point& received)
+{
+    if (len < MIN_SERVER_PACKET_LEN || len > MAX_SERVER_PACKET_LEN || len % STATE_LEN != 0)
+    {
+        Log(L"Received packet of invalid size " + std::to_wstring(len), LogType::Warning);
+        return 0;
+    }
+
+    size_t dropped = 0;
+    uint32_t zone = current_zone;
+
+    // every state's id, millis and zone are read first, and only the transforms of states from our zone are decoded.
+    // those are decoded in one pass, which is cheaper than decoding states one at a time even when some are then
+    // dropped. usually that's every state, which are decoded in place; otherwise they're gathered first
     size_t num_updates = len / STATE_LEN;
+    std::array<StateBatch::DecodedState, MAX_STATES_PER_PACKET> decoded;
+    std::array<size_t, MAX_STATES_PER_PACKET> in_zone;
+    size_t num_in_zone = 0;
     for (size_t i = 0; i < num_updates; i++)
     {
-        uint8_t player_id = DeserializeU8(buf, pos);
-        if (!ghosts.contains(player_id))
+        BitStream::BitReader reader(buf.data() + i * STATE_LEN, STATE_LEN);
+        auto [id, millis, state_zone] = StateBatch::Prefix::read(reader);
+        decoded[i] = StateBatch::DecodedState
+        {
+            .millis = millis,
+            .zone = state_zone,
+            .location = {},
+            .rotation = {},
+            .id = id,
+        };
+        if (state_zone == zone)
+        {
+            in_zone[num_in_zone++] = i;
+        }
+    }
+    if (num_in_zone == num_updates)
+    {
+        StateBatch::Decode(buf.data(), num_updates, decoded.data());
+    }
+    else if (num_in_zone > 0)
+    {
+        std::array<uint8_t, MAX_SERVER_PACKET_LEN> gathered;
+        for (size_t j = 0; j < num_in_zone; j++)
+        {
+            std::memcpy(gathered.data() + j * STATE_LEN, buf.data() + in_zone[j] * STATE_LEN, STATE_LEN);
+        }
+        std::array<StateBatch::DecodedState, MAX_STATES_PER_PACKET> transforms;
+        StateBatch::Decode(gathered.data(), num_in_zone, transforms.data());
+        for (size_t j = 0; j < num_in_zone; j++)
+        {
+            decoded[in_zone[j]] = transforms[j];
+        }
+    }
+    for (size_t i = 0; i < num_updates; i++)
+    {
+        const StateBatch::DecodedState& d = decoded[i];
+        // on the game thread we can drop states that ghosts wouldn't keep; the net thread can't check ghosts, so it
+        // only drops what the batch alone shows is stale and leaves the rest to ApplyState
+        if (batch_state_counts[d.id] == MAX_STATES || (!threaded && !WantsState(d.id, d.millis)))
+        {
+            dropped++;
+            continue;
+        }
+        batch_state_counts[d.id]++;
+
+        ReceivedState state{ .id = d.id, .received = received };
+        if (d.zone != zone)
+        {
+            // the server only sends a state from another zone when the ghost has just left ours, and all its ghost
+            // needs from it is the zone and millis to know when to hide, so the transform isn't built
+            state.state = State{ .zone = d.zone, .millis = d.millis };
+            DeliverState(state);
+            continue;
+        }
+        state.state = State
+        {
+            .transform = Transform
+            {
+                .location_x = d.location[0],
+                .location_y = d.location[1],
+                .location_z = d.location[2],
+                .rotation_x = d.rotation[0],
+                .rotation_y = d.rotation[1],
+                .rotation_z = d.rotation[2],
+            },
+            .zone = d.zone,
+            .millis = d.millis,
+        };
+        DeliverState(state);
+    }
+    return dropped;
+}
+
+// Decodes the states in one delta mode server packet like DecodePacket, keeping each one to decode later deltas
+// against. If every state could be decoded, the packet is acked.
+size_t DecodeDeltaPacket(
+    const boost::array<uint8_t, RECV>& buf,
+    size_t len,
+    const steady_time_point& received
+) {
+    if (len < DELTA_PACKET_HEADER_LEN || len > MAX_SERVER_PACKET_LEN)
+    {
+        Log(L"Received packet of invalid size " + std::to_wstring(len), LogType::Warning);
+        return 0;
+    }
+
+    BitStream::BitReader reader(buf.data(), len);
+    auto [sequence, flags, acked_millis, count, newest_millis] = DeltaPacketHeader::read(reader);
+    if ((flags & DELTA_PACKET_HAS_ACK) && int64_t(acked_millis) > delta_acked_millis)
+    {
+        delta_acked_millis = acked_millis;
+    }
+    std::optional<uint32_t> tick_millis = {};
+    if (flags & DELTA_PACKET_IS_SNAPSHOT)
+    {
+        auto [tick] = DeltaTick::read(reader);
+        tick_millis = tick * TICK_MILLIS;
+        ReceivedTick received_tick{ .millis = *tick_millis, .received = received };
+        if (threaded)
+        {
+            inbound_ticks.push(received_tick);
+        }
+        else
+        {
+            HandleTick(received_tick);
+        }
+    }
+
+    size_t dropped = 0;
+    bool complete = true;
+    uint32_t zone = current_zone;
+    for (size_t i = 0; i < count; i++)
+    {
+        auto player_id = uint16_t(reader.read(delta_wide ? 16 : 8));
+        if (player_id >= MAX_GHOSTS)
+        {
+            // the server never hands out ids this high, and without a history for it the rest of the packet can't be
+            // decoded
+            Log(L"Received state with out of range id " + std::to_wstring(player_id), LogType::Warning);
+            complete = false;
+            break;
+        }
+        std::optional<uint8_t> sequence = {};
+        if (delta_sequenced)
+        {
+            sequence = uint8_t(reader.read(8));
+        }
+        uint32_t ghost_millis = newest_millis - uint32_t(reader.read_varbits());
+        // the game thread can track the state now, even if it's then dropped; the net thread leaves it to ApplyState
+        if (sequence && !threaded)
+        {
+            TrackSequence(player_id, *sequence, ghost_millis, received);
+        }
+        auto& history = delta_history[player_id];
+        auto find_baseline = [&history](uint32_t millis) { return FindQuantized(history, millis); };
+        Delta::QuantizedState quantized;
+        if (!Delta::Decode(reader, ghost_millis, find_baseline, delta_short_keyframes, quantized))
+        {
+            // a delta against a state we never got; the server sends a keyframe once it hasn't heard an ack for a
+            // while, and the rest of the packet is still fine
+            complete = false;
+            continue;
+        }
+        if (history.can_insert(ghost_millis))
         {
-            // skip pos ahead the bytes it would have read for this player
-            pos += 19;
+            history.insert(quantized);
+        }
+
+        // see DecodePacket
+        if (batch_state_counts[player_id] == MAX_STATES || (!threaded && !WantsState(player_id, ghost_millis)))
+        {
+            dropped++;
             continue;
         }
-        auto& ghost = ghosts.at(player_id);
+        batch_state_counts[player_id]++;
 
-        uint32_t ghost_millis = DeserializeU32(buf, pos);
-        if (!ghost.can_insert(ghost_millis))
+        ReceivedState state{ .id = player_id, .received = received, .sequence = sequence, .tick_millis = tick_millis };
+        if (quantized.zone != zone)
         {
-            pos += 15;
+            // see DecodePacket. unlike there, the state had to be decoded in full anyway to keep it in history, but
+            // its transform still isn't built
+            state.state = State{ .zone = quantized.zone, .millis = ghost_millis };
+            DeliverState(state);
             continue;
         }
+        state.state = State{ .transform = Dequantize(quantized), .zone = quantized.zone, .millis = ghost_millis };
+        DeliverState(state);
+    }
+
+    if (reader.overflowed())
+    {
+        Log(L"Received truncated packet of size " + std::to_wstring(len), LogType::Warning);
+        return dropped;
+    }
+    if (complete)
+    {
+        RecordAck(sequence);
+    }
+    return dropped;
+}
+
+// Adds a fully decoded server packet to delta_acks. Must be called by whichever thread decodes packets.
+void RecordAck(uint16_t sequence)
+{
+    int64_t acks = delta_acks;
+    if (acks < 0)
+    {
+        delta_acks = sequence;
+        return;
+    }
+    auto newest = uint16_t(acks);
+    auto mask = uint32_t(acks >> 16);
+    auto ahead = uint16_t(sequence - newest);
+    if (ahead == 0)
+    {
+        return;
+    }
+    if (ahead < 0x8000)
+    {
+        // the old newest and everything in the mask are now ahead packets further behind
+        mask = ahead > 32 ? 0 : uint32_t(((uint64_t(mask) << 1) | 1) << (ahead - 1));
+        newest = sequence;
+    }
+    else
+    {
+        auto behind = uint16_t(newest - sequence);
+        if (behind > 32)
+        {
+            return;
+        }
+        mask |= uint32_t(1) << (behind - 1);
+    }
+    delta_acks = (int64_t(mask) << 16) | newest;
+}
 
-        State state{};
-        state.millis = ghost_millis;
-        state.zone = DeserializeU32(buf, pos);
-        state.info.location_x = DeserializeLocator(buf, pos);
-        state.info.location_y = DeserializeLocator(buf, pos);
-        state.info.location_z = DeserializeLocator(buf, pos);
-        state.info.rotation_x = DeserializeRotator(buf, pos);
-        state.info.rotation_y = DeserializeRotator(buf, pos);
-        state.info.rotation_z = DeserializeRotator(buf, pos);
-        ghost.insert(state, millis);
+// Measures how long after its tick a snapshot arrived. Must be called on the game thread.
+void HandleTick(const ReceivedTick& tick)
+{
+    if (!snapshot_playout || !server_clock.synced())
+    {
+        return;
+    }
+    snapshot_playout->add_sample(double(int32_t(ServerMillis(tick.received) - tick.millis)));
+}
+
+// Applies a decoded state to its ghost, or queues it for the game thread.
+void DeliverState(const ReceivedState& state)
+{
+    if (threaded)
+    {
+        inbound_states.push(state);
+    }
+    else
+    {
+        ApplyState(state);
+    }
+}
+
+// Returns whether a state from the player with this id and millis would be kept by its ghost.
+bool WantsState(uint16_t player_id, uint32_t ghost_millis)
+{
+    return timers && ghosts.contains(player_id) && ghosts.at(player_id).can_insert(ghost_millis);
+}
+
+// Gives a received state to its ghost. Must be called on the game thread.
+void ApplyState(const ReceivedState& received)
+{
+    if (received.sequence && threaded)
+    {
+        TrackSequence(received.id, *received.sequence, received.state.millis, received.received);
+    }
+    if (!WantsState(received.id, received.state.millis))
+    {
+        return;
+    }
+
+    State state = received.state;
+    uint32_t millis = received.tick_millis ? *received.tick_millis : ServerMillis(received.received);
+    ghosts.at(received.id).insert(state, millis);
+}
+
+// Records a state's sequence in its ghost's link stats. Must be called on the game thread.
+void TrackSequence(
+    uint16_t player_id,
+    uint8_t sequence,
+    uint32_t ghost_millis,
+    const std::chrono::steady_clock::time_point& received
+) {
+    if (!ghosts.contains(player_id))
+    {
+        return;
     }
+    double arrived = std::chrono::duration<double, std::milli>(received.time_since_epoch()).count();
+    ghosts.at(player_id).link.add(sequence, double(ghost_millis), arrived);
 }
 
 void OnErr(const std::string& error_message)
@@ -538,6 +2019,28 @@ void OnErr(const std::string& error_message)
     // TODO should we disconnect here?
 }
 
+void LogGhostStats(const Ghost& ghost)
+{
+    if (ghost.frames != 0)
+    {
+        Log(L"Ghost " + std::to_wstring(ghost.id) + L": playout delay "
+            + std::to_wstring(int64_t(ghost.playout.delay())) + L" ms, ran out of states on "
+            + std::to_wstring(ghost.underruns) + L" of " + std::to_wstring(ghost.frames) + L" frames");
+    }
+
+    LinkStats::Summary link = ghost.link.summary();
+    if (link.received == 0)
+    {
+        return;
+    }
+    auto percent = [](double fraction) { return std::to_wstring(int64_t(std::round(fraction * 100.0))) + L"%"; };
+    Log(L"Ghost " + std::to_wstring(ghost.id) + L": received " + std::to_wstring(link.received) + L" states, lost "
+        + std::to_wstring(link.lost) + L" (" + percent(link.loss()) + L", " + percent(link.recent_loss)
+        + L" recently), " + std::to_wstring(link.reordered) + L" reordered by up to "
+        + std::to_wstring(link.max_reorder_depth) + L", " + std::to_wstring(link.duplicates) + L" duplicates, "
+        + std::to_wstring(int64_t(std::round(link.jitter))) + L" ms jitter");
+}
+
 std::wstring ToWide(const std::string& input)
 {
     static std::wstring_convert<std::codecvt_utf8_utf16<wchar_t>> converter;
@@ -569,130 +2072,304 @@ RC::Unreal::FString ToFString(const std::string& input)
     return RC::Unreal::FString(ToWide(input).c_str());
 }
 
-// Serializes src into 1 byte of buf starting at pos and increments pos by 1.
-void SerializeU8(uint8_t src, boost::array<uint8_t, SEND>& buf, size_t& pos)
+// Converts a state to the integers delta mode sends.
+Delta::QuantizedState Quantize(const Transform& transform, uint32_t zone, uint32_t millis)
 {
-    buf[pos] = src;
-    pos += 1;
+    auto locator = [](double src) { return int32_t(std::llround(src * Delta::LOCATION_SCALE)); };
+    return Delta::QuantizedState
+    {
+        .millis = millis,
+        .zone = zone,
+        .location = {
+            locator(transform.location_x),
+            locator(transform.location_y),
+            locator(transform.location_z),
+        },
+        .rotation = {
+            uint8_t(Rotator::quantize(transform.rotation_x)),
+            uint8_t(Rotator::quantize(transform.rotation_y)),
+            uint8_t(Rotator::quantize(transform.rotation_z)),
+        },
+    };
 }
 
-// Serializes src into 4 bytes of buf starting at pos and increments pos by 4.
-void SerializeU32(uint32_t src, boost::array<uint8_t, SEND>& buf, size_t& pos)
+Transform Dequantize(const Delta::QuantizedState& state)
 {
-    buf[pos + 3] = uint8_t(src);
-    for (int i = 2; i >= 0; i--)
+    return Transform
     {
-        src >>= 8;
-        buf[pos + i] = uint8_t(src);
-    }
-    pos += 4;
+        .location_x = double(state.location[0]) / Delta::LOCATION_SCALE,
+        .location_y = double(state.location[1]) / Delta::LOCATION_SCALE,
+        .location_z = double(state.location[2]) / Delta::LOCATION_SCALE,
+        .rotation_x = Rotator::dequantize(state.rotation[0]),
+        .rotation_y = Rotator::dequantize(state.rotation[1]),
+        .rotation_z = Rotator::dequantize(state.rotation[2]),
+    };
 }
 
-// Serializes src into 4 bytes of buf starting at pos and increments pos by 4.
-void SerializeF32(float src, boost::array<uint8_t, SEND>& buf, size_t& pos)
-{
-    uint32_t src_bits = std::bit_cast<uint32_t>(src);
-    SerializeU32(src_bits, buf, pos);
+// Returns the state in states with exactly this millis, or null if there isn't one.
+const Delta::QuantizedState* FindQuantized(
+    const StateBuffer::StateBuffer<Delta::QuantizedState, MAX_STATES>& states,
+    uint32_t millis
+) {
+    size_t i = states.lower_bound(millis);
+    return i < states.size() && states[i].millis == millis ? &states[i] : nullptr;
 }
 
-// Casts src to a float, then serializes that into 4 bytes of buf starting at pos and increments pos by 4.
-void SerializeLocator(double src, boost::array<uint8_t, SEND>& buf, size_t& pos)
+// Calculates milliseconds since the Connected message. This function should only be called if clock_epoch has a
+// value.
+uint32_t LocalMillis(const steady_time_point& now)
 {
-    SerializeF32(float(src), buf, pos);
+    return uint32_t((now - *clock_epoch).count() / 1000000ll);
 }
 
-// Maps src from the range [-180.0, 180.0] to [0, 255], serializes that into 1 byte of buf starting at pos, and
-// increments pos by 1.
-void SerializeRotator(double src, boost::array<uint8_t, SEND>& buf, size_t& pos)
+// Estimates the server's millis at now. This function should only be called if the clock is synced.
+uint32_t ServerMillis(const steady_time_point& now)
 {
-    double scaled = (src + 180.0) * 256.0 / 360.0;
-    SerializeU8(uint8_t(scaled), buf, pos);
+    return server_clock.to_server(LocalMillis(now));
 }
 
-// Deserializes 1 byte of buf into a uint8_t starting at pos and increments pos by 1.
-uint8_t DeserializeU8(const boost::array<uint8_t, RECV>& buf, size_t& pos)
+// Increments nanos based on the amount of time that has passed since the last time this function was called. This
+// function should only be called if timers has a value. Returns now.
+steady_time_point AdvanceNanos()
 {
-    uint8_t result = buf[pos];
-    pos += 1;
-    return result;
+    auto now = std::chrono::steady_clock::now();
+    nanos += (now - *timers).count();
+    timers = now;
+    return now;
 }
 
-// Deserializes 4 bytes of buf into a uint32_t starting at pos and increments pos by 4.
-uint32_t DeserializeU32(const boost::array<uint8_t, RECV>& buf, size_t& pos)
+// Sends an update if enough nanos have been accrued. Returns whether an update was sent.
+bool TrySendUpdate(const Transform& transform, const uint32_t& millis)
 {
-    uint32_t result = buf[pos];
-    for (int i = 1; i < 4; i++)
+    if (nanos / nanos_per_update)
     {
-        result <<= 8;
-        result |= buf[pos + i];
+        nanos = nanos % nanos_per_update;
+        if (ShouldSuppress(transform, millis))
+        {
+            send_stats.suppressed++;
+            SendPoll();
+        }
+        else
+        {
+            SendUpdate(transform, millis);
+        }
+        return true;
     }
-    pos += 4;
-    return result;
+    return false;
 }
 
-// Deserializes 4 bytes of buf into a float starting at pos and increments pos by 4.
-float DeserializeF32(const boost::array<uint8_t, RECV>& buf, size_t& pos)
+// Returns whether other clients' extrapolation of our last few updates is close enough to transform that sending it
+// can be skipped.
+bool ShouldSuppress(const Transform& transform, uint32_t millis)
 {
-    uint32_t bits = DeserializeU32(buf, pos);
-    return std::bit_cast<float>(bits);
+    double threshold = Settings::GetSendErrorThreshold();
+    if (threshold <= 0.0 || sent_ghost.states.empty())
+    {
+        return false;
+    }
+
+    const State& back = sent_ghost.states.back();
+    if (back.zone != current_zone
+        || Rotator::quantize(back.transform.rotation_x) != Rotator::quantize(transform.rotation_x)
+        || Rotator::quantize(back.transform.rotation_y) != Rotator::quantize(transform.rotation_y)
+        || Rotator::quantize(back.transform.rotation_z) != Rotator::quantize(transform.rotation_z))
+    {
+        return false;
+    }
+
+    // millis is always past back since it's at least as new as the last update sent, so this is the extrapolation
+    Span span = sent_ghost.get_extrapolated(millis);
+    double elapsed = double(span.millis - span.from->millis);
+    double span_millis = double(span.to->millis - span.from->millis);
+    double pct = span_millis > 0.0 ? elapsed / span_millis : 0.0;
+    auto error = [pct](double from, double to, double actual) { return from + (to - from) * pct - actual; };
+    const auto& from = span.from->transform;
+    const auto& to = span.to->transform;
+    double dx = error(from.location_x, to.location_x, transform.location_x);
+    double dy = error(from.location_y, to.location_y, transform.location_y);
+    double dz = error(from.location_z, to.location_z, transform.location_z);
+    if (dx * dx + dy * dy + dz * dz > threshold * threshold)
+    {
+        return false;
+    }
+
+    if (millis - back.millis >= KEEPALIVE_MILLIS)
+    {
+        send_stats.keepalives++;
+        return false;
+    }
+    return true;
 }
 
-// Deserializes 4 bytes of buf into a float starting at pos and increments pos by 4, then casts the float to a double.
-double DeserializeLocator(const boost::array<uint8_t, RECV>& buf, size_t& pos)
+// Sends an update.
+void SendUpdate(const Transform& transform, uint32_t millis)
 {
-    return double(DeserializeF32(buf, pos));
+    // the clock estimate can step back a little when a better sample comes in, but the server and other clients
+    // expect each update to be newer than the last
+    if (last_sent_millis && millis <= *last_sent_millis)
+    {
+        millis = *last_sent_millis + 1;
+    }
+    last_sent_millis = millis;
+    send_stats.updates++;
+    sent_ghost.states.insert(State{ .transform = transform, .zone = current_zone, .millis = millis });
+    if (delta_mode)
+    {
+        SendDeltaUpdate(transform, millis);
+        return;
+    }
+
+    boost::array<uint8_t, SEND> buf{};
+    BitStream::BitWriter writer(buf.data(), buf.size());
+    StateHeader::write(writer, uint8_t(*id), millis);
+    const auto& t = transform;
+    StateBody::write(
+        writer, current_zone, t.location_x, t.location_y, t.location_z, t.rotation_x, t.rotation_y, t.rotation_z);
+    SendPacket(buf, writer.bytes());
 }
 
-// Deserializes 1 byte of buf starting at pos and increments pos by 1, then maps that byte to the range [-180.0, 180.0].
-double DeserializeRotator(const boost::array<uint8_t, RECV>& buf, size_t& pos)
+// Sends an update in delta mode, encoded against the newest of our updates the server has.
+void SendDeltaUpdate(const Transform& transform, uint32_t millis)
 {
-    uint8_t byte = DeserializeU8(buf, pos);
-    return double(byte) * 360.0 / 256.0 - 180.0;
+    auto state = Quantize(transform, current_zone, millis);
+    const Delta::QuantizedState* baseline = nullptr;
+    int64_t acked_millis = delta_acked_millis;
+    if (acked_millis >= 0 && last_keyframe_millis && millis - *last_keyframe_millis < KEYFRAME_MILLIS)
+    {
+        baseline = FindQuantized(delta_sent, uint32_t(acked_millis));
+    }
+    if (!baseline)
+    {
+        last_keyframe_millis = millis;
+    }
+
+    // repeat the updates just before this one, in case their packets were lost
+    size_t redundant = std::min(size_t(delta_redundancy), delta_sent.size());
+
+    // the state is encoded on its own first, so one that doesn't fit can be replaced before the header, which takes a
+    // sequence number, is written. a writer skips what doesn't fit but carries on, so an unchecked overflow would send
+    // a corrupt packet
+    boost::array<uint8_t, SEND - DELTA_UPDATE_HEADER_LEN> body_buf{};
+    BitStream::BitWriter body(body_buf.data(), body_buf.size());
+    Delta::Encode(body, state, baseline, delta_short_keyframes);
+    if (body.overflowed() && baseline)
+    {
+        // SEND covers the biggest delta, so this shouldn't happen
+        Log(L"Delta update didn't fit in a packet, sending a keyframe instead", LogType::Warning);
+        baseline = nullptr;
+        last_keyframe_millis = millis;
+        body_buf.fill(0);
+        body = BitStream::BitWriter(body_buf.data(), body_buf.size());
+        Delta::Encode(body, state, baseline, delta_short_keyframes);
+    }
+    if (body.overflowed())
+    {
+        Log(L"Keyframe didn't fit in a packet", LogType::Error);
+        return;
+    }
+    if (redundant > 0)
+    {
+        Delta::EncodeRedundant(body, state, delta_sent, redundant);
+    }
+    if (body.overflowed())
+    {
+        // SEND covers the biggest redundant block too, so this shouldn't happen either. the earlier states are only
+        // a backup, so they're left out
+        Log(L"Delta update with earlier states didn't fit in a packet, sending it without them", LogType::Warning);
+        redundant = 0;
+        body_buf.fill(0);
+        body = BitStream::BitWriter(body_buf.data(), body_buf.size());
+        Delta::Encode(body, state, baseline, delta_short_keyframes);
+    }
+
+    boost::array<uint8_t, SEND> buf{};
+    BitStream::BitWriter writer(buf.data(), buf.size());
+    WriteDeltaHeader(redundant > 0 ? DELTA_HAS_STATE | DELTA_HAS_REDUNDANT : DELTA_HAS_STATE, writer);
+    DeltaMillis::write(writer, millis);
+    // the header is whole bytes, so the state can be copied in after it as is
+    std::copy_n(body_buf.begin(), body.bytes(), writer.cursor());
+    // millis always increases, so this is always kept
+    delta_sent.insert(state);
+    SendPacket(buf, writer.bytes() + body.bytes());
 }
 
-// Calculates milliseconds since the first update. This function should only be called if timers has a value.
-uint32_t MillisSinceStart(const steady_time_point& now)
+void SendPoll()
 {
-    return uint32_t((now - timers->first).count() / 1000000ll);
+    boost::array<uint8_t, SEND> buf{};
+    BitStream::BitWriter writer(buf.data(), buf.size());
+    if (delta_mode)
+    {
+        // a delta poll still carries our ack, so the server's deltas keep moving forward while we're suppressed
+        WriteDeltaHeader(0, writer);
+    }
+    else
+    {
+        Poll::write(writer, uint8_t(*id));
+    }
+    SendPacket(buf, writer.bytes());
 }
 
-// Increments nanos based on the amount of time that has passed since the last time this function was called. This
-// function should only be called if timers has a value. Returns now.
-steady_time_point AdvanceNanos()
+// Writes our id, flags, ack and sequence for a delta update or poll.
+void WriteDeltaHeader(uint8_t flags, BitStream::BitWriter& writer)
 {
-    auto now = std::chrono::steady_clock::now();
-    nanos += (now - timers->second).count();
-    timers->second = now;
-    return now;
+    int64_t acks = delta_acks;
+    bool has_mask = acks >= 0 && delta_ack_mask;
+    if (acks >= 0)
+    {
+        flags |= DELTA_HAS_ACK;
+    }
+    if (has_mask)
+    {
+        flags |= DELTA_HAS_ACK_MASK;
+    }
+    if (delta_sequenced)
+    {
+        flags |= DELTA_HAS_SEQUENCE;
+    }
+    if (delta_wide)
+    {
+        WideDeltaHeader::write(writer, WIDE_ID_MARKER, *id, flags, uint16_t(acks));
+    }
+    else
+    {
+        DeltaHeader::write(writer, uint8_t(*id), flags, uint16_t(acks));
+    }
+    if (has_mask)
+    {
+        DeltaAckMask::write(writer, uint32_t(acks >> 16));
+    }
+    if (delta_sequenced)
+    {
+        DeltaSequence::write(writer, delta_next_sequence++);
+    }
 }
 
-// Sends an update if enough nanos have been accrued. Returns whether an update was sent.
-bool TrySendUpdate(const FST_PlayerInfo& info, const uint32_t& millis)
+void SendPing(const steady_time_point& now)
 {
-    if (nanos / NANOS_PER_UPDATE)
+    boost::array<uint8_t, SEND> buf{};
+    BitStream::BitWriter writer(buf.data(), buf.size());
+    if (delta_wide)
     {
-        nanos = nanos % NANOS_PER_UPDATE;
-        SendUpdate(info, millis);
-        return true;
+        WidePing::write(writer, WIDE_ID_MARKER, *id, LocalMillis(now));
     }
-    return false;
+    else
+    {
+        Ping::write(writer, uint8_t(*id), LocalMillis(now));
+    }
+    SendPacket(buf, writer.bytes());
 }
 
-// Sends an update.
-void SendUpdate(const FST_PlayerInfo& info, const uint32_t& millis)
+void SendPacket(const boost::array<uint8_t, SEND>& buf, size_t len)
 {
-    boost::array<uint8_t, SEND> buf{};
-    size_t pos = 0;
-    SerializeU8(*id, buf, pos);
-    SerializeU32(millis, buf, pos);
-    SerializeU32(current_zone, buf, pos);
-    SerializeLocator(info.location_x, buf, pos);
-    SerializeLocator(info.location_y, buf, pos);
-    SerializeLocator(info.location_z, buf, pos);
-    SerializeRotator(info.rotation_x, buf, pos);
-    SerializeRotator(info.rotation_y, buf, pos);
-    SerializeRotator(info.rotation_z, buf, pos);
-    udp->Send(buf);
+    if (threaded)
+    {
+        // if the net thread is somehow this far behind, dropping the packet is fine since a newer one is coming
+        outbound_packets.push(OutboundPacket{ .buf = buf, .len = len });
+    }
+    else
+    {
+        udp->Send(buf, len);
+    }
 }
 
 } // namespace
@@ -2,6 +2,8 @@
 
 #include "Settings.hpp"
 
+#include <algorithm>
+#include <cmath>
 #include <codecvt>
 #include <fstream>
 #include <iostream>
@@ -14,6 +16,8 @@ namespace
 {
     void ParseSetting(std::string&, toml::table, const std::string&);
     void ParseSetting(std::array<uint8_t, 3>&, toml::table, const std::string&);
+    void ParseSetting(bool&, toml::table, const std::string&);
+    void ParseSetting(double&, toml::table, const std::string&);
     std::wstring ToWide(const std::string&);
 
     // if you run from the executable directory
@@ -25,6 +29,15 @@ namespace
     std::string port = "23432";
     std::array<uint8_t, 3> color = { 0x00, 0x7f, 0xff };
 	std::string name = "Sybil";
+    bool threaded_network = false;
+    double underrun_target = 0.05;
+    double extrapolation_millis = 150.0;
+    double send_rate = 30.0;
+    double send_error_threshold = 5.0;
+    bool delta_compression = true;
+    double send_redundancy = 2.0;
+    bool snapshots = false;
+    bool udp_transport = false;
 }
 
 void Settings::Load()
@@ -56,6 +69,19 @@ void Settings::Load()
     ParseSetting(port, settings_table, "server.port");
     ParseSetting(color, settings_table, "sybil.color");
     ParseSetting(name, settings_table, "sybil.name");
+    ParseSetting(threaded_network, settings_table, "network.threaded");
+    ParseSetting(underrun_target, settings_table, "network.underrun_target");
+    ParseSetting(extrapolation_millis, settings_table, "network.extrapolation_millis");
+    extrapolation_millis = std::clamp(extrapolation_millis, 0.0, 1000.0);
+    ParseSetting(send_rate, settings_table, "network.send_rate");
+    send_rate = std::clamp(send_rate, 10.0, 60.0);
+    ParseSetting(send_error_threshold, settings_table, "network.send_error_threshold");
+    send_error_threshold = std::clamp(send_error_threshold, 0.0, 100.0);
+    ParseSetting(delta_compression, settings_table, "network.delta_compression");
+    ParseSetting(send_redundancy, settings_table, "network.send_redundancy");
+    send_redundancy = std::clamp(send_redundancy, 0.0, 4.0);
+    ParseSetting(snapshots, settings_table, "network.snapshots");
+    ParseSetting(udp_transport, settings_table, "network.udp_transport");
 }
 
 const std::string& Settings::GetAddress()
@@ -78,6 +104,51 @@ const std::string & Settings::GetName()
     return name;
 }
 
+bool Settings::GetThreadedNetwork()
+{
+    return threaded_network;
+}
+
+double Settings::GetUnderrunTarget()
+{
+    return underrun_target;
+}
+
+double Settings::GetExtrapolationMillis()
+{
+    return extrapolation_millis;
+}
+
+double Settings::GetSendRate()
+{
+    return send_rate;
+}
+
+double Settings::GetSendErrorThreshold()
+{
+    return send_error_threshold;
+}
+
+bool Settings::GetDeltaCompression()
+{
+    return delta_compression;
+}
+
+double Settings::GetSendRedundancy()
+{
+    return send_redundancy;
+}
+
+bool Settings::GetSnapshots()
+{
+    return snapshots;
+}
+
+bool Settings::GetUdpTransport()
+{
+    return udp_transport;
+}
+
 namespace
 {
 
@@ -130,6 +201,33 @@ void ParseSetting(std::array<uint8_t, 3>& setting, toml::table settings_table, c
     setting = { red, green, blue };
 }
 
+void ParseSetting(bool& setting, toml::table settings_table, const std::string& setting_path)
+{
+    std::optional<bool> option = settings_table.at_path(setting_path).value<bool>();
+    if (!option)
+    {
+        Log(ToWide(setting_path) + L" = default (setting missing or not a boolean)");
+        return;
+    }
+
+    Log(ToWide(setting_path) + (*option ? L" = true" : L" = false"));
+    setting = *option;
+}
+
+void ParseSetting(double& setting, toml::table settings_table, const std::string& setting_path)
+{
+    std::optional<double> option = settings_table.at_path(setting_path).value<double>();
+    // nan and inf are valid toml, but std::clamp passes nan through, so neither is ever wanted
+    if (!option || !std::isfinite(*option))
+    {
+        Log(ToWide(setting_path) + L" = default (setting missing or not a number)");
+        return;
+    }
+
+    Log(ToWide(setting_path) + L" = " + std::to_wstring(*option));
+    setting = *option;
+}
+
 std::wstring ToWide(const std::string& input)
 {
     static std::wstring_convert<std::codecvt_utf8_utf16<wchar_t>> converter;
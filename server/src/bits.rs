@@ -0,0 +1,154 @@
+/// Writes values of up to 64 bits with no padding between them, least significant bit first both
+/// within each value and within each byte. Matches BitStream.hpp in the client.
+pub struct BitWriter {
+    // 0 past what's been written, and grown as it's written so there are always 16 bytes from the
+    // byte being written to, which a value is ORed into with one load and store
+    bytes: Vec<u8>,
+    bits: usize,
+}
+
+impl BitWriter {
+    pub fn new() -> Self {
+        Self { bytes: Vec::new(), bits: 0 }
+    }
+
+    pub fn write(&mut self, value: u64, bits: u32) {
+        // bits of value past the count are dropped. the value is shifted to where it starts in the
+        // last byte and ORed into the 8 bytes from there, or 16 if it runs past them
+        let value = if bits < u64::BITS { value & ((1 << bits) - 1) } else { value };
+        let start = self.bits / 8;
+        let shift = self.bits % 8;
+        if self.bytes.len() < start + 16 {
+            self.bytes.resize(start + 64, 0);
+        }
+        if shift + bits as usize <= 64 {
+            let window: &mut [u8; 8] = (&mut self.bytes[start..start + 8]).try_into().unwrap();
+            *window = (u64::from_le_bytes(*window) | value << shift).to_le_bytes();
+        } else {
+            let window: &mut [u8; 16] = (&mut self.bytes[start..start + 16]).try_into().unwrap();
+            let shifted = (value as u128) << shift;
+            *window = (u128::from_le_bytes(*window) | shifted).to_le_bytes();
+        }
+        self.bits += bits as usize;
+    }
+
+    pub fn write_bool(&mut self, value: bool) {
+        self.write(value as u64, 1);
+    }
+
+    /// Returns how many bits write_varbits takes to write value.
+    pub fn varbits_len(value: u64) -> usize {
+        6 + (64 - value.leading_zeros()) as usize
+    }
+
+    /// Writes value as a 6 bit length followed by that many bits. value must be less than 2^63.
+    pub fn write_varbits(&mut self, value: u64) {
+        let bits = 64 - value.leading_zeros();
+        self.write(bits as u64, 6);
+        self.write(value, bits);
+    }
+
+    /// Writes value with write_varbits after zigzag encoding it.
+    pub fn write_signed(&mut self, value: i64) {
+        self.write_varbits(((value << 1) ^ (value >> 63)) as u64);
+    }
+
+    /// Writes the first `bits` bits of words, as if each word was written in turn.
+    pub fn write_words(&mut self, words: &[u64], bits: usize) {
+        for (i, word) in words.iter().take(bits.div_ceil(64)).enumerate() {
+            self.write(*word, (bits - i * 64).min(64) as u32);
+        }
+    }
+
+    pub fn bits(&self) -> usize {
+        self.bits
+    }
+
+    pub fn into_bytes(mut self) -> Vec<u8> {
+        self.bytes.truncate(self.bits.div_ceil(8));
+        self.bytes
+    }
+}
+
+/// Reads values written by a BitWriter. Reading past the end returns None.
+pub struct BitReader<'a> {
+    bytes: &'a [u8],
+    bits: usize,
+}
+
+impl<'a> BitReader<'a> {
+    pub fn new(bytes: &'a [u8]) -> Self {
+        Self { bytes, bits: 0 }
+    }
+
+    pub fn read(&mut self, bits: u32) -> Option<u64> {
+        if self.bits + bits as usize > self.bytes.len() * 8 {
+            return None;
+        }
+        let mut value = 0;
+        for i in 0..bits {
+            let bit = (self.bytes[self.bits / 8] >> (self.bits % 8)) & 1;
+            value |= (bit as u64) << i;
+            self.bits += 1;
+        }
+        Some(value)
+    }
+
+    pub fn read_bool(&mut self) -> Option<bool> {
+        Some(self.read(1)? != 0)
+    }
+
+    pub fn read_varbits(&mut self) -> Option<u64> {
+        let bits = self.read(6)? as u32;
+        self.read(bits)
+    }
+
+    pub fn read_signed(&mut self) -> Option<i64> {
+        let value = self.read_varbits()?;
+        Some((value >> 1) as i64 ^ -((value & 1) as i64))
+    }
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+
+    #[test]
+    fn reads_back_what_was_written() {
+        let mut seed = 1u64;
+        let mut next = || {
+            seed = seed
+                .wrapping_mul(6_364_136_223_846_793_005)
+                .wrapping_add(1_442_695_040_888_963_407);
+            seed
+        };
+        for _ in 0..1000 {
+            let mut writer = BitWriter::new();
+            let mut written = Vec::new();
+            for _ in 0..next() % 20 {
+                let bits = (next() % 65) as u32;
+                let value = next() & if bits < 64 { (1 << bits) - 1 } else { u64::MAX };
+                writer.write(value, bits);
+                written.push((value, bits));
+                // and sometimes a whole word and part of another
+                if next() % 4 == 0 {
+                    let words = [next(), next()];
+                    let bits = 64 + (next() % 64) as u32;
+                    writer.write_words(&words, bits as usize);
+                    written.push((words[0], 64));
+                    written.push((words[1] & ((1 << (bits - 64)) - 1), bits - 64));
+                }
+            }
+            let total: usize = written.iter().map(|(_, bits)| *bits as usize).sum();
+            assert_eq!(writer.bits(), total);
+            let bytes = writer.into_bytes();
+            assert_eq!(bytes.len(), total.div_ceil(8));
+            let mut reader = BitReader::new(&bytes);
+            for (value, bits) in written {
+                assert_eq!(reader.read(bits), Some(value));
+            }
+            // the rest of the last byte is 0
+            assert_eq!(reader.read(((8 - total % 8) % 8) as u32), Some(0));
+        }
+    }
+}
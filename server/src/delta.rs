@@ -0,0 +1,572 @@
+use crate::{
+    bits::{BitReader, BitWriter},
+    state::STATE_LEN,
+};
+
+/// The feature clients ask for in Connect to use delta packets.
+pub const FEATURE: &str = "delta";
+
+/// The feature clients ask for in Connect, along with delta, to repeat earlier states in updates.
+pub const REDUNDANCY_FEATURE: &str = "redundancy";
+
+/// The feature clients ask for in Connect, along with delta, to be able to get an id of 255 or
+/// more. Ids in packets to and from them are then 16 bits.
+pub const WIDE_IDS_FEATURE: &str = "wide_ids";
+
+/// The feature clients ask for in Connect, along with delta, to ack every packet of a reply that
+/// takes more than one.
+pub const ACK_MASK_FEATURE: &str = "ack_mask";
+
+/// The feature clients ask for in Connect, along with delta, to send keyframe locations as 20 bit
+/// offsets when they can.
+pub const SHORT_KEYFRAMES_FEATURE: &str = "short_keyframes";
+
+/// Locations are sent as fixed point numbers with this many steps per unit.
+pub const LOCATION_SCALE: f32 = 8.0;
+
+/// In short keyframes, a location inside a box of 2^SHORT_LOCATION_BITS steps on each axis centered
+/// on the origin, about 1.3 km across, is sent as offsets from the box's minimum corner. Locations
+/// outside it are still sent in full. Matches Delta.hpp in the client.
+const SHORT_LOCATION_BITS: u32 = 20;
+const SHORT_LOCATION_MIN: i64 = -(1 << (SHORT_LOCATION_BITS - 1));
+
+/// Returns the offset of each axis of location from the short box's minimum corner, or None if
+/// it's outside the box.
+fn short_offsets(location: &[i32; 3]) -> Option<[u64; 3]> {
+    let mut offsets = [0; 3];
+    for i in 0..3 {
+        let offset = location[i] as i64 - SHORT_LOCATION_MIN;
+        if offset < 0 || offset >= 1 << SHORT_LOCATION_BITS {
+            return None;
+        }
+        offsets[i] = offset as u64;
+    }
+    Some(offsets)
+}
+
+/// A delta player's update is its id, flags, the sequence of the newest packet it fully decoded,
+/// a mask of which of the packets before that one it also fully decoded if it sends one, its own
+/// sequence if it numbers its packets, the state's millis and then the state itself. A poll is the
+/// same without the millis and state. The id is parsed by the caller, so everything here starts
+/// at the flags.
+const POLL_LEN: usize = 3;
+const HAS_STATE: u8 = 1;
+const HAS_ACK: u8 = 2;
+/// Set if the state is followed by a count and then that many of the sender's earlier states,
+/// newest first, each as how many millis older it is than the one before it and its change from
+/// that one.
+const HAS_REDUNDANT: u8 = 4;
+const REDUNDANT_COUNT_BITS: u32 = 3;
+const HAS_SEQUENCE: u8 = 8;
+const HAS_ACK_MASK: u8 = 16;
+
+/// A packet to a delta player is a sequence, flags, the millis of the newest of its own states the
+/// server has, the number of states, the millis those states are relative to, the tick number if
+/// it's a snapshot (see snapshots::FEATURE) and then the states. It's always longer than a pong.
+/// Each state is its sender, 16 bits if the player agreed to
+/// WIDE_IDS_FEATURE and 8 otherwise, its 8 bit sequence if the player agreed to
+/// link_stats::FEATURE, its millis offset and then the state itself.
+const PACKET_HEADER_LEN: usize = 12;
+const PACKET_HAS_ACK: u8 = 1;
+const PACKET_IS_SNAPSHOT: u8 = 2;
+const TICK_LEN: usize = 4;
+const MAX_PACKET_LEN: usize = 504;
+const _: () = assert!(PACKET_HEADER_LEN > 8 && MAX_PACKET_LEN <= 508);
+
+/// The fewest bits a state in a packet can take: its sender, a zero millis offset and a delta that
+/// changes nothing. Packets never hold more states than their count byte can say.
+const MIN_STATE_BITS: usize = 8 + 6 + 1 + 6 + 1 + 3 * 6 + 3;
+const _: () = assert!((MAX_PACKET_LEN - PACKET_HEADER_LEN) * 8 / MIN_STATE_BITS <= u8::MAX as usize);
+
+/// A state the way it's sent in delta mode. Everything is an integer so that a state rebuilt from
+/// a baseline and a delta is exactly the state that was encoded.
+#[derive(Clone, Copy)]
+pub struct Quantized {
+    pub millis: u32,
+    pub zone: u32,
+    pub location: [i32; 3],
+    pub rotation: [u8; 3],
+}
+
+impl Quantized {
+    /// Parses a state from the 24 byte format.
+    pub fn from_state_bytes(bytes: &[u8; STATE_LEN]) -> Self {
+        let u32_at = |i: usize| u32::from_be_bytes(bytes[i..i + 4].try_into().unwrap());
+        let location_at = |i: usize| (f32::from_bits(u32_at(i)) * LOCATION_SCALE).round() as i32;
+        Self {
+            millis: u32_at(1),
+            zone: u32_at(5),
+            location: [location_at(9), location_at(13), location_at(17)],
+            rotation: [bytes[21], bytes[22], bytes[23]],
+        }
+    }
+
+    /// Returns the state in the 24 byte format, for players that don't use delta packets.
+    pub fn to_state_bytes(&self, id: u8) -> [u8; STATE_LEN] {
+        let mut bytes = [0u8; STATE_LEN];
+        bytes[0] = id;
+        bytes[1..5].copy_from_slice(&self.millis.to_be_bytes());
+        bytes[5..9].copy_from_slice(&self.zone.to_be_bytes());
+        for (i, location) in self.location.iter().enumerate() {
+            let start = 9 + i * 4;
+            let location = *location as f32 / LOCATION_SCALE;
+            bytes[start..start + 4].copy_from_slice(&location.to_bits().to_be_bytes());
+        }
+        bytes[21..24].copy_from_slice(&self.rotation);
+        bytes
+    }
+}
+
+/// Writes state relative to baseline, or as a keyframe if there's no baseline. The state's millis
+/// isn't written, but a delta does say which baseline it's relative to. short_keyframes is whether
+/// the receiver agreed to SHORT_KEYFRAMES_FEATURE. Nothing else about the receiver goes into it, so
+/// one encoding can be shared by everyone sent the same state against the same baseline.
+fn encode(
+    writer: &mut BitWriter,
+    state: &Quantized,
+    baseline: Option<&Quantized>,
+    short_keyframes: bool,
+) {
+    writer.write_bool(baseline.is_none());
+    let Some(baseline) = baseline else {
+        writer.write(state.zone as u64, 32);
+        let offsets = if short_keyframes { short_offsets(&state.location) } else { None };
+        if short_keyframes {
+            writer.write_bool(offsets.is_some());
+        }
+        match offsets {
+            Some(offsets) => offsets.iter().for_each(|o| writer.write(*o, SHORT_LOCATION_BITS)),
+            None => state.location.iter().for_each(|l| writer.write(*l as u32 as u64, 32)),
+        }
+        for rotation in state.rotation {
+            writer.write(rotation as u64, 8);
+        }
+        return;
+    };
+
+    writer.write_varbits(state.millis.wrapping_sub(baseline.millis) as u64);
+    writer.write_bool(state.zone != baseline.zone);
+    if state.zone != baseline.zone {
+        writer.write(state.zone as u64, 32);
+    }
+    for (location, base) in state.location.iter().zip(baseline.location) {
+        writer.write_signed(*location as i64 - base as i64);
+    }
+    for (rotation, base) in state.rotation.iter().zip(baseline.rotation) {
+        writer.write_bool(*rotation != base);
+        if *rotation != base {
+            writer.write(*rotation as u64, 8);
+        }
+    }
+}
+
+/// How a state differs from another of the same player, as written after a delta's millis offset
+/// and for each redundant state.
+struct Change {
+    zone: Option<u32>,
+    location_deltas: [i64; 3],
+    rotations: [Option<u8>; 3],
+}
+
+impl Change {
+    fn read(reader: &mut BitReader) -> Option<Self> {
+        let zone = if reader.read_bool()? { Some(reader.read(32)? as u32) } else { None };
+        let mut location_deltas = [0; 3];
+        for delta in &mut location_deltas {
+            *delta = reader.read_signed()?;
+        }
+        let mut rotations = [None; 3];
+        for r in &mut rotations {
+            if reader.read_bool()? {
+                *r = Some(reader.read(8)? as u8);
+            }
+        }
+        Some(Self { zone, location_deltas, rotations })
+    }
+
+    fn apply(&self, base: &Quantized, millis: u32) -> Quantized {
+        let mut state = Quantized { millis, zone: self.zone.unwrap_or(base.zone), ..*base };
+        for i in 0..3 {
+            state.location[i] = (base.location[i] as i64 + self.location_deltas[i]) as i32;
+            state.rotation[i] = self.rotations[i].unwrap_or(base.rotation[i]);
+        }
+        state
+    }
+}
+
+/// Reads a state written by encode whose millis is already known. find_baseline is given the millis
+/// of a delta's baseline. Returns None if the baseline can't be found or the state is cut off.
+fn decode(
+    reader: &mut BitReader,
+    millis: u32,
+    find_baseline: impl Fn(u32) -> Option<Quantized>,
+    short_keyframes: bool,
+) -> Option<Quantized> {
+    if reader.read_bool()? {
+        let zone = reader.read(32)? as u32;
+        let inside = short_keyframes && reader.read_bool()?;
+        let mut location = [0; 3];
+        for l in &mut location {
+            *l = if inside {
+                (SHORT_LOCATION_MIN + reader.read(SHORT_LOCATION_BITS)? as i64) as i32
+            } else {
+                reader.read(32)? as u32 as i32
+            };
+        }
+        let mut rotation = [0; 3];
+        for r in &mut rotation {
+            *r = reader.read(8)? as u8;
+        }
+        return Some(Quantized { millis, zone, location, rotation });
+    }
+
+    let baseline_millis = millis.wrapping_sub(reader.read_varbits()? as u32);
+    let change = Change::read(reader)?;
+    Some(change.apply(&find_baseline(baseline_millis)?, millis))
+}
+
+/// The parts of a delta player's update before its state.
+pub struct UpdateHeader {
+    pub id: u16,
+    pub ack: Option<u16>,
+    // bit i is set if the packet i + 1 before ack was also fully decoded
+    pub ack_mask: u32,
+    pub sequence: Option<u16>,
+    pub millis: Option<u32>,
+    redundant: bool,
+    // where the state starts
+    len: usize,
+}
+
+/// Parses the header of an update or poll from the delta player with this id, where buf starts
+/// after the id. Returns None if it's malformed.
+pub fn parse_update_header(id: u16, buf: &[u8]) -> Option<UpdateHeader> {
+    if buf.len() < POLL_LEN {
+        return None;
+    }
+    let flags = buf[0];
+    let ack = u16::from_be_bytes([buf[1], buf[2]]);
+    let mut len = POLL_LEN;
+    let ack_mask = if flags & HAS_ACK_MASK != 0 {
+        let mask = u32::from_be_bytes(buf.get(len..len + 4)?.try_into().unwrap());
+        len += 4;
+        mask
+    } else {
+        0
+    };
+    let sequence = if flags & HAS_SEQUENCE != 0 {
+        let sequence = u16::from_be_bytes(buf.get(len..len + 2)?.try_into().unwrap());
+        len += 2;
+        Some(sequence)
+    } else {
+        None
+    };
+    let millis = if flags & HAS_STATE != 0 {
+        // the state takes at least a byte
+        if buf.len() <= len + 4 {
+            return None;
+        }
+        let millis = u32::from_be_bytes(buf[len..len + 4].try_into().unwrap());
+        len += 4;
+        Some(millis)
+    } else {
+        None
+    };
+    Some(UpdateHeader {
+        id,
+        ack: (flags & HAS_ACK != 0).then_some(ack),
+        ack_mask,
+        sequence,
+        millis,
+        redundant: flags & HAS_REDUNDANT != 0,
+        len,
+    })
+}
+
+/// Decodes the state in an update, followed by any earlier states the sender repeated in it,
+/// newest first. find_baseline looks up the sender's own stored states. Returns None if the update
+/// has no state or it can't be decoded; earlier states that are cut off are left out.
+pub fn decode_update(
+    buf: &[u8],
+    header: &UpdateHeader,
+    find_baseline: impl Fn(u32) -> Option<Quantized>,
+    short_keyframes: bool,
+) -> Option<(Quantized, Vec<Quantized>)> {
+    let mut reader = BitReader::new(&buf[header.len..]);
+    let state = decode(&mut reader, header.millis?, find_baseline, short_keyframes)?;
+    let mut redundant = Vec::new();
+    if header.redundant {
+        let count = reader.read(REDUNDANT_COUNT_BITS).unwrap_or(0);
+        let mut after = state;
+        for _ in 0..count {
+            // every state is older than the one before it
+            let Some(gap) = reader.read_varbits().filter(|gap| *gap > 0) else {
+                break;
+            };
+            let Some(change) = Change::read(&mut reader) else {
+                break;
+            };
+            after = change.apply(&after, after.millis.wrapping_sub(gap as u32));
+            redundant.push(after);
+        }
+    }
+    Some((state, redundant))
+}
+
+/// The most bits encode can write: a delta whose millis offset, zone and locations all take their
+/// full width.
+const MAX_STATE_BITS: usize = 1 + (6 + 32) + 1 + 32 + 3 * (6 + 33) + 3 * 9;
+
+/// A state as written by encode. It's short, so it's kept inline.
+#[derive(Clone, Copy)]
+pub struct Encoded {
+    words: [u64; MAX_STATE_BITS.div_ceil(64)],
+    bits: usize,
+}
+
+impl Encoded {
+    /// Encodes state like encode.
+    pub fn new(state: &Quantized, baseline: Option<&Quantized>, short_keyframes: bool) -> Self {
+        let mut writer = BitWriter::new();
+        encode(&mut writer, state, baseline, short_keyframes);
+        let bits = writer.bits();
+        let mut words = [0; MAX_STATE_BITS.div_ceil(64)];
+        for (word, chunk) in words.iter_mut().zip(writer.into_bytes().chunks(8)) {
+            let mut bytes = [0; 8];
+            bytes[..chunk.len()].copy_from_slice(chunk);
+            *word = u64::from_le_bytes(bytes);
+        }
+        Self { words, bits }
+    }
+}
+
+/// A state to send to a delta player.
+pub struct Outgoing {
+    pub sender: u16,
+    // the state's place among the sender's states sent to this player, if they're numbered
+    pub sequence: Option<u8>,
+    pub millis: u32,
+    pub encoded: Encoded,
+}
+
+/// A packet built for a delta player, with the sender and millis of each state in it so the
+/// states can become baselines once the packet is acked.
+pub struct Packet {
+    pub sequence: u16,
+    pub bytes: Vec<u8>,
+    pub states: Vec<(u16, u32)>,
+}
+
+/// Packs states into as few packets as fit, numbering them from next_sequence. ack is the millis
+/// of the newest state the server has from the receiver, and tick is set if the packets are a
+/// snapshot.
+pub fn build_packets(
+    states: &[Outgoing],
+    ack: Option<u32>,
+    tick: Option<u32>,
+    next_sequence: &mut u16,
+    wide: bool,
+) -> Vec<Packet> {
+    // every state is encoded relative to the newest one, so their millis need as few bits as
+    // possible
+    let Some(newest) = states.iter().map(|outgoing| outgoing.millis).max() else {
+        return Vec::new();
+    };
+
+    let header_len = PACKET_HEADER_LEN + if tick.is_some() { TICK_LEN } else { 0 };
+    let budget = (MAX_PACKET_LEN - header_len) * 8;
+    let mut packets = Vec::new();
+    let mut body = BitWriter::new();
+    let mut contents = Vec::new();
+    let id_bits = if wide { 16 } else { 8 };
+    for outgoing in states {
+        let offset = newest.wrapping_sub(outgoing.millis) as u64;
+        let sequence_bits = if outgoing.sequence.is_some() { 8 } else { 0 };
+        let header_bits = id_bits as usize + sequence_bits + BitWriter::varbits_len(offset);
+        if body.bits() + header_bits + outgoing.encoded.bits > budget {
+            let full = std::mem::replace(&mut body, BitWriter::new());
+            let contents = std::mem::take(&mut contents);
+            packets.push(finish_packet(full, contents, ack, tick, newest, next_sequence));
+        }
+        body.write(outgoing.sender as u64, id_bits);
+        if let Some(sequence) = outgoing.sequence {
+            body.write(sequence as u64, 8);
+        }
+        body.write_varbits(offset);
+        body.write_words(&outgoing.encoded.words, outgoing.encoded.bits);
+        contents.push((outgoing.sender, outgoing.millis));
+    }
+    packets.push(finish_packet(body, contents, ack, tick, newest, next_sequence));
+    packets
+}
+
+fn finish_packet(
+    body: BitWriter,
+    states: Vec<(u16, u32)>,
+    ack: Option<u32>,
+    tick: Option<u32>,
+    newest: u32,
+    next_sequence: &mut u16,
+) -> Packet {
+    let sequence = *next_sequence;
+    *next_sequence = next_sequence.wrapping_add(1);
+
+    let mut bytes = Vec::with_capacity(PACKET_HEADER_LEN + TICK_LEN + body.bits().div_ceil(8));
+    bytes.extend_from_slice(&sequence.to_be_bytes());
+    let mut flags = if ack.is_some() { PACKET_HAS_ACK } else { 0 };
+    if tick.is_some() {
+        flags |= PACKET_IS_SNAPSHOT;
+    }
+    bytes.push(flags);
+    bytes.extend_from_slice(&ack.unwrap_or(0).to_be_bytes());
+    bytes.push(states.len() as u8);
+    bytes.extend_from_slice(&newest.to_be_bytes());
+    if let Some(tick) = tick {
+        bytes.extend_from_slice(&tick.to_be_bytes());
+    }
+    bytes.extend_from_slice(&body.into_bytes());
+    Packet { sequence, bytes, states }
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+
+    fn state_bytes(zone: u32, location: [f32; 3]) -> [u8; STATE_LEN] {
+        let mut bytes = [0; STATE_LEN];
+        bytes[1..5].copy_from_slice(&1000u32.to_be_bytes());
+        bytes[5..9].copy_from_slice(&zone.to_be_bytes());
+        for (i, l) in location.iter().enumerate() {
+            let start = 9 + i * 4;
+            bytes[start..start + 4].copy_from_slice(&l.to_be_bytes());
+        }
+        bytes[21..24].copy_from_slice(&[1, 2, 3]);
+        bytes
+    }
+
+    /// Encodes a keyframe of state and decodes it again, returning it and how many bits it took.
+    fn round_trip(state: &Quantized, short_keyframes: bool) -> (Quantized, usize) {
+        let mut writer = BitWriter::new();
+        encode(&mut writer, state, None, short_keyframes);
+        let bits = writer.bits();
+        let bytes = writer.into_bytes();
+        let mut reader = BitReader::new(&bytes);
+        let decoded = decode(&mut reader, state.millis, |_| None, short_keyframes).unwrap();
+        (decoded, bits)
+    }
+
+    /// An update with a keyframe at millis 1000 followed by a redundant state for each of earlier,
+    /// written as how many millis older it is than the one before it and how far it moved in x.
+    fn redundant_update(earlier: &[(u64, i64)]) -> Vec<u8> {
+        let mut buf = vec![HAS_STATE | HAS_REDUNDANT, 0, 0];
+        buf.extend_from_slice(&1000u32.to_be_bytes());
+        let state = Quantized { millis: 1000, zone: 7, location: [800, 0, 0], rotation: [1, 2, 3] };
+        let mut writer = BitWriter::new();
+        encode(&mut writer, &state, None, false);
+        writer.write(earlier.len() as u64, REDUNDANT_COUNT_BITS);
+        for (gap, x) in earlier {
+            writer.write_varbits(*gap);
+            writer.write_bool(false);
+            for delta in [*x, 0, 0] {
+                writer.write_signed(delta);
+            }
+            writer.write(0, 3);
+        }
+        buf.extend_from_slice(&writer.into_bytes());
+        buf
+    }
+
+    /// Decodes an update from redundant_update and returns the millis and x of its redundant states.
+    fn decode_redundant(buf: &[u8]) -> Vec<(u32, i32)> {
+        let header = parse_update_header(0, buf).unwrap();
+        let (state, redundant) = decode_update(buf, &header, |_| None, false).unwrap();
+        assert_eq!((state.millis, state.location[0]), (1000, 800));
+        redundant.iter().map(|s| (s.millis, s.location[0])).collect()
+    }
+
+    #[test]
+    fn redundant_states_are_rebuilt_newest_first() {
+        let buf = redundant_update(&[(33, -8), (34, -16)]);
+        assert_eq!(decode_redundant(&buf), [(967, 792), (933, 776)]);
+    }
+
+    #[test]
+    fn redundant_tail_stops_at_a_repeat() {
+        // a zero gap would be the state before it again, and nothing after it can be trusted
+        let buf = redundant_update(&[(33, -8), (0, 0), (33, -8)]);
+        assert_eq!(decode_redundant(&buf), [(967, 792)]);
+    }
+
+    #[test]
+    fn cut_off_redundant_states_are_left_out() {
+        let buf = redundant_update(&[(33, -8), (33, -8), (33, -8), (33, -8)]);
+        let full = decode_redundant(&buf);
+        assert_eq!(full.len(), 4);
+        let mut seen = Vec::new();
+        // cut it back to the last byte of the keyframe, which is 1 + 32 + 3 * 32 + 3 * 8 bits
+        for len in (POLL_LEN + 4 + 20..buf.len()).rev() {
+            let redundant = decode_redundant(&buf[..len]);
+            assert_eq!(redundant, full[..redundant.len()], "cut to {len} bytes");
+            seen.push(redundant.len());
+        }
+        assert!(seen.contains(&0) && seen.contains(&3), "{seen:?}");
+    }
+
+    #[test]
+    fn keyframe_error_is_within_half_a_step() {
+        let bound = 0.5 / LOCATION_SCALE;
+        // spread over and a little past the short box, which is 2^17 units across
+        let mut seed = 1u32;
+        for _ in 0..100_000 {
+            let mut location = [0.0; 3];
+            for l in &mut location {
+                seed = seed.wrapping_mul(1_664_525).wrapping_add(1_013_904_223);
+                *l = (seed as f32 / u32::MAX as f32 - 0.5) * 140_000.0;
+            }
+            let state = Quantized::from_state_bytes(&state_bytes(7, location));
+            let (decoded, _) = round_trip(&state, true);
+            let bytes = decoded.to_state_bytes(0);
+            for (i, l) in location.iter().enumerate() {
+                let start = 9 + i * 4;
+                let got = f32::from_be_bytes(bytes[start..start + 4].try_into().unwrap());
+                assert!((got - l).abs() <= bound, "{l} came back as {got}");
+            }
+        }
+    }
+
+    #[test]
+    fn keyframe_bits() {
+        let bits = SHORT_LOCATION_BITS as usize;
+        let inside = Quantized::from_state_bytes(&state_bytes(7, [0.0, -100.5, 4000.25]));
+        assert_eq!(round_trip(&inside, true).1, 1 + 32 + 1 + 3 * bits + 3 * 8);
+        assert_eq!(round_trip(&inside, false).1, 1 + 32 + 3 * 32 + 3 * 8);
+        let outside = Quantized::from_state_bytes(&state_bytes(7, [0.0, 1e6, 0.0]));
+        assert_eq!(round_trip(&outside, true).1, 1 + 32 + 1 + 3 * 32 + 3 * 8);
+    }
+
+    #[test]
+    fn short_offsets_cover_exactly_the_box() {
+        let min = SHORT_LOCATION_MIN as i32;
+        let max = min + (1 << SHORT_LOCATION_BITS) - 1;
+        assert_eq!(short_offsets(&[min; 3]), Some([0; 3]));
+        assert_eq!(short_offsets(&[max; 3]), Some([(1 << SHORT_LOCATION_BITS) - 1; 3]));
+        assert_eq!(short_offsets(&[min - 1, min, min]), None);
+        assert_eq!(short_offsets(&[max, max, max + 1]), None);
+        assert_eq!(short_offsets(&[i32::MIN, 0, i32::MAX]), None);
+    }
+
+    #[test]
+    fn keyframe_outside_short_box_is_sent_in_full() {
+        let min = SHORT_LOCATION_MIN as i32;
+        for location in
+            [[min - 1, 0, 0], [0, min + (1 << SHORT_LOCATION_BITS), 0], [i32::MIN, i32::MAX, -1]]
+        {
+            let state = Quantized { millis: 1000, zone: 7, location, rotation: [1, 2, 3] };
+            assert!(short_offsets(&location).is_none());
+            let (decoded, _) = round_trip(&state, true);
+            assert_eq!(decoded.location, location);
+            assert_eq!(decoded.rotation, state.rotation);
+            assert_eq!(decoded.zone, state.zone);
+        }
+    }
+}
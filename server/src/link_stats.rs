@@ -0,0 +1,221 @@
+use std::fmt;
+
+/// The feature clients ask for in Connect, along with delta, to number their delta packets and
+/// have the states sent to them numbered.
+pub const FEATURE: &str = "sequence";
+
+/// How many of the newest sequences the tracker remembers, so a packet can be up to WINDOW - 1
+/// sequences late before it's taken as lost.
+const WINDOW: u64 = 64;
+
+/// Tells loss, reordering and duplicates apart from the sequence numbers of one sender's packets,
+/// which are `bits` bits wide and wrap around. Matches LinkStats.hpp in the client.
+pub struct Tracker {
+    mask: u64,
+    started: bool,
+    newest: u64,
+    // bit i is set if the sequence i before the newest has arrived
+    arrived: u64,
+    // how many sequences the window covers since the first packet, up to WINDOW
+    span: u64,
+    transit: Option<f64>,
+    received: u64,
+    // a missing packet is only counted once it's too far behind the newest one to still be on its
+    // way, and uncounted if it turns up after all
+    lost: u64,
+    duplicates: u64,
+    reordered: u64,
+    max_reorder_depth: u64,
+    // the smoothed difference in transit time between consecutive packets, in millis, as in RFC
+    // 3550
+    jitter: f64,
+}
+
+impl Tracker {
+    pub fn new(bits: u32) -> Self {
+        assert!((8..=32).contains(&bits) && WINDOW < 1 << (bits - 1));
+        Self {
+            mask: (1 << bits) - 1,
+            started: false,
+            newest: 0,
+            arrived: 0,
+            span: 0,
+            transit: None,
+            received: 0,
+            lost: 0,
+            duplicates: 0,
+            reordered: 0,
+            max_reorder_depth: 0,
+            jitter: 0.0,
+        }
+    }
+
+    /// Records a packet that arrived in order of arrival. sent and arrived are in millis, and sent
+    /// is None for packets that don't say when they were sent.
+    pub fn add(&mut self, sequence: u64, sent: Option<f64>, arrived: f64) {
+        let sequence = sequence & self.mask;
+        if !self.started {
+            self.started = true;
+            self.newest = sequence;
+            // nothing from before the first packet is expected
+            self.arrived = u64::MAX;
+            self.span = 1;
+            self.received += 1;
+            self.sample(sent, arrived);
+            return;
+        }
+
+        let ahead = sequence.wrapping_sub(self.newest) & self.mask;
+        if ahead != 0 && ahead <= self.mask / 2 {
+            // whatever this pushes out of the window without having arrived is lost
+            if ahead >= WINDOW {
+                self.lost += WINDOW - self.arrived.count_ones() as u64 + (ahead - WINDOW);
+                self.arrived = 1;
+            } else {
+                self.lost += ahead - (self.arrived >> (WINDOW - ahead)).count_ones() as u64;
+                self.arrived = (self.arrived << ahead) | 1;
+            }
+            self.newest = sequence;
+            self.span = (self.span + ahead).min(WINDOW);
+            self.received += 1;
+            self.sample(sent, arrived);
+            return;
+        }
+
+        let behind = self.newest.wrapping_sub(sequence) & self.mask;
+        if behind < WINDOW {
+            if (self.arrived >> behind) & 1 != 0 {
+                self.duplicates += 1;
+                return;
+            }
+            self.arrived |= 1 << behind;
+        } else {
+            // it was already counted as lost
+            self.lost = self.lost.saturating_sub(1);
+        }
+        self.received += 1;
+        self.reordered += 1;
+        self.max_reorder_depth = self.max_reorder_depth.max(behind);
+        self.sample(sent, arrived);
+    }
+
+    fn sample(&mut self, sent: Option<f64>, arrived: f64) {
+        let Some(sent) = sent else {
+            return;
+        };
+        let transit = arrived - sent;
+        if let Some(last) = self.transit {
+            self.jitter += ((transit - last).abs() - self.jitter) / 16.0;
+        }
+        self.transit = Some(transit);
+    }
+
+    pub fn received(&self) -> u64 {
+        self.received
+    }
+}
+
+impl fmt::Display for Tracker {
+    fn fmt(&self, f: &mut fmt::Formatter) -> fmt::Result {
+        let percent = |part: u64, whole: u64| part as f64 * 100.0 / whole.max(1) as f64;
+        let recent_missing =
+            if self.started { WINDOW - self.arrived.count_ones() as u64 } else { 0 };
+        write!(
+            f,
+            "received {} packets, lost {} ({:.1}%, {:.1}% recently), ",
+            self.received,
+            self.lost,
+            percent(self.lost, self.received + self.lost),
+            percent(recent_missing, self.span),
+        )?;
+        write!(
+            f,
+            "{} reordered by up to {}, {} duplicates, {:.1} ms jitter",
+            self.reordered, self.max_reorder_depth, self.duplicates, self.jitter,
+        )
+    }
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+
+    /// Adds each sequence in order of arrival, 10 ms apart and each taking 20 ms to arrive.
+    fn tracker(bits: u32, sequences: impl IntoIterator<Item = u64>) -> Tracker {
+        let mut tracker = Tracker::new(bits);
+        for (i, sequence) in sequences.into_iter().enumerate() {
+            let sent = i as f64 * 10.0;
+            tracker.add(sequence, Some(sent), sent + 20.0);
+        }
+        tracker
+    }
+
+    #[test]
+    fn in_order() {
+        let tracker = tracker(16, 0..200);
+        let counts = (tracker.received, tracker.lost, tracker.reordered, tracker.duplicates);
+        assert_eq!(counts, (200, 0, 0, 0));
+        assert_eq!(tracker.jitter, 0.0);
+    }
+
+    #[test]
+    fn missing_packets_are_lost_once_out_of_the_window() {
+        let sequences = || (0..200).filter(|s| s % 10 != 5);
+        let short = tracker(16, sequences().take_while(|s| *s < WINDOW));
+        assert_eq!(short.lost, 0);
+        let tracker = tracker(16, sequences());
+        assert_eq!(tracker.received, 180);
+        // the last WINDOW sequences are still in time to arrive
+        assert_eq!(tracker.lost, (200 - WINDOW + 4) / 10);
+        assert_eq!(tracker.reordered, 0);
+    }
+
+    #[test]
+    fn late_packets_are_reordered_not_lost() {
+        let mut sequences: Vec<u64> = (0..200).collect();
+        // 11, 12 and 10 all arrive after 13
+        sequences.swap(10, 13);
+        sequences.swap(100, 101);
+        let tracker = tracker(16, sequences);
+        assert_eq!((tracker.received, tracker.lost), (200, 0));
+        assert_eq!((tracker.reordered, tracker.max_reorder_depth), (4, 3));
+    }
+
+    #[test]
+    fn packets_later_than_the_window_are_uncounted_from_lost() {
+        let mut sequences: Vec<u64> = (0..200).filter(|s| *s != 10).collect();
+        sequences.insert(150, 10);
+        let tracker = tracker(16, sequences);
+        assert_eq!((tracker.received, tracker.lost, tracker.reordered), (200, 0, 1));
+        assert_eq!(tracker.max_reorder_depth, 140);
+    }
+
+    #[test]
+    fn duplicates() {
+        let tracker = tracker(16, [0, 1, 1, 2, 0, 3, 3]);
+        assert_eq!((tracker.received, tracker.duplicates, tracker.reordered), (4, 3, 0));
+    }
+
+    #[test]
+    fn sequences_wrap() {
+        // three times around 8 bit sequences, losing one each time
+        let tracker = tracker(8, (0..3 * 256).filter(|s| s % 256 != 7));
+        let counts = (tracker.received, tracker.lost, tracker.reordered, tracker.duplicates);
+        assert_eq!(counts, (765, 3, 0, 0));
+    }
+
+    #[test]
+    fn jitter_follows_changes_in_transit() {
+        let mut tracker = Tracker::new(16);
+        for i in 0..100 {
+            let sent = i as f64 * 10.0;
+            tracker.add(i, Some(sent), sent + if i % 2 == 0 { 20.0 } else { 30.0 });
+        }
+        // it converges on the 10 ms difference between consecutive transit times
+        assert!((tracker.jitter - 10.0).abs() < 0.1, "{}", tracker.jitter);
+        // packets that don't say when they were sent leave it alone
+        let jitter = tracker.jitter;
+        tracker.add(100, None, 5000.0);
+        assert_eq!(tracker.jitter, jitter);
+    }
+}
@@ -6,20 +6,27 @@ use std::{
 };
 use tokio::net::{TcpListener, UdpSocket};
 
+mod bits;
+mod delta;
+mod link_stats;
 mod message;
+mod reliable;
 mod serve;
+mod snapshots;
 mod state;
+mod tiers;
 
 #[tokio::main]
 async fn main() {
     let addr = env::args().nth(1).unwrap_or("127.0.0.1:23432".to_owned());
     let tcp_listener = TcpListener::bind(&addr).await.expect("Failed to bind TCP listener");
-    let udp_socket = UdpSocket::bind(&addr).await.expect("Failed to bind UDP socket");
+    let udp_socket = Arc::new(UdpSocket::bind(&addr).await.expect("Failed to bind UDP socket"));
     println!("Server started, listening on {addr}");
 
     let state = Arc::new(Mutex::new(State::new()));
     let tcp_task = tokio::spawn(serve::tcp(state.clone(), tcp_listener));
-    let udp_task = tokio::spawn(serve::udp(state.clone(), udp_socket));
+    let udp_task = tokio::spawn(serve::udp(state.clone(), udp_socket.clone()));
+    let tick_task = tokio::spawn(serve::tick(state.clone(), udp_socket));
 
     // stdin gets its own thread because it requires blocking calls in order to read inputs
     thread::spawn(move || serve::stdin(state));
@@ -37,6 +44,12 @@ async fn main() {
                 Err(err) => format!("UDP task crashed: {err}"),
             }
         }
+        join_result = tick_task => {
+            match join_result {
+                Ok(reason) => format!("tick task ended: {reason}"),
+                Err(err) => format!("tick task crashed: {err}"),
+            }
+        }
     };
     println!("terminating server: {reason}");
     process::exit(1);
@@ -2,7 +2,7 @@ use serde::{Deserialize, Serialize};
 
 #[derive(Serialize)]
 pub struct PlayerInfo {
-    pub id: u8,
+    pub id: u16,
     pub color: [u8; 3],
     pub name: String,
 }
@@ -10,19 +10,237 @@ pub struct PlayerInfo {
 #[derive(Serialize)]
 #[serde(tag = "type")]
 pub enum ServerMessage {
-    Connected { id: u8, players: Vec<PlayerInfo> },
-    PlayerJoined { id: u8, color: [u8; 3], name: String },
-    PlayerLeft { id: u8 },
+    Connected { id: u16, players: Vec<PlayerInfo>, features: Vec<String> },
+    PlayerJoined { id: u16, color: [u8; 3], name: String },
+    PlayerLeft { id: u16 },
 }
 
 #[derive(Deserialize)]
 pub struct ConnectInfo {
     pub color: [u8; 3],
     pub name: String,
+    // optional protocol features the client supports; older clients don't send any
+    #[serde(default)]
+    pub features: Vec<String>,
 }
 
 #[derive(Deserialize)]
 #[serde(tag = "type")]
 pub enum ClientMessage {
     Connect(ConnectInfo),
+    // the hash of the zone the client is now in, so it's only sent states from that zone
+    Subscribe { zone: u32 },
+}
+
+/// With this feature, the server's messages and the client's messages after Connect use a binary
+/// encoding instead of JSON: the message's type and then its fields in order, big-endian. Strings
+/// are a 16 bit length and then their bytes, and lists are a 16 bit count and then their items.
+/// Connect is always JSON, since the client doesn't know yet whether the server supports anything
+/// else, and JSON messages always start with '{', which is never a type. Matches
+/// ControlMessage.hpp in the client.
+pub const BINARY_FEATURE: &str = "binary";
+
+const CONNECTED: u8 = 0;
+const PLAYER_JOINED: u8 = 1;
+const PLAYER_LEFT: u8 = 2;
+const SUBSCRIBE: u8 = 1;
+
+impl ServerMessage {
+    pub fn to_binary(&self) -> Vec<u8> {
+        let mut buf = Vec::new();
+        match self {
+            ServerMessage::Connected { id, players, features } => {
+                // a player usually takes 7 bytes plus a short name
+                buf.reserve(7 + players.len() * 16);
+                buf.push(CONNECTED);
+                buf.extend_from_slice(&id.to_be_bytes());
+                write_len(&mut buf, features.len());
+                for feature in features {
+                    write_str(&mut buf, feature);
+                }
+                write_len(&mut buf, players.len());
+                for player in players {
+                    write_player(&mut buf, player.id, player.color, &player.name);
+                }
+            }
+            ServerMessage::PlayerJoined { id, color, name } => {
+                buf.push(PLAYER_JOINED);
+                write_player(&mut buf, *id, *color, name);
+            }
+            ServerMessage::PlayerLeft { id } => {
+                buf.push(PLAYER_LEFT);
+                buf.extend_from_slice(&id.to_be_bytes());
+            }
+        }
+        buf
+    }
+}
+
+impl ClientMessage {
+    /// Decodes a message in either encoding.
+    pub fn decode(buf: &[u8]) -> Result<Self, String> {
+        if buf.first() == Some(&b'{') {
+            return serde_json::from_slice(buf)
+                .map_err(|e| format!("failed to deserialize message: {e}"));
+        }
+        match *buf {
+            [SUBSCRIBE, a, b, c, d] => {
+                Ok(ClientMessage::Subscribe { zone: u32::from_be_bytes([a, b, c, d]) })
+            }
+            _ => Err(format!("failed to decode binary message of {} bytes", buf.len())),
+        }
+    }
+}
+
+fn write_len(buf: &mut Vec<u8>, len: usize) {
+    buf.extend_from_slice(&(len as u16).to_be_bytes());
+}
+
+fn write_str(buf: &mut Vec<u8>, s: &str) {
+    // nothing sent is anywhere near this long, but a name could be made to be
+    let bytes = &s.as_bytes()[..s.len().min(u16::MAX as usize)];
+    write_len(buf, bytes.len());
+    buf.extend_from_slice(bytes);
+}
+
+fn write_player(buf: &mut Vec<u8>, id: u16, color: [u8; 3], name: &str) {
+    buf.extend_from_slice(&id.to_be_bytes());
+    buf.extend_from_slice(&color);
+    write_str(buf, name);
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+    use serde_json::{Value, json};
+    use std::time::Instant;
+
+    fn take<'a>(buf: &mut &'a [u8], len: usize) -> &'a [u8] {
+        let (taken, rest) = buf.split_at(len);
+        *buf = rest;
+        taken
+    }
+
+    fn read_u16(buf: &mut &[u8]) -> u16 {
+        u16::from_be_bytes(take(buf, 2).try_into().unwrap())
+    }
+
+    fn read_str(buf: &mut &[u8]) -> String {
+        let len = read_u16(buf) as usize;
+        String::from_utf8(take(buf, len).to_vec()).unwrap()
+    }
+
+    fn read_player(buf: &mut &[u8]) -> Value {
+        let id = read_u16(buf);
+        let color = take(buf, 3).to_vec();
+        json!({ "id": id, "color": color, "name": read_str(buf) })
+    }
+
+    /// Reads a binary message back into the JSON serde writes for the same message, the way
+    /// ControlMessage.hpp in the client reads it.
+    fn binary_to_json(mut buf: &[u8]) -> Value {
+        let buf = &mut buf;
+        let message = match take(buf, 1)[0] {
+            CONNECTED => {
+                let id = read_u16(buf);
+                let features: Vec<String> = (0..read_u16(buf)).map(|_| read_str(buf)).collect();
+                let players: Vec<Value> = (0..read_u16(buf)).map(|_| read_player(buf)).collect();
+                json!({ "type": "Connected", "id": id, "players": players, "features": features })
+            }
+            PLAYER_JOINED => {
+                let mut player = read_player(buf);
+                player["type"] = "PlayerJoined".into();
+                player
+            }
+            PLAYER_LEFT => json!({ "type": "PlayerLeft", "id": read_u16(buf) }),
+            other => panic!("unknown message type {other}"),
+        };
+        assert!(buf.is_empty(), "{} bytes left over", buf.len());
+        message
+    }
+
+    #[test]
+    fn server_messages_say_the_same_in_both_encodings() {
+        let players = (0..3)
+            .map(|id| PlayerInfo {
+                id: id * 300,
+                color: [id as u8, 127, 255],
+                name: format!("P{id}"),
+            })
+            .collect();
+        let features = vec![BINARY_FEATURE.to_string(), "delta".to_string()];
+        let messages = [
+            ServerMessage::Connected { id: 7, players, features },
+            ServerMessage::Connected { id: 1000, players: Vec::new(), features: Vec::new() },
+            ServerMessage::PlayerJoined {
+                id: 513, color: [1, 2, 3], name: "Sybil ✿".to_string()
+            },
+            ServerMessage::PlayerLeft { id: 65535 },
+        ];
+        for message in &messages {
+            assert_eq!(
+                binary_to_json(&message.to_binary()),
+                serde_json::to_value(message).unwrap()
+            );
+        }
+        assert_eq!(
+            serde_json::to_value(&messages[3]).unwrap(),
+            json!({ "type": "PlayerLeft", "id": 65535 })
+        );
+        assert_eq!(messages[3].to_binary(), [PLAYER_LEFT, 255, 255]);
+    }
+
+    #[test]
+    fn client_messages_decode_from_both_encodings() {
+        let zone = 0x1234_5678;
+        let binary = [SUBSCRIBE, 0x12, 0x34, 0x56, 0x78];
+        let json = br#"{"type":"Subscribe","zone":305419896}"#;
+        for buf in [&binary[..], &json[..]] {
+            let Ok(ClientMessage::Subscribe { zone: decoded }) = ClientMessage::decode(buf) else {
+                panic!("Subscribe didn't decode");
+            };
+            assert_eq!(decoded, zone);
+        }
+
+        // Connect is only ever JSON, and features are optional for older clients
+        let connect = br#"{"type":"Connect","color":[1,2,3],"name":"a"}"#;
+        let Ok(ClientMessage::Connect(info)) = ClientMessage::decode(connect) else {
+            panic!("Connect didn't decode");
+        };
+        assert!(info.color == [1, 2, 3] && info.name == "a" && info.features.is_empty());
+
+        let too_long = [binary.as_slice(), &[0]].concat();
+        for bad in [&binary[..4], &too_long, &[0, 0, 0, 0, 0], b"{", b""] {
+            assert!(ClientMessage::decode(bad).is_err());
+        }
+    }
+
+    /// Times encoding a Connected that lists 200 players both ways and prints their sizes. Run with
+    /// --release --ignored --nocapture.
+    #[test]
+    #[ignore]
+    fn connected_roster() {
+        let players = (0..200)
+            .map(|id| PlayerInfo { id, color: [id as u8, 127, 255], name: format!("Player {id}") })
+            .collect();
+        let features =
+            ["delta", "short_keyframes", "redundancy", "binary"].map(str::to_owned).to_vec();
+        let connected = ServerMessage::Connected { id: 7, players, features };
+
+        let runs = 10000;
+        let started = Instant::now();
+        let mut json = String::new();
+        for _ in 0..runs {
+            json = serde_json::to_string(&connected).unwrap();
+        }
+        let json_micros = started.elapsed().as_secs_f64() * 1e6 / runs as f64;
+        let started = Instant::now();
+        let mut binary = Vec::new();
+        for _ in 0..runs {
+            binary = connected.to_binary();
+        }
+        let binary_micros = started.elapsed().as_secs_f64() * 1e6 / runs as f64;
+        println!("JSON: {json_micros:.1} us, {} bytes", json.len());
+        println!("binary: {binary_micros:.1} us, {} bytes", binary.len());
+    }
 }
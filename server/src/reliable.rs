@@ -0,0 +1,199 @@
+use std::{
+    collections::{HashMap, VecDeque},
+    time::{Duration, Instant},
+};
+
+/// Clients that don't use a WebSocket send their messages over UDP instead, in control packets
+/// that start with two of this byte. No other packet in either direction does: a narrow id is
+/// never 255, a wide id's high byte never is, and the byte after a delta packet's sequence never
+/// has IS_CONTROL set. Matches ReliableChannel.hpp in the client.
+pub const MARKER: u8 = 255;
+
+/// A control packet is the marker, flags and an ack, which is how many fragments have arrived in
+/// order so far. If it has a fragment, the fragment's sequence and bytes follow. Messages are
+/// split into as many fragments as they need, each but the last with MORE set.
+const HEADER_LEN: usize = 5;
+const FRAGMENT_HEADER_LEN: usize = 7;
+const IS_CONTROL: u8 = 128;
+const HAS_FRAGMENT: u8 = 1;
+const MORE: u8 = 2;
+/// Set if the sender is done with the channel and won't answer anything on it again.
+const CLOSE: u8 = 4;
+
+/// Packets to clients have to fit in their receive buffer, which is sized for delta packets.
+const MAX_PACKET_LEN: usize = 504;
+const MAX_FRAGMENT_LEN: usize = MAX_PACKET_LEN - FRAGMENT_HEADER_LEN;
+
+/// How many fragments can be sent without being acked, and how far ahead of the next one in order
+/// a fragment can arrive and still be kept.
+const WINDOW: u16 = 32;
+/// Unacked fragments are sent again this long after they were last sent.
+const RESEND: Duration = Duration::from_millis(250);
+/// An ack goes out at least this often, so the other end knows this one is still there.
+const KEEPALIVE: Duration = Duration::from_secs(1);
+/// The other end is given up on after hearing nothing from it for this long.
+const TIMEOUT: Duration = Duration::from_secs(5);
+
+/// Returns whether buf is a control packet.
+pub fn is_control(buf: &[u8]) -> bool {
+    buf.len() >= HEADER_LEN && buf[0] == MARKER && buf[1] == MARKER && buf[2] & IS_CONTROL != 0
+}
+
+/// Returns whether buf is the first fragment a client sends, which is the only packet that can
+/// start a new session. Anything else from an unknown address is left over from an old one.
+pub fn opens_channel(buf: &[u8]) -> bool {
+    is_control(buf)
+        && buf[2] & (HAS_FRAGMENT | CLOSE) == HAS_FRAGMENT
+        && buf.len() >= FRAGMENT_HEADER_LEN
+        && buf[5..7] == [0, 0]
+}
+
+struct Fragment {
+    sequence: u16,
+    more: bool,
+    bytes: Vec<u8>,
+    sent: bool,
+}
+
+/// One end of an ordered, reliable stream of messages over UDP. Fragments are numbered and sent
+/// again until the other end acks them, and ones that arrive out of order are held until the
+/// ones before them turn up.
+pub struct Channel {
+    next_sequence: u16,
+    // fragments the other end hasn't acked yet, oldest first; only the first WINDOW are sent
+    unacked: VecDeque<Fragment>,
+    resend_at: Instant,
+    // how many fragments have arrived in order, which wraps, and the ones that arrived early
+    received: u16,
+    early: HashMap<u16, (bool, Vec<u8>)>,
+    // the fragments of a message whose last fragment hasn't arrived yet
+    partial: Vec<u8>,
+    ack_due: bool,
+    last_sent: Instant,
+    last_heard: Instant,
+}
+
+impl Channel {
+    pub fn new(now: Instant) -> Self {
+        Self {
+            next_sequence: 0,
+            unacked: VecDeque::new(),
+            resend_at: now,
+            received: 0,
+            early: HashMap::new(),
+            partial: Vec::new(),
+            ack_due: false,
+            last_sent: now,
+            last_heard: now,
+        }
+    }
+
+    /// Queues a message to be sent by the next poll.
+    pub fn send(&mut self, message: &[u8]) {
+        let chunks: Vec<&[u8]> = message.chunks(MAX_FRAGMENT_LEN).collect();
+        let last = chunks.len().saturating_sub(1);
+        for (i, chunk) in chunks.into_iter().enumerate() {
+            self.push(i != last, chunk.to_vec());
+        }
+        if message.is_empty() {
+            self.push(false, Vec::new());
+        }
+    }
+
+    fn push(&mut self, more: bool, bytes: Vec<u8>) {
+        let sequence = self.next_sequence;
+        self.next_sequence = sequence.wrapping_add(1);
+        self.unacked.push_back(Fragment { sequence, more, bytes, sent: false });
+    }
+
+    /// Handles a control packet from the other end and returns the messages it completed, in
+    /// order. Returns None if the other end closed the channel.
+    pub fn receive(&mut self, buf: &[u8], now: Instant) -> Option<Vec<Vec<u8>>> {
+        let mut messages = Vec::new();
+        if !is_control(buf) {
+            return Some(messages);
+        }
+        self.last_heard = now;
+        let flags = buf[2];
+        if flags & CLOSE != 0 {
+            return None;
+        }
+
+        let ack = u16::from_be_bytes([buf[3], buf[4]]);
+        while let Some(fragment) = self.unacked.front() {
+            // acked if it's before ack, going by whichever way round is closer
+            let behind = ack.wrapping_sub(fragment.sequence);
+            if behind == 0 || behind > u16::MAX / 2 {
+                break;
+            }
+            self.unacked.pop_front();
+        }
+
+        if flags & HAS_FRAGMENT == 0 || buf.len() < FRAGMENT_HEADER_LEN {
+            return Some(messages);
+        }
+        // anything with a fragment gets acked, even a duplicate, since the ack for it may be lost
+        self.ack_due = true;
+        let sequence = u16::from_be_bytes([buf[5], buf[6]]);
+        let ahead = sequence.wrapping_sub(self.received);
+        if ahead >= WINDOW {
+            return Some(messages);
+        }
+        self.early.insert(sequence, (flags & MORE != 0, buf[FRAGMENT_HEADER_LEN..].to_vec()));
+        while let Some((more, bytes)) = self.early.remove(&self.received) {
+            self.received = self.received.wrapping_add(1);
+            self.partial.extend_from_slice(&bytes);
+            if !more {
+                messages.push(std::mem::take(&mut self.partial));
+            }
+        }
+        Some(messages)
+    }
+
+    /// Returns the packets that are due: fragments that haven't been sent yet, all unacked ones
+    /// if it's time to resend them, and otherwise an ack if one is due.
+    pub fn poll(&mut self, now: Instant) -> Vec<Vec<u8>> {
+        let resend = now >= self.resend_at;
+        let mut packets = Vec::new();
+        for fragment in self.unacked.iter_mut().take(WINDOW as usize) {
+            if fragment.sent && !resend {
+                continue;
+            }
+            fragment.sent = true;
+            let mut flags = IS_CONTROL | HAS_FRAGMENT;
+            if fragment.more {
+                flags |= MORE;
+            }
+            let mut packet = header(flags, self.received);
+            packet.extend_from_slice(&fragment.sequence.to_be_bytes());
+            packet.extend_from_slice(&fragment.bytes);
+            packets.push(packet);
+        }
+        if !packets.is_empty() {
+            self.resend_at = now + RESEND;
+        } else if self.ack_due || now - self.last_sent >= KEEPALIVE {
+            packets.push(header(IS_CONTROL, self.received));
+        }
+        if !packets.is_empty() {
+            self.ack_due = false;
+            self.last_sent = now;
+        }
+        packets
+    }
+
+    /// Returns a packet that tells the other end this one is done with the channel.
+    pub fn close(&self) -> Vec<u8> {
+        header(IS_CONTROL | CLOSE, self.received)
+    }
+
+    pub fn timed_out(&self, now: Instant) -> bool {
+        now - self.last_heard >= TIMEOUT
+    }
+}
+
+fn header(flags: u8, ack: u16) -> Vec<u8> {
+    let mut packet = Vec::with_capacity(MAX_PACKET_LEN);
+    packet.extend_from_slice(&[MARKER, MARKER, flags]);
+    packet.extend_from_slice(&ack.to_be_bytes());
+    packet
+}
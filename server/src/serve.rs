@@ -1,10 +1,18 @@
-use crate::state::{PlayerState, STATE_LEN, State};
+use crate::{
+    reliable, snapshots,
+    state::{PlayerState, STATE_LEN, State},
+};
 use std::{
     io, process,
     sync::{Arc, Mutex},
+    time::Duration,
+};
+use tokio::{
+    net::{TcpListener, UdpSocket},
+    time::{self, MissedTickBehavior},
 };
-use tokio::net::{TcpListener, UdpSocket};
 
+mod session;
 mod stdin;
 mod tcp;
 mod udp;
@@ -36,19 +44,69 @@ pub async fn tcp(state: Arc<Mutex<State>>, tcp_listener: TcpListener) -> String
     }
 }
 
-pub async fn udp(state: Arc<Mutex<State>>, udp_socket: UdpSocket) -> String {
-    let mut buf = [0u8; STATE_LEN];
-    let udp_socket = Arc::new(udp_socket);
+pub async fn udp(state: Arc<Mutex<State>>, udp_socket: Arc<UdpSocket>) -> String {
+    let mut buf = [0u8; udp::MAX_CLIENT_PACKET_LEN];
+    let sessions = session::Sessions::default();
     loop {
         match udp_socket.recv_from(&mut buf).await {
             Ok((len, addr)) => {
+                // control packets go first, since they start with the same byte as wide id packets
+                if reliable::is_control(&buf[..len]) {
+                    session::dispatch(&sessions, &state, &udp_socket, addr, &buf[..len]);
+                    continue;
+                }
+                if buf[0] == udp::WIDE_ID_MARKER && len >= udp::WIDE_ID_LEN {
+                    let (id, rest) = udp::parse_wide_id(&buf[..len]);
+                    if len == udp::WIDE_PING_LEN {
+                        let client_millis = u32::from_be_bytes(rest.try_into().unwrap());
+                        tokio::spawn(udp::handle_ping(
+                            state.clone(),
+                            (id, client_millis),
+                            udp_socket.clone(),
+                            addr,
+                        ));
+                        continue;
+                    }
+                    tokio::spawn(udp::handle_delta_packet(
+                        state.clone(),
+                        id,
+                        rest.to_vec(),
+                        udp_socket.clone(),
+                        addr,
+                    ));
+                    continue;
+                }
+                if len == udp::POLL_LEN {
+                    let id = buf[0] as u16;
+                    tokio::spawn(udp::handle_poll(state.clone(), id, udp_socket.clone(), addr));
+                    continue;
+                }
+                if len == udp::PING_LEN {
+                    tokio::spawn(udp::handle_ping(
+                        state.clone(),
+                        udp::parse_ping(&buf),
+                        udp_socket.clone(),
+                        addr,
+                    ));
+                    continue;
+                }
+                if state.lock().unwrap().is_delta(buf[0] as u16) {
+                    tokio::spawn(udp::handle_delta_packet(
+                        state.clone(),
+                        buf[0] as u16,
+                        buf[1..len].to_vec(),
+                        udp_socket.clone(),
+                        addr,
+                    ));
+                    continue;
+                }
                 if len != STATE_LEN {
                     println!("received UDP packet of the incorrect length: {len}");
                     continue;
                 }
                 tokio::spawn(udp::handle_packet(
                     state.clone(),
-                    PlayerState::from_bytes(buf),
+                    PlayerState::from_bytes(buf[..STATE_LEN].try_into().unwrap()),
                     udp_socket.clone(),
                     addr,
                 ));
@@ -58,3 +116,159 @@ pub async fn udp(state: Arc<Mutex<State>>, udp_socket: UdpSocket) -> String {
         }
     }
 }
+
+/// Sends a snapshot to every player that's sent them, once per tick. Ticks are lined up with the
+/// server's clock, and one that's missed is skipped rather than sent late.
+pub async fn tick(state: Arc<Mutex<State>>, udp_socket: Arc<UdpSocket>) -> String {
+    let start = state.lock().unwrap().start();
+    let period = Duration::from_millis(snapshots::TICK_MILLIS as u64);
+    let mut interval = time::interval_at(start.into(), period);
+    interval.set_missed_tick_behavior(MissedTickBehavior::Skip);
+    loop {
+        interval.tick().await;
+        let snapshots = state.lock().unwrap().snapshot();
+        for (addr, packets) in snapshots {
+            tokio::spawn(udp::send_packets(packets, udp_socket.clone(), addr));
+        }
+    }
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+    use std::{
+        io::{Read, Write},
+        net::{SocketAddr, TcpStream, UdpSocket as StdUdpSocket},
+        time::Instant,
+    };
+
+    const CONNECT: &[u8] = br#"{"type":"Connect","color":[255,0,0],"name":"bench"}"#;
+
+    /// Connects over the UDP transport, from sending Connect to reading Connected, and returns
+    /// how long that took and how many sends and receives it needed.
+    fn udp_connect(server: SocketAddr) -> (Duration, u32) {
+        let mut buf = [0u8; 508];
+        let mut calls = 0;
+        let client = StdUdpSocket::bind("127.0.0.1:0").unwrap();
+        client.connect(server).unwrap();
+        client.set_read_timeout(Some(Duration::from_secs(1))).unwrap();
+
+        let started = Instant::now();
+        let mut channel = reliable::Channel::new(started);
+        channel.send(CONNECT);
+        for packet in channel.poll(started) {
+            client.send(&packet).unwrap();
+            calls += 1;
+        }
+        let connected = loop {
+            let len = client.recv(&mut buf).expect("no answer to Connect");
+            calls += 1;
+            let messages = channel.receive(&buf[..len], Instant::now()).unwrap();
+            if let Some(message) = messages.into_iter().next() {
+                break message;
+            }
+        };
+        let elapsed = started.elapsed();
+        assert!(connected.starts_with(br#"{"type":"Connected""#));
+        client.send(&channel.close()).unwrap();
+        (elapsed, calls)
+    }
+
+    /// Returns the payload of the unmasked frame at the start of buf, once all of it is there.
+    fn frame_payload(buf: &[u8]) -> Option<&[u8]> {
+        let (start, len) = match *buf.get(1)? & 127 {
+            126 => (4, u16::from_be_bytes([*buf.get(2)?, *buf.get(3)?]) as usize),
+            127 => panic!("frame too long for a connect"),
+            len => (2, len as usize),
+        };
+        buf.get(start..start + len)
+    }
+
+    /// Connects over the WebSocket path, from the TCP connect through the upgrade to reading
+    /// Connected, and returns the same as udp_connect, counting the TCP connect as one call.
+    fn ws_connect(server: SocketAddr) -> (Duration, u32) {
+        let mut buf = [0u8; 1024];
+        let mut received = Vec::new();
+        let started = Instant::now();
+        let mut stream = TcpStream::connect(server).unwrap();
+        let mut calls = 1;
+        stream.set_nodelay(true).unwrap();
+        stream.set_read_timeout(Some(Duration::from_secs(1))).unwrap();
+        let mut read = |stream: &mut TcpStream, received: &mut Vec<u8>| {
+            let len = stream.read(&mut buf).expect("connection closed");
+            assert!(len > 0, "connection closed");
+            received.extend_from_slice(&buf[..len]);
+        };
+
+        // the key is the sample one from RFC 6455; the server's answer to it isn't checked
+        let upgrade = "GET / HTTP/1.1\r\nHost: localhost\r\nUpgrade: websocket\r\n\
+            Connection: Upgrade\r\nSec-WebSocket-Key: dGhlIHNhbXBsZSBub25jZQ==\r\n\
+            Sec-WebSocket-Version: 13\r\n\r\n";
+        stream.write_all(upgrade.as_bytes()).unwrap();
+        calls += 1;
+        let response_len = loop {
+            if let Some(end) = received.windows(4).position(|window| window == b"\r\n\r\n") {
+                break end + 4;
+            }
+            read(&mut stream, &mut received);
+            calls += 1;
+        };
+        assert!(received.starts_with(b"HTTP/1.1 101"));
+        received.drain(..response_len);
+
+        // a final text frame, masked with a zero key so the payload goes as is
+        let mut frame = vec![0x81, 0x80 | CONNECT.len() as u8, 0, 0, 0, 0];
+        frame.extend_from_slice(CONNECT);
+        stream.write_all(&frame).unwrap();
+        calls += 1;
+        let connected = loop {
+            if let Some(payload) = frame_payload(&received) {
+                break payload;
+            }
+            read(&mut stream, &mut received);
+            calls += 1;
+        };
+        let elapsed = started.elapsed();
+        assert!(connected.starts_with(br#"{"type":"Connected""#));
+        // a close frame, also masked
+        stream.write_all(&[0x88, 0x80, 0, 0, 0, 0]).unwrap();
+        (elapsed, calls)
+    }
+
+    fn print_connects(transport: &str, mut connects: Vec<(Duration, u32)>) {
+        connects.sort();
+        let median = connects[connects.len() / 2].0.as_secs_f64() * 1e6;
+        let p99 = connects[connects.len() * 99 / 100].0.as_secs_f64() * 1e6;
+        let calls = connects.iter().map(|(_, calls)| *calls).sum::<u32>() as f64;
+        let calls = calls / connects.len() as f64;
+        println!(
+            "{transport:>9} connect: median {median:>4.0} us, p99 {p99:>5.0} us, \
+            {calls:.1} sends and recvs"
+        );
+    }
+
+    /// Times connecting over the UDP transport and over the WebSocket path on loopback, and counts
+    /// the client's sends and receives for each. Run with --release --ignored --nocapture.
+    #[tokio::test(flavor = "multi_thread")]
+    #[ignore]
+    async fn udp_vs_websocket_connect() {
+        let state = Arc::new(Mutex::new(State::new()));
+        let udp_socket = Arc::new(UdpSocket::bind("127.0.0.1:0").await.unwrap());
+        let udp_server = udp_socket.local_addr().unwrap();
+        tokio::spawn(udp(state.clone(), udp_socket));
+        let tcp_listener = TcpListener::bind("127.0.0.1:0").await.unwrap();
+        let tcp_server = tcp_listener.local_addr().unwrap();
+        tokio::spawn(tcp(state, tcp_listener));
+
+        let connects = 500;
+        let (udp_connects, ws_connects) = tokio::task::spawn_blocking(move || {
+            let udp_connects = (0..connects).map(|_| udp_connect(udp_server)).collect();
+            let ws_connects = (0..connects).map(|_| ws_connect(tcp_server)).collect();
+            (udp_connects, ws_connects)
+        })
+        .await
+        .unwrap();
+        print_connects("UDP", udp_connects);
+        print_connects("WebSocket", ws_connects);
+    }
+}
@@ -0,0 +1,184 @@
+use crate::{
+    message::{self, ClientMessage, ConnectInfo, ServerMessage},
+    reliable::{self, Channel},
+    state::State,
+};
+use std::{
+    collections::HashMap,
+    net::SocketAddr,
+    sync::{Arc, Mutex},
+    time::{Duration, Instant},
+};
+use tokio::{
+    net::UdpSocket,
+    sync::mpsc::{self, UnboundedReceiver, UnboundedSender},
+    time,
+};
+
+/// The control packets of each client connected over UDP instead of a WebSocket, keyed by where
+/// they come from, go to that client's session task through these.
+pub type Sessions = Arc<Mutex<HashMap<SocketAddr, UnboundedSender<Vec<u8>>>>>;
+
+/// How often a session checks whether anything needs resending or it has timed out.
+const POLL_INTERVAL: Duration = Duration::from_millis(50);
+
+struct Session {
+    channel: Channel,
+    udp_socket: Arc<UdpSocket>,
+    addr: SocketAddr,
+    id: u16,
+    // whether the client agreed to binary messages
+    binary: bool,
+    rx: UnboundedReceiver<ServerMessage>,
+    state: Arc<Mutex<State>>,
+}
+
+impl Drop for Session {
+    fn drop(&mut self) {
+        self.state.lock().unwrap().disconnect(self.id);
+    }
+}
+
+/// Hands a control packet to the session for addr, starting one if it's the first packet a
+/// client sends.
+pub fn dispatch(
+    sessions: &Sessions,
+    state: &Arc<Mutex<State>>,
+    udp_socket: &Arc<UdpSocket>,
+    addr: SocketAddr,
+    packet: &[u8],
+) {
+    let mut sessions_guard = sessions.lock().unwrap();
+    if let Some(tx) = sessions_guard.get(&addr) {
+        // if the session just ended, the packet is for a connection that's gone anyway
+        let _ = tx.send(packet.to_vec());
+        return;
+    }
+    if !reliable::opens_channel(packet) {
+        return;
+    }
+    let (tx, rx) = mpsc::unbounded_channel();
+    let _ = tx.send(packet.to_vec());
+    sessions_guard.insert(addr, tx);
+    tokio::spawn(handle_session(state.clone(), udp_socket.clone(), addr, rx, sessions.clone()));
+}
+
+async fn handle_session(
+    state: Arc<Mutex<State>>,
+    udp_socket: Arc<UdpSocket>,
+    addr: SocketAddr,
+    packets: UnboundedReceiver<Vec<u8>>,
+    sessions: Sessions,
+) {
+    run_session(state, udp_socket, addr, packets).await;
+    sessions.lock().unwrap().remove(&addr);
+}
+
+async fn run_session(
+    state: Arc<Mutex<State>>,
+    udp_socket: Arc<UdpSocket>,
+    addr: SocketAddr,
+    mut packets: UnboundedReceiver<Vec<u8>>,
+) {
+    let mut channel = Channel::new(Instant::now());
+    let info = match receive_connect_message(&mut channel, &mut packets, &udp_socket, addr).await {
+        Ok(info) => info,
+        Err(err) => {
+            println!("connection refused: {addr}: {err}");
+            return;
+        }
+    };
+    let connected = state.lock().unwrap().connect(info);
+    let Some((id, rx, players, features)) = connected else {
+        println!("connection refused: {addr}: server full");
+        send_to(&udp_socket, &channel.close(), addr).await;
+        return;
+    };
+    let binary = features.iter().any(|feature| feature == message::BINARY_FEATURE);
+    let mut session = Session { channel, udp_socket, addr, id, binary, rx, state };
+    send_message(&mut session, &ServerMessage::Connected { id, players, features }).await;
+    println!("{id:02x}: connection established over UDP");
+
+    let mut interval = time::interval(POLL_INTERVAL);
+    let reason = loop {
+        tokio::select! {
+            msg = session.rx.recv() => {
+                let Some(msg) = msg else {
+                    // I don't think this should ever happen because rx is only dropped when we
+                    // disconnect
+                    break "rx is closed??".to_owned();
+                };
+                send_message(&mut session, &msg).await;
+            }
+            packet = packets.recv() => {
+                let Some(packet) = packet else {
+                    break "session closed".to_owned();
+                };
+                let Some(messages) = session.channel.receive(&packet, Instant::now()) else {
+                    break "received close".to_owned();
+                };
+                for msg in messages {
+                    super::tcp::handle_message(&session.state, id, &msg);
+                }
+                flush(&mut session.channel, &session.udp_socket, addr).await;
+            }
+            _ = interval.tick() => {
+                if session.channel.timed_out(Instant::now()) {
+                    break "timed out".to_owned();
+                }
+                flush(&mut session.channel, &session.udp_socket, addr).await;
+            }
+        }
+    };
+    println!("{id:02x}: disconnected: {reason}");
+}
+
+/// Waits for the client's Connect message, answering its packets in the meantime.
+async fn receive_connect_message(
+    channel: &mut Channel,
+    packets: &mut UnboundedReceiver<Vec<u8>>,
+    udp_socket: &Arc<UdpSocket>,
+    addr: SocketAddr,
+) -> Result<ConnectInfo, String> {
+    let mut interval = time::interval(POLL_INTERVAL);
+    loop {
+        let packet = tokio::select! {
+            packet = packets.recv() => packet.ok_or("session closed".to_owned())?,
+            _ = interval.tick() => {
+                if channel.timed_out(Instant::now()) {
+                    return Err("timed out".to_owned());
+                }
+                flush(channel, udp_socket, addr).await;
+                continue;
+            }
+        };
+        let messages = channel.receive(&packet, Instant::now()).ok_or("received close")?;
+        for msg in messages {
+            let msg = serde_json::from_slice::<ClientMessage>(&msg)
+                .map_err(|e| format!("failed to deserialize message: {e}"))?;
+            // nothing else means anything before the client is connected
+            if let ClientMessage::Connect(info) = msg {
+                return Ok(info);
+            }
+        }
+        flush(channel, udp_socket, addr).await;
+    }
+}
+
+async fn send_message(session: &mut Session, msg: &ServerMessage) {
+    let msg = if session.binary { msg.to_binary() } else { serde_json::to_vec(msg).unwrap() };
+    session.channel.send(&msg);
+    flush(&mut session.channel, &session.udp_socket, session.addr).await;
+}
+
+async fn flush(channel: &mut Channel, udp_socket: &UdpSocket, addr: SocketAddr) {
+    for packet in channel.poll(Instant::now()) {
+        send_to(udp_socket, &packet, addr).await;
+    }
+}
+
+async fn send_to(udp_socket: &UdpSocket, buf: &[u8], addr: SocketAddr) {
+    if let Err(err) = udp_socket.send_to(buf, addr).await {
+        println!("error sending UDP packet: {err}");
+    }
+}
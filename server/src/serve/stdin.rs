@@ -4,11 +4,11 @@ use std::{
     sync::{Arc, Mutex},
 };
 
-pub fn handle_command(_state: &Arc<Mutex<State>>, command: &str) {
-    // We don't use state yet but it could theoretically be used for all sorts of things
-    // e.g. a /warp_all command, which would send a message to all clients
-    // or a command to get info about currently connected players
+pub fn handle_command(state: &Arc<Mutex<State>>, command: &str) {
+    // state could be used for all sorts of things, e.g. a /warp_all command, which would send a
+    // message to all clients
     match command {
+        "/stats" => state.lock().unwrap().print_stats(),
         "/exit" => {
             println!("terminating server");
             process::exit(0);
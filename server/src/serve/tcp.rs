@@ -1,15 +1,17 @@
 use crate::{
-    message::{ClientMessage, ConnectInfo, ServerMessage},
+    message::{self, ClientMessage, ConnectInfo, ServerMessage},
     state::State,
 };
 use futures_util::{SinkExt, StreamExt};
 use std::sync::{Arc, Mutex};
 use tokio::{net::TcpStream, sync::mpsc::UnboundedReceiver};
-use tokio_tungstenite::WebSocketStream;
+use tokio_tungstenite::{WebSocketStream, tungstenite::Message};
 
 struct Connection {
     ws_stream: WebSocketStream<TcpStream>,
-    id: u8,
+    id: u16,
+    // whether the client agreed to binary messages
+    binary: bool,
     rx: UnboundedReceiver<ServerMessage>,
     state: Arc<Mutex<State>>,
 }
@@ -38,7 +40,8 @@ pub async fn handle_connection(state: Arc<Mutex<State>>, raw_stream: TcpStream)
             // ignore the number returned because buf is guaranteed to be empty as send_updates
             // drains all of buf
             _ = connection.rx.recv_many(&mut buf, limit) => {
-                if let Err(err) = send_updates(&mut connection.ws_stream, &mut buf).await {
+                let binary = connection.binary;
+                if let Err(err) = send_updates(&mut connection.ws_stream, &mut buf, binary).await {
                     break format!("failed to send connection updates: {err}");
                 }
             }
@@ -55,6 +58,9 @@ pub async fn handle_connection(state: Arc<Mutex<State>>, raw_stream: TcpStream)
                 if msg.is_close() {
                     break "received close message".to_owned();
                 }
+                if msg.is_text() || msg.is_binary() {
+                    handle_message(&connection.state, connection.id, &msg.into_data());
+                }
             }
         }
     };
@@ -71,14 +77,15 @@ async fn receive_connection(
     let info = receive_connect_message(&mut ws_stream)
         .await
         .map_err(|e| format!("failed to receive connect message: {e}"))?;
-    let (id, rx, players) = state.lock().unwrap().connect(info).ok_or("server full".to_owned())?;
-    let mut connection = Connection { ws_stream, id, rx, state };
+    let (id, rx, players, features) =
+        state.lock().unwrap().connect(info).ok_or("server full".to_owned())?;
+    let binary = features.iter().any(|feature| feature == message::BINARY_FEATURE);
+    let mut connection = Connection { ws_stream, id, binary, rx, state };
 
-    let msg = ServerMessage::Connected { id, players };
-    let msg = serde_json::to_string(&msg).unwrap();
+    let msg = ServerMessage::Connected { id, players, features };
     connection
         .ws_stream
-        .send(msg.into())
+        .send(to_ws_message(&msg, binary))
         .await
         .map_err(|e| format!("{id:02x}: error sending connected message: {e}"))?;
     Ok(connection)
@@ -105,22 +112,42 @@ async fn receive_connect_message(
         let msg = serde_json::from_str::<ClientMessage>(msg)
             .map_err(|e| format!("failed to deserialize message: {e}"))?;
 
-        return match msg {
-            ClientMessage::Connect(info) => Ok(info),
-        };
+        match msg {
+            ClientMessage::Connect(info) => return Ok(info),
+            // nothing else means anything before the client is connected
+            _ => continue,
+        }
+    }
+}
+
+/// Handles a message from a connected client, whichever way it came in.
+pub fn handle_message(state: &Arc<Mutex<State>>, id: u16, msg: &[u8]) {
+    let msg = match ClientMessage::decode(msg) {
+        Ok(msg) => msg,
+        Err(err) => {
+            println!("{id:02x}: {err}");
+            return;
+        }
+    };
+    match msg {
+        ClientMessage::Subscribe { zone } => state.lock().unwrap().subscribe(id, zone),
+        ClientMessage::Connect(_) => {
+            println!("{id:02x}: ignoring connect message from connected client");
+        }
     }
 }
 
 async fn send_updates(
     ws_stream: &mut WebSocketStream<TcpStream>,
     buf: &mut Vec<ServerMessage>,
+    binary: bool,
 ) -> Result<(), String> {
     if buf.is_empty() {
         // I don't think this should ever happen because rx is only dropped when we disconnect
         return Err("rx is closed??".to_owned());
     }
     for connection_update in buf.drain(..) {
-        feed_connection_update(ws_stream, connection_update).await?;
+        feed_connection_update(ws_stream, connection_update, binary).await?;
     }
     ws_stream.flush().await.map_err(|e| format!("failed to send connection updates: {e}"))
 }
@@ -128,7 +155,18 @@ async fn send_updates(
 async fn feed_connection_update(
     ws_stream: &mut WebSocketStream<TcpStream>,
     msg: ServerMessage,
+    binary: bool,
 ) -> Result<(), String> {
-    let msg = serde_json::to_string(&msg).unwrap();
-    ws_stream.feed(msg.into()).await.map_err(|e| format!("failed to feed connection update: {e}"))
+    ws_stream
+        .feed(to_ws_message(&msg, binary))
+        .await
+        .map_err(|e| format!("failed to feed connection update: {e}"))
+}
+
+fn to_ws_message(msg: &ServerMessage, binary: bool) -> Message {
+    if binary {
+        Message::binary(msg.to_binary())
+    } else {
+        serde_json::to_string(msg).unwrap().into()
+    }
 }
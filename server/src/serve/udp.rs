@@ -1,4 +1,4 @@
-use crate::state::{PlayerState, STATE_LEN, State};
+use crate::state::{PlayerState, Reply, STATE_LEN, State};
 use std::{
     net::SocketAddr,
     sync::{Arc, Mutex},
@@ -10,17 +10,112 @@ const MAX_PACKET_LEN: usize = MAX_STATES_PER_PACKET * STATE_LEN;
 const _: () = assert!(MAX_PACKET_LEN <= 508);
 const _: () = assert!(MAX_PACKET_LEN + STATE_LEN > 508);
 
+/// The biggest packet a client could send. A delta update with a keyframe and four redundant
+/// states is at most 136 bytes, but there's no harm in taking anything that fits in a datagram.
+pub const MAX_CLIENT_PACKET_LEN: usize = 508;
+
+/// A poll is just a player id. Clients send one in place of a state they chose not to send, and
+/// get the same reply as for a state.
+pub const POLL_LEN: usize = 1;
+const _: () = assert!(POLL_LEN % STATE_LEN != 0);
+
+/// A ping is a player id followed by the millis the client sent it at. A pong echoes those millis
+/// back followed by the server's millis. Neither length is a multiple of STATE_LEN, so the client
+/// can't mistake a pong for states.
+pub const PING_LEN: usize = 5;
+const PONG_LEN: usize = 8;
+const _: () = assert!(PING_LEN % STATE_LEN != 0 && PONG_LEN % STATE_LEN != 0);
+
+/// Players with wide ids start every packet with this byte, which is never a narrow id, then
+/// their 16 bit id. After that, a ping is just the client millis, and a delta update or poll
+/// carries on from its flags, so both are told apart by length like the rest.
+pub const WIDE_ID_MARKER: u8 = 255;
+pub const WIDE_ID_LEN: usize = 3;
+pub const WIDE_PING_LEN: usize = WIDE_ID_LEN + 4;
+
+/// Returns the id and client millis of a ping.
+pub fn parse_ping(buf: &[u8]) -> (u16, u32) {
+    (buf[0] as u16, u32::from_be_bytes(buf[1..5].try_into().unwrap()))
+}
+
+/// Returns the id of a player with a wide id, and the rest of its packet.
+pub fn parse_wide_id(buf: &[u8]) -> (u16, &[u8]) {
+    (u16::from_be_bytes([buf[1], buf[2]]), &buf[WIDE_ID_LEN..])
+}
+
+/// Answers a ping with a pong so the client can sync its clock to the server's. Pings from ids that
+/// aren't connected are ignored, since a pong is bigger than a ping.
+pub async fn handle_ping(
+    state: Arc<Mutex<State>>,
+    (id, client_millis): (u16, u32),
+    udp_socket: Arc<UdpSocket>,
+    addr: SocketAddr,
+) {
+    let Some(server_millis) = state.lock().unwrap().ping(id) else {
+        return;
+    };
+
+    let mut buf = [0u8; PONG_LEN];
+    buf[0..4].copy_from_slice(&client_millis.to_be_bytes());
+    buf[4..8].copy_from_slice(&server_millis.to_be_bytes());
+    send_to(udp_socket, &buf[..], addr).await;
+}
+
 // TODO should send_to be put in a tokio::spawn()?
 pub async fn handle_packet(
     state: Arc<Mutex<State>>,
-    (id, millis, player_state): (u8, u32, PlayerState),
+    (id, millis, player_state): (u16, u32, PlayerState),
+    udp_socket: Arc<UdpSocket>,
+    addr: SocketAddr,
+) {
+    let Some(reply) = state.lock().unwrap().update(id, millis, player_state) else {
+        return;
+    };
+    send_reply(reply, udp_socket, addr).await;
+}
+
+/// Handles an update or poll from a player that uses delta packets, where buf starts after its id.
+pub async fn handle_delta_packet(
+    state: Arc<Mutex<State>>,
+    id: u16,
+    buf: Vec<u8>,
+    udp_socket: Arc<UdpSocket>,
+    addr: SocketAddr,
+) {
+    let Some(reply) = state.lock().unwrap().update_delta(id, &buf, addr) else {
+        return;
+    };
+    send_reply(reply, udp_socket, addr).await;
+}
+
+/// Replies to a poll with states like handle_packet, without storing anything.
+pub async fn handle_poll(
+    state: Arc<Mutex<State>>,
+    id: u16,
     udp_socket: Arc<UdpSocket>,
     addr: SocketAddr,
 ) {
-    let Some(updates) = state.lock().unwrap().update(id, millis, player_state) else {
+    let Some(reply) = state.lock().unwrap().poll(id) else {
         return;
     };
+    send_reply(reply, udp_socket, addr).await;
+}
+
+async fn send_reply(reply: Reply, udp_socket: Arc<UdpSocket>, addr: SocketAddr) {
+    match reply {
+        Reply::States(updates) => send_states(updates, udp_socket, addr).await,
+        Reply::Delta(packets) => send_packets(packets, udp_socket, addr).await,
+    }
+}
+
+pub async fn send_packets(packets: Vec<Vec<u8>>, udp_socket: Arc<UdpSocket>, addr: SocketAddr) {
+    for packet in packets {
+        send_to(udp_socket.clone(), &packet, addr).await;
+    }
+}
 
+/// Sends updates to addr, packing as many into each packet as fit.
+async fn send_states(updates: Vec<[u8; STATE_LEN]>, udp_socket: Arc<UdpSocket>, addr: SocketAddr) {
     let mut buf = [0u8; MAX_PACKET_LEN];
     let mut states_in_buf = 0;
     for bytes in updates {
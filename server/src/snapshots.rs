@@ -0,0 +1,15 @@
+/// The feature clients ask for in Connect, along with delta, to be sent the other players' states
+/// once every server tick instead of in reply to each of their own packets.
+pub const FEATURE: &str = "snapshots";
+
+/// How often snapshots go out. Tick n is at n * TICK_MILLIS on the server's clock, which clients
+/// know too, so a snapshot only needs to carry its tick number. About the default send rate, so
+/// a snapshot usually has one new state from each player.
+pub const TICK_MILLIS: u32 = 33;
+
+/// Returns the tick that millis on the server's clock falls in.
+pub fn tick_at(millis: u128) -> u32 {
+    // tick * TICK_MILLIS then wraps along with the server's truncated millis, at least until the
+    // tick number itself wraps after about four years
+    (millis / TICK_MILLIS as u128) as u32
+}
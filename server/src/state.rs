@@ -1,100 +1,422 @@
-use crate::message::{ConnectInfo, PlayerInfo, ServerMessage};
+use crate::{
+    delta::{self, Encoded, Outgoing, Packet, Quantized},
+    link_stats::{self, Tracker},
+    message::{self, ConnectInfo, PlayerInfo, ServerMessage},
+    snapshots, tiers,
+};
 use rand::{Rng, SeedableRng, rngs::SmallRng};
-use std::collections::{BTreeMap, HashMap, HashSet};
+use std::{
+    collections::{BTreeMap, HashMap, HashSet, VecDeque, btree_map::Entry},
+    hash::{BuildHasherDefault, Hasher},
+    net::SocketAddr,
+    time::Instant,
+};
 use tokio::sync::mpsc::{self, UnboundedReceiver, UnboundedSender};
 
-// semi-arbitrary limit on number of connected players, but this guarantees that server updates fit
-// into a single packet
-const MAX_PLAYERS: usize = 22;
+// limit on number of connected players. replies are split over as many packets as they need, so
+// this is only about how many players one server can keep up with: every update is replied to with
+// the states of every other player under one lock, so the cost grows with the square of this. at
+// 30 updates a second, this many players in one place take about half a core in tests::load_test,
+// which leaves room for the sockets. it's above NARROW_IDS, so once the narrow ids run out only
+// players with wide ids can join
+const MAX_PLAYERS: usize = 300;
+
+// ids below this fit in the byte that players without wide ids use for them. 255 itself is never
+// handed out, so a packet from a player with a wide id can start with it (see serve::udp)
+pub const NARROW_IDS: u16 = 255;
+// every id is below this, so clients can keep a slot for each possible id
+pub const MAX_IDS: u16 = 1024;
+const _: () = assert!(MAX_PLAYERS < MAX_IDS as usize);
 
 // how many updates to keep for each player
 const MAX_UPDATES: usize = 20;
 
+// how many delta packets to remember per player while waiting for acks; acks older than this are
+// ignored, which only means keyframes get sent a little longer. with many players, one reply can
+// take several packets
+const MAX_IN_FLIGHT: usize = 128;
+
+// a delta player gets a keyframe of every other player at least this often, so a state lost in a
+// way acks can't catch never lingers
+const KEYFRAME_MILLIS: u32 = 1000;
+
 pub const STATE_LEN: usize = 24;
 
 pub struct PlayerState {
     bytes: [u8; STATE_LEN],
-    sent_to: HashSet<u8>,
+    // the same state as bytes, for delta players
+    quantized: Quantized,
+    // when this state was stored, counted across all players; see Player::seen
+    arrival: u64,
+    // set if this state was only received as a repeat in a later update, see delta::decode_update
+    recovered: bool,
+}
+
+/// One of a player's states encoded for delta players, which every receiver sent that state
+/// against the same baseline shares.
+struct Encoding {
+    millis: u32,
+    baseline: Option<u32>,
+    short_keyframes: bool,
+    encoded: Encoded,
 }
 
 impl PlayerState {
     /// Creates a new PlayerState from its byte representation. Also returns the parsed id and
     /// millis.
-    pub fn from_bytes(bytes: [u8; STATE_LEN]) -> (u8, u32, Self) {
-        let id = bytes[0];
-        let millis = u32::from_be_bytes(bytes[1..5].try_into().unwrap());
-        (id, millis, Self { bytes, sent_to: HashSet::new() })
+    pub fn from_bytes(bytes: [u8; STATE_LEN]) -> (u16, u32, Self) {
+        let id = bytes[0] as u16;
+        let quantized = Quantized::from_state_bytes(&bytes);
+        (id, quantized.millis, Self { bytes, quantized, arrival: 0, recovered: false })
+    }
+
+    /// Creates a new PlayerState from a state decoded from a delta packet. A wide id doesn't fit in
+    /// bytes, but bytes are only sent to players without wide ids, who are never sent these.
+    fn from_quantized(id: u16, quantized: Quantized, recovered: bool) -> Self {
+        let bytes = quantized.to_state_bytes(id as u8);
+        Self { bytes, quantized, arrival: 0, recovered }
     }
 }
 
+/// What a player that uses delta packets has been sent and is known to have.
+#[derive(Default)]
+struct DeltaLink {
+    next_sequence: u16,
+    // packets that haven't been acked yet, oldest first
+    in_flight: VecDeque<Packet>,
+    // for each other player, by id, the millis of the newest of its states this player is known to
+    // have
+    baselines: Vec<Option<u32>>,
+    // for each other player, by id, the millis of the last keyframe of it sent to this player
+    keyframes: Vec<Option<u32>>,
+    // whether keyframes to and from this player send locations as short offsets when they can
+    short_keyframes: bool,
+    // whether packets to and from this player are numbered, and if so, the sequence of the next
+    // state of each other player, by id, sent to it
+    sequenced: bool,
+    sequences: Vec<u8>,
+    // whether ids in packets to and from this player are 16 bits
+    wide: bool,
+    // whether this player is sent a snapshot every tick rather than a reply to each packet, and if
+    // so, where its newest packet came from, which is where snapshots go
+    snapshots: bool,
+    addr: Option<SocketAddr>,
+    // how many packets and bytes of states this player has been sent, to compare replies with
+    // snapshots
+    sent_packets: u64,
+    sent_bytes: u64,
+}
+
+impl DeltaLink {
+    /// Makes the states in the acked packet baselines, along with those in each earlier packet
+    /// whose bit is set in mask, where bit i is the packet i + 1 before it. Then forgets it and
+    /// every packet before it.
+    fn ack(&mut self, sequence: u16, mask: u32) {
+        let Some(i) = self.in_flight.iter().position(|packet| packet.sequence == sequence) else {
+            return;
+        };
+        for packet in self.in_flight.drain(..=i) {
+            let behind = sequence.wrapping_sub(packet.sequence) as u32;
+            if behind != 0 && (behind > u32::BITS || (mask >> (behind - 1)) & 1 == 0) {
+                continue;
+            }
+            for (sender, millis) in packet.states {
+                let baseline = &mut self.baselines[sender as usize];
+                if baseline.is_none_or(|baseline| millis > baseline) {
+                    *baseline = Some(millis);
+                }
+            }
+        }
+    }
+}
+
+/// What to send a player in reply to one of its packets.
+pub enum Reply {
+    States(Vec<[u8; STATE_LEN]>),
+    Delta(Vec<Vec<u8>>),
+}
+
 struct Player {
     color: [u8; 3],
     name: String,
     states: BTreeMap<u32, PlayerState>,
+    // the states in states as they've been encoded for delta players, until they or their
+    // baselines are pushed out of it
+    encodings: Vec<Encoding>,
+    // the arrival of the last state stored for this player, and how many of its stored states were
+    // recovered
+    newest_arrival: u64,
+    recovered_stored: usize,
+    // for each other player, by id, the arrival of its last stored state when a state of it was
+    // last sent to this player. its states that arrived before that have been sent or skipped, so
+    // a reply only looks at those after it
+    seen: Vec<u64>,
     tx: UnboundedSender<ServerMessage>,
+    // set if this player asked for delta packets when connecting
+    delta: Option<DeltaLink>,
+    // how many of this player's states were only received as repeats in later updates
+    recovered: u64,
+    // what has arrived of this player's numbered packets
+    upstream: Tracker,
+    // the zone this player subscribed to, if it did; it's then only sent states from that zone
+    zone: Option<u32>,
+    // the other players whose newest state sent to this player was in its zone, so it's sent
+    // their first state outside of it to know they left
+    in_zone: HashSet<u16>,
+    // set if this player asked to be sent far away players' states less often, in which case this
+    // is the millis of the newest state of each other player sent to it
+    tiered: bool,
+    last_sent: HashMap<u16, u32>,
+    connected: Instant,
 }
 
 impl Player {
-    fn new(color: [u8; 3], name: String, tx: UnboundedSender<ServerMessage>) -> Self {
-        Self { color, name, states: BTreeMap::new(), tx }
+    fn new(
+        color: [u8; 3],
+        name: String,
+        tx: UnboundedSender<ServerMessage>,
+        delta: Option<DeltaLink>,
+        tiered: bool,
+    ) -> Self {
+        let upstream = Tracker::new(16);
+        Self {
+            color,
+            name,
+            states: BTreeMap::new(),
+            encodings: Vec::new(),
+            newest_arrival: 0,
+            recovered_stored: 0,
+            seen: vec![0; MAX_IDS as usize],
+            tx,
+            delta,
+            recovered: 0,
+            upstream,
+            zone: None,
+            in_zone: HashSet::new(),
+            tiered,
+            last_sent: HashMap::new(),
+            connected: Instant::now(),
+        }
     }
 
-    fn update(&mut self, millis: u32, player_state: PlayerState) {
-        // ignore duplicates
-        if self.states.contains_key(&millis) {
-            return;
-        }
+    /// Returns whether this player can be told about the player with this id, which it can't if
+    /// the id is wide and this player doesn't use wide ids.
+    fn sees(&self, id: u16) -> bool {
+        id < NARROW_IDS || self.is_wide()
+    }
 
-        // if states is not full, just put it in
-        if self.states.len() < MAX_UPDATES {
-            self.states.insert(millis, player_state);
-            return;
+    fn is_wide(&self) -> bool {
+        self.delta.as_ref().is_some_and(|link| link.wide)
+    }
+
+    fn print_stats(&self, id: u16) {
+        if let Some(link) = self.delta.as_ref().filter(|link| link.sent_packets > 0) {
+            let seconds = self.connected.elapsed().as_secs_f64();
+            println!(
+                "{id:02x}: sent {} packets, {} bytes of {} ({:.1} packets/s, {:.0} bytes/s)",
+                link.sent_packets,
+                link.sent_bytes,
+                if link.snapshots { "snapshots" } else { "replies" },
+                link.sent_packets as f64 / seconds,
+                link.sent_bytes as f64 / seconds,
+            );
         }
+        if self.upstream.received() > 0 {
+            println!("{id:02x}: {}", self.upstream);
+        }
+        if self.recovered > 0 {
+            println!("{id:02x}: recovered {} lost states from redundant updates", self.recovered);
+        }
+    }
 
+    /// Stores a state as the one with this arrival and returns whether it was new.
+    fn update(&mut self, millis: u32, mut player_state: PlayerState, arrival: u64) -> bool {
         // if states is full, only put it in if it wouldn't be first; then pop first
-        if self.states.first_key_value().unwrap().0 < &millis {
-            self.states.insert(millis, player_state);
-            self.states.pop_first();
+        let full = self.states.len() == MAX_UPDATES;
+        if full && *self.states.first_key_value().unwrap().0 >= millis {
+            return false;
+        }
+
+        // ignore duplicates, which redundant updates make common, with the same lookup as the insert
+        let Entry::Vacant(entry) = self.states.entry(millis) else {
+            return false;
+        };
+        player_state.arrival = arrival;
+        self.recovered_stored += player_state.recovered as usize;
+        entry.insert(player_state);
+        self.newest_arrival = arrival;
+        if full {
+            let (first_millis, first) = self.states.pop_first().unwrap();
+            self.recovered_stored -= first.recovered as usize;
+            self.encodings.retain(|e| e.millis != first_millis && e.baseline != Some(first_millis));
+        }
+        true
+    }
+
+    /// Returns state, one of this player's, encoded against its stored state with the baseline
+    /// millis, or as a keyframe if there's none, along with whether it's a keyframe. It's kept in
+    /// encodings for the next receiver that needs it the same way.
+    fn encoding(
+        &mut self,
+        state: &Quantized,
+        baseline: Option<u32>,
+        short_keyframes: bool,
+    ) -> (Encoded, bool) {
+        // the newest states are the most asked for, and they were encoded last
+        let find = |encodings: &[Encoding], baseline: Option<u32>| {
+            encodings.iter().rposition(|e| {
+                e.millis == state.millis
+                    && e.baseline == baseline
+                    && e.short_keyframes == short_keyframes
+            })
+        };
+        // an encoding against a baseline only lasts as long as the baseline is stored, so finding
+        // one means it still is
+        if let Some(i) = baseline.and_then(|baseline| find(&self.encodings, Some(baseline))) {
+            return (self.encodings[i].encoded, false);
+        }
+        let baseline = baseline.and_then(|millis| self.states.get(&millis)).map(|s| s.quantized);
+        if baseline.is_none() {
+            if let Some(i) = find(&self.encodings, None) {
+                return (self.encodings[i].encoded, true);
+            }
         }
+        let encoded = Encoded::new(state, baseline.as_ref(), short_keyframes);
+        self.encodings.push(Encoding {
+            millis: state.millis,
+            baseline: baseline.map(|baseline| baseline.millis),
+            short_keyframes,
+            encoded,
+        });
+        (encoded, baseline.is_none())
+    }
+}
+
+/// Hashes player ids with a multiply instead of SipHash. Ids are handed out at random, so there's
+/// nothing to defend against, and a reply looks up the sender of every state in it.
+#[derive(Default)]
+struct IdHasher(u64);
+
+impl Hasher for IdHasher {
+    fn write(&mut self, bytes: &[u8]) {
+        for byte in bytes {
+            self.write_u16(*byte as u16);
+        }
+    }
+
+    fn write_u16(&mut self, id: u16) {
+        // the map takes its buckets from the low bits and tags from the high ones, which the
+        // multiply fills
+        self.0 = (self.0 ^ id as u64).wrapping_mul(0x9e37_79b9_7f4a_7c15);
+    }
+
+    fn finish(&self) -> u64 {
+        self.0
     }
 }
 
 /// Shared state between all threads, used to track what has been received from and what should be
 /// sent to players.
 pub struct State {
-    players: HashMap<u8, Player>,
+    players: HashMap<u16, Player, BuildHasherDefault<IdHasher>>,
+    // the arrival of the last state stored; it never goes back, so a reused id can't match
+    // anything in Player::seen from before
+    arrivals: u64,
     rng: SmallRng,
+    // the zero of the clock that clients sync to and stamp their states with
+    start: Instant,
 }
 
 impl State {
     pub fn new() -> Self {
-        Self { players: HashMap::new(), rng: SmallRng::from_rng(&mut rand::rng()) }
+        Self {
+            players: HashMap::default(),
+            arrivals: 0,
+            rng: SmallRng::from_rng(&mut rand::rng()),
+            start: Instant::now(),
+        }
     }
 
+    /// Adds a player and returns its id, its message receiver, the other players and the features
+    /// from info that the server agreed to.
     pub fn connect(
         &mut self,
         info: ConnectInfo,
-    ) -> Option<(u8, UnboundedReceiver<ServerMessage>, Vec<PlayerInfo>)> {
+    ) -> Option<(u16, UnboundedReceiver<ServerMessage>, Vec<PlayerInfo>, Vec<String>)> {
         if self.players.len() == MAX_PLAYERS {
             return None;
         }
 
-        // player limit means this should be fine, right?
+        // short keyframes, redundant states, sequence numbers, wide ids, ack masks and snapshots
+        // only exist in delta packets
+        let wants_delta = info.features.iter().any(|feature| feature == delta::FEATURE);
+        let delta_only = [
+            delta::SHORT_KEYFRAMES_FEATURE,
+            delta::REDUNDANCY_FEATURE,
+            link_stats::FEATURE,
+            delta::WIDE_IDS_FEATURE,
+            delta::ACK_MASK_FEATURE,
+            snapshots::FEATURE,
+        ];
+        let features: Vec<String> = info
+            .features
+            .into_iter()
+            .filter(|feature| {
+                feature == delta::FEATURE
+                    || feature == tiers::FEATURE
+                    || feature == message::BINARY_FEATURE
+                    || (wants_delta && delta_only.contains(&feature.as_str()))
+            })
+            .collect();
+        let has = |name: &str| features.iter().any(|feature| feature == name);
+        let short_keyframes = has(delta::SHORT_KEYFRAMES_FEATURE);
+        let sequenced = has(link_stats::FEATURE);
+        let tiered = has(tiers::FEATURE);
+        let wide = has(delta::WIDE_IDS_FEATURE);
+        let snapshots = has(snapshots::FEATURE);
+        let delta = wants_delta.then(|| DeltaLink {
+            baselines: vec![None; MAX_IDS as usize],
+            keyframes: vec![None; MAX_IDS as usize],
+            sequences: vec![0; MAX_IDS as usize],
+            short_keyframes,
+            sequenced,
+            wide,
+            snapshots,
+            ..Default::default()
+        });
+
+        // narrow ids are handed out first, so players without wide ids, who can only see others
+        // with narrow ids, see as many players as they can. the player limit means there's always
+        // a free id in whichever range is picked
+        let narrow_taken = self.players.keys().filter(|id| **id < NARROW_IDS).count();
+        let range = if narrow_taken < NARROW_IDS as usize {
+            0..NARROW_IDS
+        } else if wide {
+            NARROW_IDS + 1..MAX_IDS
+        } else {
+            return None;
+        };
         let id = loop {
-            let id = self.rng.random::<u8>();
+            let id = self.rng.random_range(range.clone());
             if !self.players.contains_key(&id) {
                 break id;
             }
         };
 
-        // create list of other players' ids while informing other players of this new connection
+        // create list of other players' ids while informing other players of this new connection.
+        // players without wide ids never hear of players with them
         let mut players = Vec::with_capacity(self.players.len());
         for (player_id, player) in &self.players {
-            players.push(PlayerInfo {
-                id: *player_id,
-                color: player.color,
-                name: player.name.clone(),
-            });
+            if wide || *player_id < NARROW_IDS {
+                players.push(PlayerInfo {
+                    id: *player_id,
+                    color: player.color,
+                    name: player.name.clone(),
+                });
+            }
+            if !player.sees(id) {
+                continue;
+            }
             // if the corresponding rx has been dropped, it doesn't matter that this message won't
             // get read, so we can ignore the error
             let _ = player.tx.send(ServerMessage::PlayerJoined {
@@ -105,54 +427,673 @@ impl State {
         }
 
         let (tx, rx) = mpsc::unbounded_channel();
-        self.players.insert(id, Player::new(info.color, info.name, tx));
+        self.players.insert(id, Player::new(info.color, info.name, tx, delta, tiered));
 
-        Some((id, rx, players))
+        Some((id, rx, players, features))
+    }
+
+    /// Returns whether the player with this id uses delta packets.
+    pub fn is_delta(&self, id: u16) -> bool {
+        self.players.get(&id).is_some_and(|player| player.delta.is_some())
     }
 
     /// Removes the player associated with id from state and informs other players that they
     /// disconnected.
-    pub fn disconnect(&mut self, id: u8) {
-        if self.players.remove(&id).is_none() {
+    pub fn disconnect(&mut self, id: u16) {
+        let Some(player) = self.players.remove(&id) else {
             // TODO this shouldn't happen, right?
             return;
+        };
+        player.print_stats(id);
+
+        for player in self.players.values_mut() {
+            // the id can be handed out again, and the next player with it starts from nothing
+            if let Some(link) = player.delta.as_mut() {
+                link.baselines[id as usize] = None;
+                link.keyframes[id as usize] = None;
+                link.sequences[id as usize] = 0;
+            }
+            if player.sees(id) {
+                let _ = player.tx.send(ServerMessage::PlayerLeft { id });
+            }
+        }
+    }
+
+    /// Makes the player associated with id only be sent states from zone, starting with the newest
+    /// state of every other player, since those weren't sent to it if they were in another zone.
+    pub fn subscribe(&mut self, id: u16, zone: u32) {
+        let Some(player) = self.players.get_mut(&id) else {
+            return;
+        };
+        player.zone = Some(zone);
+        player.in_zone.clear();
+        // the client forgets the states it decodes deltas against when it changes zone, so nothing
+        // sent before this can be a baseline, even if it's acked later
+        if let Some(link) = player.delta.as_mut() {
+            link.baselines.fill(None);
+            link.in_flight.clear();
         }
 
-        for player in self.players.values() {
-            let _ = player.tx.send(ServerMessage::PlayerLeft { id });
+        let mut seen = std::mem::take(&mut player.seen);
+        for (player_id, player) in &self.players {
+            if let Some((_, newest)) = player.states.last_key_value() {
+                let seen = &mut seen[*player_id as usize];
+                *seen = (*seen).min(newest.arrival - 1);
+            }
         }
+        self.players.get_mut(&id).unwrap().seen = seen;
     }
 
     /// Updates player state and returns up to one update for each other connected player. Returns
     /// None if `id` isn't a connected player.
-    pub fn update(
-        &mut self,
-        id: u8,
-        millis: u32,
-        player_state: PlayerState,
-    ) -> Option<Vec<[u8; STATE_LEN]>> {
+    pub fn update(&mut self, id: u16, millis: u32, player_state: PlayerState) -> Option<Reply> {
         let player = self.players.get_mut(&id)?;
-        player.update(millis, player_state);
+        self.arrivals += 1;
+        player.update(millis, player_state, self.arrivals);
+
+        Some(self.reply(id, None))
+    }
+
+    /// Returns up to one update for each other connected player, like update but without storing a
+    /// new state. Returns None if `id` isn't a connected player.
+    pub fn poll(&mut self, id: u16) -> Option<Reply> {
+        if !self.players.contains_key(&id) {
+            return None;
+        }
+        Some(self.reply(id, None))
+    }
+
+    /// Handles an update or poll from a delta player, where buf starts after its id and addr is
+    /// where it came from: applies its ack, stores its state if it has one and can be decoded, and
+    /// replies like update, unless the player is sent snapshots instead. Returns None if the packet
+    /// is malformed or `id` isn't a connected delta player.
+    pub fn update_delta(&mut self, id: u16, buf: &[u8], addr: SocketAddr) -> Option<Reply> {
+        let header = delta::parse_update_header(id, buf)?;
+        let arrived = self.start.elapsed().as_secs_f64() * 1000.0;
+        let player = self.players.get_mut(&header.id)?;
+        let link = player.delta.as_mut()?;
+        if let Some(sequence) = header.ack {
+            link.ack(sequence, header.ack_mask);
+        }
+        if link.snapshots {
+            link.addr = Some(addr);
+        }
+        let snapshots = link.snapshots;
+        if let Some(sequence) = header.sequence {
+            let sent = header.millis.map(|millis| millis as f64);
+            player.upstream.add(sequence as u64, sent, arrived);
+        }
+        if header.millis.is_some() {
+            let find_baseline = |baseline: u32| player.states.get(&baseline).map(|s| s.quantized);
+            match delta::decode_update(buf, &header, find_baseline, link.short_keyframes) {
+                Some((quantized, redundant)) => {
+                    let state = PlayerState::from_quantized(header.id, quantized, false);
+                    self.arrivals += 1;
+                    player.update(quantized.millis, state, self.arrivals);
+                    // repeats of states we already have are the common case; anything new is a
+                    // state whose own update was lost
+                    for quantized in redundant {
+                        let state = PlayerState::from_quantized(header.id, quantized, true);
+                        self.arrivals += 1;
+                        if player.update(quantized.millis, state, self.arrivals) {
+                            player.recovered += 1;
+                        }
+                    }
+                }
+                // the client only deltas against states we've told it we have, so this is a state
+                // that's been pushed out since; the next keyframe fixes it
+                None => println!("{:02x}: dropped delta state with unknown baseline", header.id),
+            }
+        }
+        if snapshots {
+            return Some(Reply::Delta(Vec::new()));
+        }
+        Some(self.reply(header.id, None))
+    }
+
+    /// Returns the instant the server's clock counts from, which ticks are lined up with.
+    pub fn start(&self) -> Instant {
+        self.start
+    }
+
+    /// Builds this tick's snapshot for each player that's sent them, along with where to send it.
+    /// A snapshot has the same states a reply to one of the player's packets would have had.
+    pub fn snapshot(&mut self) -> Vec<(SocketAddr, Vec<Vec<u8>>)> {
+        let tick = snapshots::tick_at(self.start.elapsed().as_millis());
+        let receivers: Vec<(u16, SocketAddr)> = self
+            .players
+            .iter()
+            .filter_map(|(id, player)| {
+                let link = player.delta.as_ref().filter(|link| link.snapshots)?;
+                Some((*id, link.addr?))
+            })
+            .collect();
+        let mut snapshots = Vec::with_capacity(receivers.len());
+        for (id, addr) in receivers {
+            if let Reply::Delta(packets) = self.reply(id, Some(tick)) {
+                if !packets.is_empty() {
+                    snapshots.push((addr, packets));
+                }
+            }
+        }
+        snapshots
+    }
 
-        Some(self.filtered_state(id))
+    /// Prints what has arrived of each player's packets and how many of their states were recovered.
+    pub fn print_stats(&self) {
+        for (id, player) in &self.players {
+            player.print_stats(*id);
+        }
     }
 
-    fn filtered_state(&mut self, id: u8) -> Vec<[u8; STATE_LEN]> {
+    /// Returns the server's millis for a pong, or None if `id` isn't a connected player.
+    pub fn ping(&self, id: u16) -> Option<u32> {
+        if !self.players.contains_key(&id) {
+            return None;
+        }
+        // truncating is fine; clients only ever compare millis that are close together
+        Some(self.start.elapsed().as_millis() as u32)
+    }
+
+    /// Returns the states to send the player, as a snapshot of this tick if tick is set.
+    fn reply(&mut self, id: u16, tick: Option<u32>) -> Reply {
+        let filtered_state = self.filtered_state(id);
+        let Some(mut link) = self.players.get_mut(&id).and_then(|player| player.delta.take()) else {
+            return Reply::States(filtered_state.into_iter().map(|(_, bytes, _)| bytes).collect());
+        };
+
+        // each state is found among its sender's encodings, or encoded there if no one else has been
+        // sent it against the same baseline
+        let mut outgoing = Vec::with_capacity(filtered_state.len());
+        for (sender, _, state) in &filtered_state {
+            let i = *sender as usize;
+            let keyframe_due = link.keyframes[i]
+                .is_none_or(|keyframe| state.millis.wrapping_sub(keyframe) >= KEYFRAME_MILLIS);
+            // the baseline has to be older than the state so the offset between them is positive
+            let baseline =
+                link.baselines[i].filter(|millis| !keyframe_due && *millis < state.millis);
+            let player = self.players.get_mut(sender).unwrap();
+            let (encoded, keyframe) = player.encoding(state, baseline, link.short_keyframes);
+            if keyframe {
+                link.keyframes[i] = Some(state.millis);
+            }
+            let sequence = link.sequenced.then(|| {
+                let next = &mut link.sequences[i];
+                *next = next.wrapping_add(1);
+                next.wrapping_sub(1)
+            });
+            outgoing.push(Outgoing { sender: *sender, sequence, millis: state.millis, encoded });
+        }
+
+        let ack = self.players[&id].states.last_key_value().map(|(millis, _)| *millis);
+        let packets =
+            delta::build_packets(&outgoing, ack, tick, &mut link.next_sequence, link.wide);
+        let replies: Vec<Vec<u8>> = packets.iter().map(|packet| packet.bytes.clone()).collect();
+        link.sent_packets += replies.len() as u64;
+        link.sent_bytes += replies.iter().map(|reply| reply.len() as u64).sum::<u64>();
+        link.in_flight.extend(packets);
+        while link.in_flight.len() > MAX_IN_FLIGHT {
+            link.in_flight.pop_front();
+        }
+        self.players.get_mut(&id).unwrap().delta = Some(link);
+        Reply::Delta(replies)
+    }
+
+    /// Returns the id and state, in both forms, of up to one update for each other connected
+    /// player.
+    fn filtered_state(&mut self, id: u16) -> Vec<(u16, [u8; STATE_LEN], Quantized)> {
         let mut filtered_state = Vec::with_capacity(self.players.len());
-        for (player_id, player) in &mut self.players {
-            if id == *player_id {
+        // taken out of the receiver while the other players are borrowed, and put back after
+        let (sees_wide, zone, mut seen, mut in_zone, mut last_sent, position) =
+            match self.players.get_mut(&id) {
+                Some(receiver) => (
+                    receiver.is_wide(),
+                    receiver.zone,
+                    std::mem::take(&mut receiver.seen),
+                    std::mem::take(&mut receiver.in_zone),
+                    std::mem::take(&mut receiver.last_sent),
+                    receiver
+                        .tiered
+                        .then(|| receiver.states.last_key_value().map(|(_, state)| state.quantized))
+                        .flatten(),
+                ),
+                None => (false, None, Vec::new(), HashSet::new(), HashMap::new(), None),
+            };
+        for (player_id, player) in &self.players {
+            if id == *player_id || (*player_id >= NARROW_IDS && !sees_wide) {
                 continue;
             }
+            // nothing has arrived from this player since it was last looked at, which is the
+            // common case when most players reply between any two states of another
+            let seen = &mut seen[*player_id as usize];
+            if *seen >= player.newest_arrival {
+                continue;
+            }
+            let interval = match (&position, player.states.last_key_value()) {
+                (Some(position), Some((_, newest))) => tiers::interval(position, &newest.quantized),
+                _ => 0,
+            };
 
-            // get the most recent update that hasn't been sent to the player
-            for state in player.states.values_mut().rev() {
-                if !state.sent_to.contains(&id) {
-                    state.sent_to.insert(id);
-                    filtered_state.push(state.bytes);
+            // get the most recent update that hasn't been sent to the player, along with any
+            // recovered ones, which fill holes the player would otherwise have in its history
+            let mut found_newest = false;
+            for state in player.states.values().rev() {
+                if found_newest && player.recovered_stored == 0 {
                     break;
                 }
+                if (found_newest && !state.recovered) || state.arrival <= *seen {
+                    continue;
+                }
+                let is_newest = !found_newest;
+                // a player in a slower tier only gets a state once enough time has passed since the
+                // last one it got, and never the recovered ones, which just fill in detail
+                if interval > 0 {
+                    let last = last_sent.get(player_id).copied();
+                    let too_soon = last
+                        .is_some_and(|last| state.quantized.millis.wrapping_sub(last) < interval);
+                    if !is_newest || too_soon {
+                        break;
+                    }
+                }
+                found_newest = true;
+
+                // a subscribed player only gets states from its zone, except for the one that
+                // shows another player left it
+                if let Some(zone) = zone {
+                    if state.quantized.zone == zone {
+                        if is_newest {
+                            in_zone.insert(*player_id);
+                        }
+                    } else if !is_newest || !in_zone.remove(player_id) {
+                        continue;
+                    }
+                }
+                if is_newest && position.is_some() {
+                    last_sent.insert(*player_id, state.quantized.millis);
+                }
+                filtered_state.push((*player_id, state.bytes, state.quantized));
+            }
+            if found_newest {
+                *seen = player.newest_arrival;
             }
         }
+        if let Some(receiver) = self.players.get_mut(&id) {
+            receiver.seen = seen;
+            receiver.in_zone = in_zone;
+            receiver.last_sent = last_sent;
+        }
         filtered_state
     }
 }
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+    use crate::bits::BitWriter;
+    use std::time::Duration;
+
+    // updates are sent this many times a second by default, see network.send_rate in the client
+    const SEND_RATE: u32 = 30;
+
+    /// A delta update from a player at x, acking every packet up to ack, with a keyframe of its
+    /// state. Keyframes cost the server about what deltas do to decode.
+    fn keyframe_update(ack: u16, millis: u32, x: i32) -> Vec<u8> {
+        // flags for a state, an ack and an ack mask, see delta::parse_update_header
+        let mut buf = vec![1 | 2 | 16];
+        buf.extend_from_slice(&ack.to_be_bytes());
+        buf.extend_from_slice(&u32::MAX.to_be_bytes());
+        buf.extend_from_slice(&millis.to_be_bytes());
+        let mut state = BitWriter::new();
+        state.write_bool(true);
+        state.write(0, 32);
+        for location in [x, 0, 0] {
+            state.write(location as u32 as u64, 32);
+        }
+        state.write(0, 24);
+        buf.extend_from_slice(&state.into_bytes());
+        buf
+    }
+
+    /// Connects a player with these features and returns its id.
+    fn connect(state: &mut State, features: &[&str]) -> u16 {
+        let info = ConnectInfo {
+            color: [0; 3],
+            name: "player".to_string(),
+            features: features.iter().map(|feature| feature.to_string()).collect(),
+        };
+        state.connect(info).unwrap().0
+    }
+
+    /// A delta update with a keyframe at millis, repeating the states at each of earlier in the
+    /// same place. See delta::decode_update.
+    fn redundant_update(millis: u32, earlier: &[u32]) -> Vec<u8> {
+        // flags for a state and redundant states
+        let mut buf = vec![1 | 4, 0, 0];
+        buf.extend_from_slice(&millis.to_be_bytes());
+        let mut state = BitWriter::new();
+        state.write_bool(true);
+        state.write(0, 32 + 3 * 32 + 24);
+        state.write(earlier.len() as u64, 3);
+        let mut after = millis;
+        for millis in earlier {
+            state.write_varbits((after - millis) as u64);
+            // no change to the zone, location deltas of 0, which are just a 6 bit length, and no
+            // change to the rotation
+            state.write(0, 1 + 3 * 6 + 3);
+            after = *millis;
+        }
+        buf.extend_from_slice(&state.into_bytes());
+        buf
+    }
+
+    /// Stores a state of the player with this id, which doesn't use delta packets.
+    fn update(state: &mut State, id: u16, millis: u32, zone: u32) {
+        let mut bytes = [0; STATE_LEN];
+        bytes[0] = id as u8;
+        bytes[1..5].copy_from_slice(&millis.to_be_bytes());
+        bytes[5..9].copy_from_slice(&zone.to_be_bytes());
+        let (_, millis, player_state) = PlayerState::from_bytes(bytes);
+        state.update(id, millis, player_state).unwrap();
+    }
+
+    /// Returns the sender and zone of each state a poll from the player with this id gets.
+    fn poll_zones(state: &mut State, id: u16) -> Vec<(u8, u32)> {
+        let Some(Reply::States(states)) = state.poll(id) else {
+            panic!("no reply to {id}");
+        };
+        states.iter().map(|s| (s[0], u32::from_be_bytes(s[5..9].try_into().unwrap()))).collect()
+    }
+
+    #[test]
+    fn subscribed_players_only_get_states_from_their_zone() {
+        let mut state = State::new();
+        let [a, b, c] = [(); 3].map(|_| connect(&mut state, &[]));
+        let [b8, c8] = [b, c].map(|id| id as u8);
+        state.subscribe(a, 1);
+        update(&mut state, b, 1000, 1);
+        update(&mut state, c, 1000, 2);
+        assert_eq!(poll_zones(&mut state, a), [(b8, 1)]);
+
+        // the first state after b leaves the zone is sent so a can hide it, and nothing after that
+        update(&mut state, b, 1033, 2);
+        assert_eq!(poll_zones(&mut state, a), [(b8, 2)]);
+        update(&mut state, b, 1066, 2);
+        update(&mut state, c, 1033, 1);
+        assert_eq!(poll_zones(&mut state, a), [(c8, 1)]);
+
+        // subscribing to another zone resends the newest state of everyone in it
+        state.subscribe(a, 2);
+        assert_eq!(poll_zones(&mut state, a), [(b8, 2)]);
+        assert_eq!(poll_zones(&mut state, a), []);
+    }
+
+    #[test]
+    fn subscribing_forgets_baselines() {
+        let mut state = State::new();
+        let [a, b] = [(); 2].map(|_| connect(&mut state, &[delta::FEATURE]));
+        let addr = SocketAddr::from(([127, 0, 0, 1], 0));
+        state.update_delta(b, &keyframe_update(0, 1000, 0), addr).unwrap();
+        let Some(Reply::Delta(packets)) = state.update_delta(a, &keyframe_update(0, 1000, 0), addr)
+        else {
+            panic!("no reply to {a}");
+        };
+        let sent = u16::from_be_bytes([packets[0][0], packets[0][1]]);
+        state.update_delta(a, &keyframe_update(sent, 1033, 0), addr).unwrap();
+        assert_eq!(state.players[&a].delta.as_ref().unwrap().baselines[b as usize], Some(1000));
+
+        state.subscribe(a, 0);
+        let link = state.players[&a].delta.as_ref().unwrap();
+        assert!(link.baselines.iter().all(Option::is_none) && link.in_flight.is_empty());
+        // so b's next state goes to a as a keyframe
+        state.update_delta(b, &keyframe_update(0, 1033, 0), addr).unwrap();
+        state.update_delta(a, &keyframe_update(sent, 1066, 0), addr).unwrap();
+        assert_eq!(state.players[&a].delta.as_ref().unwrap().keyframes[b as usize], Some(1033));
+    }
+
+    #[test]
+    fn redundant_states_are_stored_once() {
+        let mut state = State::new();
+        let id = connect(&mut state, &[delta::FEATURE, delta::REDUNDANCY_FEATURE]);
+        let addr = SocketAddr::from(([127, 0, 0, 1], 0));
+        state.update_delta(id, &redundant_update(1000, &[]), addr).unwrap();
+        // 1033 was lost, 1000 and 1066 arrived
+        state.update_delta(id, &redundant_update(1066, &[1033, 1000]), addr).unwrap();
+        state.update_delta(id, &redundant_update(1100, &[1066, 1033, 1000]), addr).unwrap();
+
+        let player = &state.players[&id];
+        assert_eq!(player.states.keys().copied().collect::<Vec<_>>(), [1000, 1033, 1066, 1100]);
+        assert_eq!(player.recovered, 1);
+        assert_eq!(player.recovered_stored, 1);
+        assert!(player.states[&1033].recovered && !player.states[&1066].recovered);
+    }
+
+    /// Sends a keyframe from the player with this id and returns the senders of the states in the
+    /// packets it gets back, in order.
+    fn reply_senders(state: &mut State, id: u16, millis: u32) -> Vec<u16> {
+        let addr = SocketAddr::from(([127, 0, 0, 1], 0));
+        let Some(Reply::Delta(packets)) =
+            state.update_delta(id, &keyframe_update(0, millis, 0), addr)
+        else {
+            panic!("no reply to {id}");
+        };
+        let in_flight = &state.players[&id].delta.as_ref().unwrap().in_flight;
+        let mut senders: Vec<u16> = in_flight
+            .iter()
+            .rev()
+            .take(packets.len())
+            .flat_map(|packet| packet.states.iter().map(|(sender, _)| *sender))
+            .collect();
+        senders.sort();
+        senders
+    }
+
+    #[test]
+    fn players_without_wide_ids_never_see_them() {
+        let mut state = State::new();
+        let narrow_features = [delta::FEATURE];
+        let wide_features = [delta::FEATURE, delta::WIDE_IDS_FEATURE];
+        let info = |features: &[&str]| ConnectInfo {
+            color: [0; 3],
+            name: "player".to_string(),
+            features: features.iter().map(|feature| feature.to_string()).collect(),
+        };
+
+        // narrow ids go first, even to players with wide ids, until there are none left
+        let (narrow, mut narrow_rx, _, _) = state.connect(info(&narrow_features)).unwrap();
+        let mut wide: Vec<u16> =
+            (1..NARROW_IDS).map(|_| connect(&mut state, &wide_features)).collect();
+        assert!(narrow < NARROW_IDS && wide.iter().all(|id| *id < NARROW_IDS));
+        assert!(state.connect(info(&narrow_features)).is_none());
+        let mut others = Vec::new();
+        for _ in 0..10 {
+            let (id, _, players, _) = state.connect(info(&wide_features)).unwrap();
+            assert!((NARROW_IDS + 1..MAX_IDS).contains(&id));
+            wide.push(id);
+            others = players;
+        }
+        assert!(state.players.len() > NARROW_IDS as usize);
+
+        // players with wide ids hear of everyone, the narrow player only of narrow ids
+        assert_eq!(others.len(), state.players.len() - 1);
+        let mut joined = Vec::new();
+        while let Ok(message) = narrow_rx.try_recv() {
+            if let ServerMessage::PlayerJoined { id, .. } = message {
+                joined.push(id);
+            }
+        }
+        joined.sort();
+        let mut narrow_wide: Vec<u16> =
+            wide.iter().copied().filter(|id| *id < NARROW_IDS).collect();
+        narrow_wide.sort();
+        assert_eq!(joined, narrow_wide);
+
+        // and the same goes for their states. the last player to send gets everyone else's
+        assert!(reply_senders(&mut state, narrow, 1000).is_empty());
+        for id in &wide[..wide.len() - 1] {
+            reply_senders(&mut state, *id, 1000);
+        }
+        let last = *wide.last().unwrap();
+        let mut everyone_else: Vec<u16> =
+            state.players.keys().copied().filter(|id| *id != last).collect();
+        everyone_else.sort();
+        assert_eq!(reply_senders(&mut state, last, 1000), everyone_else);
+        assert_eq!(reply_senders(&mut state, narrow, 1033), narrow_wide);
+    }
+
+    /// Times a second of updates from this many players, all in the same place so every state is
+    /// sent to everyone, and returns how much of a core it takes.
+    fn load(players: usize) -> f64 {
+        let mut state = State::new();
+        let features = [delta::FEATURE, delta::WIDE_IDS_FEATURE, delta::ACK_MASK_FEATURE];
+        let ids: Vec<u16> = (0..players)
+            .map(|i| {
+                let info = ConnectInfo {
+                    color: [0; 3],
+                    name: format!("player {i}"),
+                    features: features.iter().map(|feature| feature.to_string()).collect(),
+                };
+                state.connect(info).unwrap().0
+            })
+            .collect();
+        let addr = SocketAddr::from(([127, 0, 0, 1], 0));
+        let mut acks = vec![0; players];
+
+        // the first second fills every player's states and baselines
+        let mut elapsed = Duration::ZERO;
+        for tick in 0..2 * SEND_RATE {
+            let started = Instant::now();
+            for (i, id) in ids.iter().enumerate() {
+                let millis = tick * 1000 / SEND_RATE + 1;
+                let update = keyframe_update(acks[i], millis, (tick as i32 + i as i32) * 8);
+                let Some(Reply::Delta(packets)) = state.update_delta(*id, &update, addr) else {
+                    panic!("no reply to {id}");
+                };
+                if let Some(last) = packets.last() {
+                    acks[i] = u16::from_be_bytes([last[0], last[1]]);
+                }
+            }
+            if tick >= SEND_RATE {
+                elapsed += started.elapsed();
+            }
+        }
+        elapsed.as_secs_f64()
+    }
+
+    /// Prints how much of a core each number of players up to MAX_PLAYERS takes, since every
+    /// update and reply happens under one lock. Run with --release --ignored --nocapture.
+    #[test]
+    #[ignore]
+    fn load_test() {
+        for players in (100..=MAX_PLAYERS).step_by(50) {
+            let core = load(players);
+            let per_update = core / (players as u32 * SEND_RATE) as f64 * 1e6;
+            let share = core * 100.0;
+            println!("{players} players: {per_update:.1} us per update, {share:.0}% of a core");
+        }
+        assert!(load(MAX_PLAYERS) < 1.0, "MAX_PLAYERS can't be kept up with on one core");
+    }
+
+    /// What a run of deliver sent the players.
+    #[derive(Default)]
+    struct Delivered {
+        bytes: usize,
+        packets: usize,
+        // a sample of each new state the way the client's Ghost::insert takes one: how old the
+        // state was when it arrived, plus the gap since the sender's state before it
+        delays: Vec<u32>,
+        newest: HashMap<(u16, u16), u32>,
+    }
+
+    impl Delivered {
+        /// Counts the packets just sent to the player with this id at now.
+        fn add(&mut self, state: &State, id: u16, packets: &[Vec<u8>], now: u32) {
+            self.bytes += packets.iter().map(Vec::len).sum::<usize>();
+            self.packets += packets.len();
+            let in_flight = &state.players[&id].delta.as_ref().unwrap().in_flight;
+            for packet in in_flight.iter().rev().take(packets.len()).rev() {
+                for (sender, millis) in &packet.states {
+                    let newest = self.newest.entry((id, *sender)).or_insert(*millis);
+                    self.delays.push(now - millis + (millis - *newest));
+                    *newest = *millis;
+                }
+            }
+        }
+
+        fn percentile(&mut self, percent: usize) -> u32 {
+            self.delays.sort_unstable();
+            self.delays[(self.delays.len() - 1) * percent / 100]
+        }
+    }
+
+    /// Runs this many players, each sending send_rate updates a second, for a simulated
+    /// measure_seconds after a second to fill their baselines, with states sent either in reply
+    /// to each update or in snapshots. Network delay is left out, so a state's delay is all
+    /// waiting for the receiver's next update or the next tick.
+    fn deliver(players: usize, send_rate: u32, measure_seconds: u32, snapshots: bool) -> Delivered {
+        let mut state = State::new();
+        let mut features = vec![delta::FEATURE, delta::ACK_MASK_FEATURE];
+        if snapshots {
+            features.push(snapshots::FEATURE);
+        }
+        let ids: Vec<u16> = (0..players).map(|_| connect(&mut state, &features)).collect();
+        // each player is sent its snapshots at an address of its own
+        let addrs: Vec<SocketAddr> =
+            (0..players).map(|i| SocketAddr::from(([127, 0, 0, 1], i as u16 + 1))).collect();
+        let interval = 1000 / send_rate;
+        let mut acks = vec![0; players];
+        let mut delivered = Delivered::default();
+        for now in 1..=(1 + measure_seconds) * 1000 {
+            let measured = now > 1000;
+            let mut sent = Vec::new();
+            for (i, id) in ids.iter().enumerate() {
+                // players send at evenly spread times within each interval
+                if (now + i as u32 * interval / players as u32) % interval != 0 {
+                    continue;
+                }
+                let update = keyframe_update(acks[i], now, now as i32);
+                let Some(Reply::Delta(packets)) = state.update_delta(*id, &update, addrs[i]) else {
+                    panic!("no reply to {id}");
+                };
+                sent.push((i, packets));
+            }
+            if snapshots && now % snapshots::TICK_MILLIS == 0 {
+                for (addr, packets) in state.snapshot() {
+                    sent.push((addrs.iter().position(|a| *a == addr).unwrap(), packets));
+                }
+            }
+            for (i, packets) in sent {
+                if let Some(last) = packets.last() {
+                    acks[i] = u16::from_be_bytes([last[0], last[1]]);
+                }
+                if measured {
+                    delivered.add(&state, ids[i], &packets, now);
+                }
+            }
+        }
+        delivered
+    }
+
+    /// Prints the bytes and packets each player is sent a second, and percentiles of the delay
+    /// samples its ghosts take, with states sent in replies and in snapshots at several send
+    /// rates. Run with --release --ignored --nocapture.
+    #[test]
+    #[ignore]
+    fn replies_vs_snapshots() {
+        const PLAYERS: usize = 20;
+        const SECONDS: u32 = 10;
+        let per_player = |count: usize| count as f64 / (PLAYERS as u32 * SECONDS) as f64;
+        println!("{PLAYERS} players: send rate, bytes/s, packets/s, delay p50/p95/p99 in ms");
+        for send_rate in [10, 20, 30, 60] {
+            for snapshots in [false, true] {
+                let mut delivered = deliver(PLAYERS, send_rate, SECONDS, snapshots);
+                let [p50, p95, p99] = [50, 95, 99].map(|percent| delivered.percentile(percent));
+                println!(
+                    "{send_rate:>3}/s {:>9}: {:>6.0} B/s {:>5.1} packets/s {p50:>3} {p95:>3} {p99:>3}",
+                    if snapshots { "snapshots" } else { "replies" },
+                    per_player(delivered.bytes),
+                    per_player(delivered.packets),
+                );
+            }
+        }
+    }
+}
@@ -0,0 +1,25 @@
+use crate::delta::{LOCATION_SCALE, Quantized};
+
+/// The feature clients ask for in Connect to be sent the states of far away players less often.
+pub const FEATURE: &str = "tiers";
+
+/// Tiers by distance from the receiver in world units, nearest first: other players within the
+/// distance are sent at most one state per the millis. Anyone beyond the last tier is in FAR_MILLIS.
+const TIERS: [(f32, u32); 2] = [(3000.0, 0), (10000.0, 100)];
+const FAR_MILLIS: u32 = 500;
+
+/// Returns how many millis apart states of a player at sender should be sent to a player at
+/// receiver, or 0 for every state. Players in different zones are always sent every state, since
+/// their distance means nothing and the zone subscription already decides what they get.
+pub fn interval(receiver: &Quantized, sender: &Quantized) -> u32 {
+    if receiver.zone != sender.zone {
+        return 0;
+    }
+    // in fixed point steps, squared, so no square root is needed
+    let distance_squared: f64 =
+        (0..3).map(|i| (receiver.location[i] as f64 - sender.location[i] as f64).powi(2)).sum();
+    TIERS
+        .iter()
+        .find(|(distance, _)| distance_squared <= ((distance * LOCATION_SCALE) as f64).powi(2))
+        .map_or(FAR_MILLIS, |(_, millis)| *millis)
+}